@@ -0,0 +1,175 @@
+#include "rvcc.h"
+
+//
+// 内存分配
+//
+// 各编译阶段的数据分别从对应的区域(arena)中分配：
+// 区域由若干块(chunk)组成，分配时仅需移动块内的指针，
+// 释放时整个区域一次性归还，无需逐个释放对象
+//
+
+// 默认块大小
+#define CHUNK_SIZE (64 * 1024)
+// 分配的对齐要求
+#define ARENA_ALIGN 16
+
+typedef struct Chunk Chunk;
+struct Chunk {
+  Chunk *next; // 上一个块
+  size_t cap;  // 块的可用容量
+  size_t used; // 已使用的字节数
+  // 此后紧跟块的数据
+};
+
+typedef struct {
+  Chunk *chunks;   // 当前块（链表头）
+  Chunk *free;     // 重置后留待复用的空块
+  size_t bytes;    // 已分配的字节数
+  size_t objects;  // 已分配的对象数
+  size_t reserved; // 向系统申请的总字节数
+} Arena;
+
+static _Thread_local Arena ARENAS[ARENA_NUM];
+
+static char *ARENA_NAMES[ARENA_NUM] = {
+    [ARENA_TOKEN] = "token",   [ARENA_AST] = "ast",
+    [ARENA_TYPE] = "type",     [ARENA_SYMBOL] = "symbol",
+    [ARENA_LOCAL] = "local",   [ARENA_STRING] = "string",
+};
+
+// 块中数据的起始地址
+static char *chunk_data(Chunk *chunk) {
+  return (char *)chunk + align_to(sizeof(Chunk), ARENA_ALIGN);
+}
+
+// 申请一个新块，至少能容纳 size 字节
+static Chunk *new_chunk(Arena *arena, size_t size) {
+  // 优先复用重置后留下的空块，其中的数据已清零
+  for (Chunk **p = &arena->free; *p; p = &(*p)->next) {
+    Chunk *chunk = *p;
+    if (chunk->cap < size)
+      continue;
+    *p = chunk->next;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    return chunk;
+  }
+
+  size_t cap = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+  size_t total = align_to(sizeof(Chunk), ARENA_ALIGN) + cap;
+
+  // calloc 保证了块内数据全部为0
+  Chunk *chunk = calloc(1, total);
+  if (!chunk)
+    error("out of memory");
+  chunk->cap = cap;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->reserved += total;
+  return chunk;
+}
+
+// 从 kind 对应的区域中分配 size 字节，内容全部为0
+void *arena_alloc(ArenaKind kind, size_t size) {
+  Arena *arena = &ARENAS[kind];
+  size = align_to(size, ARENA_ALIGN);
+
+  Chunk *chunk = arena->chunks;
+  if (!chunk || chunk->cap - chunk->used < size)
+    chunk = new_chunk(arena, size);
+
+  void *ptr = chunk_data(chunk) + chunk->used;
+  chunk->used += size;
+  arena->bytes += size;
+  arena->objects++;
+  return ptr;
+}
+
+// 在字符串区域中复制 s 的前 n 个字符，并以'\0'结尾
+char *arena_strndup(char *s, size_t n) {
+  char *buf = arena_alloc(ARENA_STRING, n + 1);
+  memcpy(buf, s, n);
+  return buf;
+}
+
+// 一次性释放 kind 对应区域中的所有对象
+void arena_release(ArenaKind kind) {
+  Arena *arena = &ARENAS[kind];
+  for (Chunk *chunk = arena->chunks, *next; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  for (Chunk *chunk = arena->free, *next; chunk; chunk = next) {
+    next = chunk->next;
+    free(chunk);
+  }
+  *arena = (Arena){};
+}
+
+// 清空 kind 对应区域中的所有对象，但保留已申请的块，
+// 之后的分配直接复用，无需再向系统申请
+void arena_reset(ArenaKind kind) {
+  Arena *arena = &ARENAS[kind];
+  for (Chunk *chunk = arena->chunks, *next; chunk; chunk = next) {
+    next = chunk->next;
+    memset(chunk_data(chunk), 0, chunk->used);
+    chunk->used = 0;
+    chunk->next = arena->free;
+    arena->free = chunk;
+  }
+  arena->chunks = NULL;
+  arena->bytes = arena->objects = 0;
+}
+
+// 从一个线程取出、交由另一个线程接管的区域
+struct ArenaSet {
+  Arena arenas[ARENA_NUM];
+};
+
+// 取出当前线程所有区域中的内存，当前线程的区域随之清空
+// 工作线程退出前取出，其中分配的对象由发起的线程接管后继续使用
+ArenaSet *arena_detach(void) {
+  ArenaSet *set = malloc(sizeof(ArenaSet));
+  if (!set)
+    error("out of memory");
+  memcpy(set->arenas, ARENAS, sizeof(ARENAS));
+  memset(ARENAS, 0, sizeof(ARENAS));
+  return set;
+}
+
+// 将块链表 list 接在 *pos 之前
+static void splice_chunks(Chunk **pos, Chunk *list) {
+  if (!list)
+    return;
+  Chunk *tail = list;
+  while (tail->next)
+    tail = tail->next;
+  tail->next = *pos;
+  *pos = list;
+}
+
+// 当前线程接管 set 中的内存，之后随当前线程的区域一起重置或释放
+void arena_attach(ArenaSet *set) {
+  for (int i = 0; i < ARENA_NUM; i++) {
+    Arena *arena = &ARENAS[i], *from = &set->arenas[i];
+    // 接管的块接在当前块之后，当前块中剩余的空间仍可继续分配
+    splice_chunks(arena->chunks ? &arena->chunks->next : &arena->chunks,
+                  from->chunks);
+    splice_chunks(&arena->free, from->free);
+    arena->bytes += from->bytes;
+    arena->objects += from->objects;
+    arena->reserved += from->reserved;
+  }
+  free(set);
+}
+
+// 输出各区域的对象数、已分配字节数及向系统申请的字节数
+void arena_print_stats(FILE *out) {
+  fprintf(out, "%-8s %12s %12s %12s\n", "arena", "objects", "bytes",
+          "reserved");
+  for (int i = 0; i < ARENA_NUM; i++) {
+    Arena *arena = &ARENAS[i];
+    fprintf(out, "%-8s %12zu %12zu %12zu\n", ARENA_NAMES[i], arena->objects,
+            arena->bytes, arena->reserved);
+  }
+}
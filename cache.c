@@ -0,0 +1,458 @@
+#include "rvcc.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// 编译缓存
+//
+// 以输入文件的内容、文件名、编译选项及格式版本的 SHA-256 为键，
+// 将生成的汇编或目标文件存入缓存目录。缓存项同时记录本次编译读取的
+// 所有源文件的设备号、inode、大小及修改时间，命中时逐个检查，
+// 头文件变化后缓存即失效。
+//
+// 写入时先写临时文件再重命名；读取时映射(mmap)缓存文件并直接写出。
+// 命中时更新缓存文件的修改时间，缓存总大小超出上限时删除最久未用的项
+//
+// 整个文件未命中时，还按函数缓存各函数生成的代码(.fn)，
+// 键由语法分析根据函数定义的终结符计算，内容的格式由代码生成决定
+//
+
+// 缓存文件的格式版本，格式或生成的代码变化时递增
+#define OUTPUT_CACHE_VERSION 2
+#define FUNCTION_CACHE_VERSION 1
+
+// 缓存文件头，之后依次为 依赖的源文件、输出
+typedef struct {
+  char magic[8];      // "RVCCOUT"
+  uint32_t version;   // 格式版本
+  uint32_t ndeps;     // 依赖的源文件数量
+  uint64_t deps_size; // 依赖部分的字节数
+  uint64_t out_size;  // 输出的字节数
+} OutputCacheHeader;
+
+// 依赖的源文件，之后为文件名，补齐到 8 字节
+typedef struct {
+  uint64_t dev;       // 设备号
+  uint64_t ino;       // inode
+  uint64_t size;      // 大小
+  int64_t mtime_sec;  // 修改时间(秒)
+  int64_t mtime_nsec; // 修改时间(纳秒)
+  uint32_t name_len;  // 文件名的长度
+  uint32_t pad;
+} CacheDep;
+
+// 函数缓存文件头，之后为函数的代码
+typedef struct {
+  char magic[8];    // "RVCCFN"
+  uint32_t version; // 格式版本
+  uint32_t pad;
+  uint64_t size; // 代码的字节数
+} FunctionCacheHeader;
+
+static char OUTPUT_CACHE_MAGIC[8] = "RVCCOUT";
+static char FUNCTION_CACHE_MAGIC[8] = "RVCCFN";
+
+// 编译缓存的目录(--cache-dir)
+_Thread_local char *OPT_CACHE_DIR;
+// 编译缓存的大小上限(--cache-size)
+_Thread_local size_t OPT_CACHE_SIZE = DEFAULT_CACHE_SIZE;
+
+//
+// SHA-256
+//
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+void sha256_init(Sha256 *s) {
+  static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+  memcpy(s->state, init, sizeof(init));
+  s->len = 0;
+}
+
+// 处理一个 64 字节的块
+static void sha256_block(Sha256 *s, const uint8_t *p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t)p[i * 4] << 24 | p[i * 4 + 1] << 16 | p[i * 4 + 2] << 8 |
+           p[i * 4 + 3];
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = s->state[0], b = s->state[1], c = s->state[2], d = s->state[3];
+  uint32_t e = s->state[4], f = s->state[5], g = s->state[6], h = s->state[7];
+  for (int i = 0; i < 64; i++) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                  ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                  ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  s->state[0] += a;
+  s->state[1] += b;
+  s->state[2] += c;
+  s->state[3] += d;
+  s->state[4] += e;
+  s->state[5] += f;
+  s->state[6] += g;
+  s->state[7] += h;
+}
+
+void sha256_update(Sha256 *s, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  size_t used = s->len % 64;
+  s->len += len;
+
+  // 先补满上次剩余的块
+  if (used) {
+    size_t n = 64 - used < len ? 64 - used : len;
+    memcpy(s->block + used, p, n);
+    p += n;
+    len -= n;
+    if (used + n < 64)
+      return;
+    sha256_block(s, s->block);
+  }
+
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_block(s, p);
+  memcpy(s->block, p, len);
+}
+
+void sha256_final(Sha256 *s, uint8_t out[32]) {
+  uint64_t bits = s->len * 8;
+  uint8_t pad[72] = {0x80};
+  size_t used = s->len % 64;
+  size_t n = used < 56 ? 56 - used : 120 - used;
+  for (int i = 0; i < 8; i++)
+    pad[n + i] = bits >> (56 - i * 8);
+  sha256_update(s, pad, n + 8);
+  for (int i = 0; i < 8; i++)
+    for (int j = 0; j < 4; j++)
+      out[i * 4 + j] = s->state[i] >> (24 - j * 8);
+}
+
+//
+// 缓存项
+//
+
+// 返回键对应的缓存文件的路径，ext 为缓存项的种类
+static char *entry_path(CacheKey *key, char *ext) {
+  char hex[65];
+  for (int i = 0; i < 32; i++)
+    sprintf(hex + i * 2, "%02x", key->hash[i]);
+  return format("%s/%s.%s", resolve_path(OPT_CACHE_DIR), hex, ext);
+}
+
+// 计算 path 的编译缓存的键，flags 为影响输出的编译选项
+// 文件无法读取时返回 false
+bool cache_key(char *path, char *flags, CacheKey *key) {
+  if (!strcmp(path, "-"))
+    return false;
+  FILE *in = fopen(resolve_path(path), "r");
+  if (!in)
+    return false;
+
+  Sha256 s;
+  sha256_init(&s);
+  uint32_t version = OUTPUT_CACHE_VERSION;
+  sha256_update(&s, OUTPUT_CACHE_MAGIC, sizeof(OUTPUT_CACHE_MAGIC));
+  sha256_update(&s, &version, sizeof(version));
+  // 各字段都以 '\0' 结尾，不同的组合不会得到相同的输入
+  sha256_update(&s, flags, strlen(flags) + 1);
+  int npaths;
+  char **paths = get_include_paths(&npaths);
+  for (int i = 0; i < npaths; i++)
+    sha256_update(&s, paths[i], strlen(paths[i]) + 1);
+  sha256_update(&s, path, strlen(path) + 1);
+
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+    sha256_update(&s, buf, n);
+  bool ok = !ferror(in);
+  fclose(in);
+  sha256_final(&s, key->hash);
+  return ok;
+}
+
+// 依赖的文件名补齐到 8 字节后的长度
+static size_t dep_size(uint32_t name_len) {
+  return sizeof(CacheDep) + align_to(name_len, 8);
+}
+
+// 检查依赖的源文件是否都未改变
+static bool deps_unchanged(char *p, char *end, uint32_t ndeps) {
+  for (uint32_t i = 0; i < ndeps; i++) {
+    CacheDep *dep = (CacheDep *)p;
+    if (end - p < sizeof(CacheDep) || end - p < dep_size(dep->name_len))
+      return false;
+    char *name = strndup(p + sizeof(CacheDep), dep->name_len);
+    struct stat st;
+    bool same = name && stat(resolve_path(name), &st) == 0 &&
+                dep->dev == st.st_dev && dep->ino == st.st_ino &&
+                dep->size == st.st_size &&
+                dep->mtime_sec == st.st_mtim.tv_sec &&
+                dep->mtime_nsec == st.st_mtim.tv_nsec;
+    free(name);
+    if (!same)
+      return false;
+    p += dep_size(dep->name_len);
+  }
+  return p == end;
+}
+
+// 读取 len 字节，文件不完整时返回 false
+static bool read_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// 查找缓存，命中时 hit 指向映射中缓存的输出
+bool cache_load(CacheKey *key, CacheHit *hit) {
+  char *path = entry_path(key, "out");
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(OutputCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  OutputCacheHeader *h = (OutputCacheHeader *)map;
+  size_t body = st.st_size - sizeof(OutputCacheHeader);
+  if (memcmp(h->magic, OUTPUT_CACHE_MAGIC, sizeof(h->magic)) ||
+      h->version != OUTPUT_CACHE_VERSION || h->deps_size > body ||
+      h->out_size != body - h->deps_size ||
+      !deps_unchanged(map + sizeof(*h), map + sizeof(*h) + h->deps_size,
+                      h->ndeps)) {
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  // 更新修改时间，记录最近一次使用
+  utimensat(AT_FDCWD, path, NULL, 0);
+
+  *hit = (CacheHit){
+      .map = map,
+      .map_size = st.st_size,
+      .data = map + sizeof(*h) + h->deps_size,
+      .len = h->out_size,
+  };
+  return true;
+}
+
+// 释放命中的缓存项
+void cache_release(CacheHit *hit) { munmap(hit->map, hit->map_size); }
+
+// 缓存目录中的一项
+typedef struct {
+  char *name;
+  off_t size;
+  struct timespec mtime;
+} CacheFile;
+
+static int by_mtime(const void *a, const void *b) {
+  struct timespec x = ((CacheFile *)a)->mtime;
+  struct timespec y = ((CacheFile *)b)->mtime;
+  if (x.tv_sec != y.tv_sec)
+    return x.tv_sec < y.tv_sec ? -1 : 1;
+  return (x.tv_nsec > y.tv_nsec) - (x.tv_nsec < y.tv_nsec);
+}
+
+// 缓存总大小超出上限时，按修改时间从旧到新删除缓存项
+static void evict(char *dir) {
+  DIR *d = opendir(dir);
+  if (!d)
+    return;
+
+  CacheFile *files = NULL;
+  int len = 0, cap = 0;
+  size_t total = 0;
+  for (struct dirent *ent; (ent = readdir(d));) {
+    char *ext = strrchr(ent->d_name, '.');
+    if (!ext || (strcmp(ext, ".out") && strcmp(ext, ".fn")))
+      continue;
+    char *name = format("%s/%s", dir, ent->d_name);
+    struct stat st;
+    if (stat(name, &st) != 0)
+      continue;
+    if (len == cap) {
+      cap = cap ? cap * 2 : 64;
+      CacheFile *p = realloc(files, sizeof(CacheFile) * cap);
+      if (!p)
+        break;
+      files = p;
+    }
+    files[len++] = (CacheFile){name, st.st_size, st.st_mtim};
+    total += st.st_size;
+  }
+  closedir(d);
+
+  if (total > OPT_CACHE_SIZE) {
+    qsort(files, len, sizeof(CacheFile), by_mtime);
+    for (int i = 0; i < len && total > OPT_CACHE_SIZE; i++)
+      if (unlink(files[i].name) == 0)
+        total -= files[i].size;
+  }
+  free(files);
+}
+
+// 依次写出 parts 作为缓存文件 path 的内容
+// 先写入临时文件再重命名，其他线程或进程不会读到写了一半的缓存项；
+// 缓存只用于加速，写入失败时直接忽略
+static void write_entry(char *path, struct iovec *parts, int n) {
+  mkdir(resolve_path(OPT_CACHE_DIR), 0777);
+  char *tmp = format("%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd < 0)
+    return;
+
+  FILE *file = fdopen(fd, "wb");
+  if (!file) {
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  bool ok = true;
+  for (int i = 0; i < n; i++)
+    ok = ok && fwrite(parts[i].iov_base, 1, parts[i].iov_len, file) ==
+                   parts[i].iov_len;
+  if (fclose(file) != 0 || !ok || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+
+// 将本次编译的输出存入缓存，依赖为本次编译读取的所有源文件
+void cache_store(CacheKey *key, char *buf, size_t len) {
+  char *deps = NULL;
+  size_t deps_size = 0;
+  FILE *out = open_memstream(&deps, &deps_size);
+  if (!out)
+    return;
+
+  uint32_t ndeps = 0;
+  for (int i = 1; source_file_name(i); i++) {
+    char *name = source_file_name(i);
+    struct stat st;
+    if (!strcmp(name, "-") || stat(resolve_path(name), &st) != 0) {
+      fclose(out);
+      free(deps);
+      return;
+    }
+    CacheDep dep = {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .size = st.st_size,
+        .mtime_sec = st.st_mtim.tv_sec,
+        .mtime_nsec = st.st_mtim.tv_nsec,
+        .name_len = strlen(name),
+    };
+    fwrite(&dep, sizeof(dep), 1, out);
+    fwrite(name, 1, dep.name_len, out);
+    fwrite((char[8]){}, 1, align_to(dep.name_len, 8) - dep.name_len, out);
+    ndeps++;
+  }
+  fclose(out);
+
+  OutputCacheHeader h = {};
+  memcpy(h.magic, OUTPUT_CACHE_MAGIC, sizeof(h.magic));
+  h.version = OUTPUT_CACHE_VERSION;
+  h.ndeps = ndeps;
+  h.deps_size = deps_size;
+  h.out_size = len;
+
+  struct iovec parts[] = {{&h, sizeof(h)}, {deps, deps_size}, {buf, len}};
+  write_entry(entry_path(key, "out"), parts, 3);
+  free(deps);
+
+  // 每次编译只检查一次总大小，函数缓存项也在此一并淘汰
+  evict(resolve_path(OPT_CACHE_DIR));
+}
+
+// 命中的函数缓存的修改时间早于该秒数时才更新
+// 每个函数都更新修改时间的开销与读取缓存相当，淘汰只需粗略的先后
+#define FUNCTION_CACHE_TOUCH_SEC 3600
+
+// 查找函数缓存，命中时 *buf 指向读入的缓存内容，随区域一起释放
+bool cache_load_function(CacheKey *key, char **buf, size_t *len) {
+  char *path = entry_path(key, "fn");
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  // 一次读入整个缓存文件
+  struct stat st;
+  FunctionCacheHeader *h = NULL;
+  bool ok = fstat(fd, &st) == 0 && st.st_size >= sizeof(*h);
+  if (ok) {
+    h = arena_alloc(ARENA_SYMBOL, st.st_size);
+    ok = read_all(fd, h, st.st_size) &&
+         !memcmp(h->magic, FUNCTION_CACHE_MAGIC, sizeof(h->magic)) &&
+         h->version == FUNCTION_CACHE_VERSION &&
+         h->size == st.st_size - sizeof(*h);
+  }
+  close(fd);
+  if (!ok)
+    return false;
+
+  *buf = (char *)(h + 1);
+  *len = h->size;
+  if (time(NULL) - st.st_mtim.tv_sec > FUNCTION_CACHE_TOUCH_SEC)
+    utimensat(AT_FDCWD, path, NULL, 0);
+  return true;
+}
+
+// 将一个函数生成的代码存入函数缓存
+void cache_store_function(CacheKey *key, char *buf, size_t len) {
+  FunctionCacheHeader h = {};
+  memcpy(h.magic, FUNCTION_CACHE_MAGIC, sizeof(h.magic));
+  h.version = FUNCTION_CACHE_VERSION;
+  h.size = len;
+  struct iovec parts[] = {{&h, sizeof(h)}, {buf, len}};
+  write_entry(entry_path(key, "fn"), parts, 2);
+}
@@ -1,15 +1,194 @@
 #include "rvcc.h"
+#include <elf.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 //
 // 三、语义分析,生成代码
 //
 
-static void gen_expr(Node *node);
-static void gen_stmt(Node *node);
+// 是否省略汇编中的注释及重复的 .loc(--terse)
+_Thread_local bool OPT_TERSE;
+// 是否直接生成目标文件(-c)
+_Thread_local bool OPT_C;
+// 是否将每个函数放入单独的代码节(-ffunction-sections)
+_Thread_local bool OPT_FUNCTION_SECTIONS;
+// 是否将每个全局变量及每个函数的字符串字面量放入单独的节(-fdata-sections)
+_Thread_local bool OPT_DATA_SECTIONS;
 
 // 输出文件
-static FILE *OUTPUT_FILE;
+static _Thread_local FILE *OUTPUT_FILE;
+
+// (0) 输出缓冲区
+// 生成的汇编先写入按块分配的缓冲区，累积到一定大小后由 writev 一次写出，
+// 避免逐行调用 stdio；缓冲区的块在写出后重复使用
+
+// 缓冲区每块的大小
+#define OUT_CHUNK_SIZE (256 * 1024)
+// 缓冲区累积到该大小后，在函数之间写出
+#define OUT_FLUSH_SIZE (4 * 1024 * 1024)
+// writev 一次最多写出的块数，不超过系统的 IOV_MAX
+#define OUT_MAX_IOV 1024
+
+typedef struct {
+  char **chunks; // 所有块
+  int nchunks;   // 块的数量
+  int cur;       // 当前写入的块
+  size_t used;   // 当前块已使用的字节数
+} OutBuf;
+
+static _Thread_local OutBuf OUT;
+
+// 当前块剩余的空间不足 n 字节时切换到下一块
+static char *out_reserve(size_t n) {
+  if (OUT.nchunks && OUT_CHUNK_SIZE - OUT.used >= n)
+    return OUT.chunks[OUT.cur] + OUT.used;
+
+  if (OUT.nchunks)
+    OUT.cur++;
+  if (OUT.cur == OUT.nchunks) {
+    OUT.chunks = realloc(OUT.chunks, sizeof(char *) * (OUT.nchunks + 1));
+    OUT.chunks[OUT.nchunks] = malloc(OUT_CHUNK_SIZE);
+    if (!OUT.chunks || !OUT.chunks[OUT.nchunks])
+      error("out of memory");
+    OUT.nchunks++;
+  }
+  OUT.used = 0;
+  return OUT.chunks[OUT.cur];
+}
+
+// 输出 len 个字符
+static void out_write(char *s, size_t len) {
+  while (len > 0) {
+    char *p = out_reserve(1);
+    size_t n = OUT_CHUNK_SIZE - OUT.used;
+    if (n > len)
+      n = len;
+    memcpy(p, s, n);
+    OUT.used += n;
+    s += n;
+    len -= n;
+  }
+}
+
+// 输出一个字符
+static void out_char(char c) {
+  *out_reserve(1) = c;
+  OUT.used++;
+}
+
+// 输出十进制整数
+static void out_int(long val) {
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  unsigned long u = val < 0 ? -(unsigned long)val : val;
+  do {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (val < 0)
+    *--p = '-';
+  out_write(p, buf + sizeof(buf) - p);
+}
+
+// 缓冲区中已累积的字节数
+static size_t out_size(void) {
+  return OUT.nchunks ? (size_t)OUT.cur * OUT_CHUNK_SIZE + OUT.used : 0;
+}
+
+// 将缓冲区中的所有块写出到输出文件
+static void flush_output(void) {
+  if (!OUT.nchunks)
+    return;
+
+  struct iovec iov[OUT.cur + 1];
+  for (int i = 0; i <= OUT.cur; i++) {
+    iov[i].iov_base = OUT.chunks[i];
+    iov[i].iov_len = i < OUT.cur ? OUT_CHUNK_SIZE : OUT.used;
+  }
+
+  // 输出文件可能已有 stdio 缓冲的内容
+  fflush(OUTPUT_FILE);
+  int fd = fileno(OUTPUT_FILE);
+
+  // 内存中的输出流(open_memstream)没有文件描述符
+  if (fd < 0) {
+    for (int i = 0; i <= OUT.cur; i++)
+      fwrite(iov[i].iov_base, 1, iov[i].iov_len, OUTPUT_FILE);
+    OUT.cur = 0;
+    OUT.used = 0;
+    return;
+  }
+
+  struct iovec *v = iov;
+  int n = OUT.cur + 1;
+  while (n > 0) {
+    ssize_t written = writev(fd, v, n < OUT_MAX_IOV ? n : OUT_MAX_IOV);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      error("write failed: %s", strerror(errno));
+    }
+
+    // 跳过已写出的部分，未写完的块从剩余处继续
+    while (n > 0 && (size_t)written >= v->iov_len) {
+      written -= v->iov_len;
+      v++;
+      n--;
+    }
+    if (n > 0) {
+      v->iov_base = (char *)v->iov_base + written;
+      v->iov_len -= written;
+    }
+  }
+
+  OUT.cur = 0;
+  OUT.used = 0;
+}
+
+// 输出格式化字符串
+// 只支持 %d, %s, %c，无需经过 vfprintf 解析格式
+static void vprint(char *fmt, va_list va) {
+  for (char *p = fmt; *p; p++) {
+    if (*p != '%') {
+      char *start = p;
+      while (p[1] && p[1] != '%')
+        p++;
+      out_write(start, p - start + 1);
+      continue;
+    }
+
+    switch (*++p) {
+    case 'd':
+      out_int(va_arg(va, int));
+      break;
+    case 's': {
+      char *s = va_arg(va, char *);
+      out_write(s, strlen(s));
+      break;
+    }
+    case 'c':
+      out_char(va_arg(va, int));
+      break;
+    case '%':
+      out_char('%');
+      break;
+    default:
+      unreachable();
+    }
+  }
+}
+
+// 输出格式化字符串
+static void print(char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  vprint(fmt, va);
+  va_end(va);
+}
 
 // 输出格式化字符串并换行
 static void println(char *fmt, ...) {
@@ -17,19 +196,356 @@ static void println(char *fmt, ...) {
 
   // 初始化 va 变量，fmt是最后一个固定参数
   va_start(va, fmt);
-  vfprintf(OUTPUT_FILE, fmt, va);
+  vprint(fmt, va);
   // 清理 va 变量
   va_end(va);
+  out_char('\n');
+}
+
+// 输出注释，--terse 及 -c 时省略
+static void comment(char *fmt, ...) {
+  if (OPT_TERSE || OPT_C)
+    return;
+
+  va_list va;
+  va_start(va, fmt);
+  vprint(fmt, va);
+  va_end(va);
+  out_char('\n');
+}
+
+// 函数的代码中的 .loc
+typedef struct {
+  uint32_t off; // 在函数的代码中的位置
+  int file_no;  // 文件编号，与函数定义位于同一文件时为 0
+  int line;     // 行号，与函数定义位于同一文件时为相对于定义起始处的行号
+} CachedLoc;
+
+// 记录正在生成的函数中的 .loc
+typedef struct {
+  bool on;         // 是否正在记录，记录时 .loc 不写入输出
+  size_t start;    // 函数的代码在输出缓冲区中的起始位置
+  int file_no;     // 函数定义所在的文件
+  int line;        // 函数定义起始处的行号
+  CachedLoc *locs; // 已记录的 .loc
+  int len;         // 已记录的数量
+  int cap;         // locs 的容量
+} LocRecorder;
+
+static _Thread_local LocRecorder REC;
+
+// 记录位于当前输出位置的 .loc
+static void record_loc(int file_no, int line) {
+  if (REC.len == REC.cap) {
+    REC.cap = REC.cap ? REC.cap * 2 : 64;
+    REC.locs = realloc(REC.locs, sizeof(CachedLoc) * REC.cap);
+    if (!REC.locs)
+      error("out of memory");
+  }
+
+  CachedLoc *loc = &REC.locs[REC.len++];
+  loc->off = out_size() - REC.start;
+  loc->file_no = file_no == REC.file_no ? 0 : file_no;
+  loc->line = file_no == REC.file_no ? line - REC.line : line;
+}
+
+// 最近一次输出的 .loc 的文件编号及行号
+static _Thread_local int LAST_LOC_FILE;
+static _Thread_local int LAST_LOC_LINE;
+
+// 输出 .loc <文件编号> 行号，--terse 时省略与上一次相同的 .loc
+// -c 生成的目标文件不含调试信息
+static void emit_loc(SrcLoc loc) {
+  if (OPT_C)
+    return;
+
+  int file_no = srcloc_file_no(loc);
+  int line = srcloc_line(loc);
+  if (OPT_TERSE && file_no == LAST_LOC_FILE && line == LAST_LOC_LINE)
+    return;
+
+  LAST_LOC_FILE = file_no;
+  LAST_LOC_LINE = line;
+  if (REC.on)
+    record_loc(file_no, line);
+  else
+    println("  .loc %d %d", file_no, line);
+}
+
+// 已输出 .file 的源文件数量
+static _Thread_local int FILE_NAMES_LEN;
+
+// 为尚未输出的源文件输出 .file <文件编号> <文件名>
+// 流式生成时文件在解析过程中才被包含，因此每个函数之前都需检查
+static void emit_file_names(void) {
+  if (OPT_C)
+    return;
+
+  char *name;
+  while ((name = source_file_name(FILE_NAMES_LEN + 1)))
+    println(".file %d \"%s\"", ++FILE_NAMES_LEN, name);
+}
+
+// 指令
+// 以下函数输出一条汇编指令、伪指令或伪操作；
+// -c 时不输出文本，而是编码后写入目标文件
+
+// 寄存器编号
+typedef enum {
+  ZERO = 0,
+  RA = 1,
+  SP = 2,
+  FP = 8,
+  A0 = 10,
+  A1,
+  A2,
+  A3,
+  A4,
+  A5,
+} Reg;
+
+static char *REG_NAMES[] = {
+    [ZERO] = "zero", [RA] = "ra", [SP] = "sp", [FP] = "fp", [A0] = "a0",
+    [A1] = "a1",     [A2] = "a2", [A3] = "a3", [A4] = "a4", [A5] = "a5",
+};
+
+// 各节对应的伪操作
+static char *SECTION_DIRECTIVES[] = {
+    [SEC_TEXT] = ".text",
+    [SEC_DATA] = ".data",
+    [SEC_BSS] = ".bss",
+    [SEC_RODATA] = ".section .rodata",
+};
 
-  fprintf(OUTPUT_FILE, "\n");
+// 单独的节的名称前缀、属性及类型
+// 节名为 <前缀>.<符号名>，链接器可以按节丢弃未被引用的函数及数据
+typedef struct {
+  char *prefix; // 名称前缀
+  char *flags;  // 属性
+  char *type;   // 类型
+} SectionAttr;
+
+static SectionAttr SECTION_ATTRS[] = {
+    [SEC_TEXT] = {".text", "ax", "progbits"},
+    [SEC_DATA] = {".data", "aw", "progbits"},
+    [SEC_BSS] = {".bss", "aw", "nobits"},
+    [SEC_RODATA] = {".rodata.str", "a", "progbits"},
+};
+
+// op rd, rs1, rs2
+static void emit_op(char *op, uint32_t code, Reg rd, Reg rs1, Reg rs2) {
+  if (OPT_C)
+    obj_inst(rv_r(code, rd, rs1, rs2));
+  else
+    println("  %s %s, %s, %s", op, REG_NAMES[rd], REG_NAMES[rs1],
+            REG_NAMES[rs2]);
+}
+
+// op rd, rs1, imm
+static void emit_opi(char *op, uint32_t code, Reg rd, Reg rs1, int imm) {
+  if (OPT_C)
+    obj_inst(rv_i(code, rd, rs1, imm));
+  else
+    println("  %s %s, %s, %d", op, REG_NAMES[rd], REG_NAMES[rs1], imm);
+}
+
+// op rd, off(base)
+static void emit_load(char *op, uint32_t code, Reg rd, int off, Reg base) {
+  if (OPT_C)
+    obj_inst(rv_i(code, rd, base, off));
+  else
+    println("  %s %s, %d(%s)", op, REG_NAMES[rd], off, REG_NAMES[base]);
+}
+
+// op rs, off(base)
+static void emit_store(char *op, uint32_t code, Reg rs, int off, Reg base) {
+  if (OPT_C)
+    obj_inst(rv_s(code, rs, base, off));
+  else
+    println("  %s %s, %d(%s)", op, REG_NAMES[rs], off, REG_NAMES[base]);
+}
+
+// 伪指令 op rd, rs，对应的指令为 inst
+static void emit_pseudo(char *op, Reg rd, Reg rs, uint32_t inst) {
+  if (OPT_C)
+    obj_inst(inst);
+  else
+    println("  %s %s, %s", op, REG_NAMES[rd], REG_NAMES[rs]);
+}
+
+// li rd, val
+static void emit_li(Reg rd, int val) {
+  if (!OPT_C) {
+    println("  li %s, %d", REG_NAMES[rd], val);
+    return;
+  }
+
+  if (-2048 <= val && val < 2048) {
+    obj_inst(rv_i(RV_ADDI, rd, ZERO, val));
+    return;
+  }
+  // lui 载入高20位，addiw 加上有符号的低12位
+  int lo = ((val & 0xfff) ^ 0x800) - 0x800;
+  obj_inst(rv_u(RV_LUI, rd, ((int64_t)val - lo) >> 12));
+  if (lo)
+    obj_inst(rv_i(RV_ADDIW, rd, rd, lo));
+}
+
+// 已生成的 auipc 标签数量
+static _Thread_local int PCREL_COUNT;
+
+// la rd, sym
+static void emit_la(Reg rd, char *sym) {
+  if (!OPT_C) {
+    println("  la %s, %s", REG_NAMES[rd], sym);
+    return;
+  }
+
+  // auipc 载入相对于 pc 的高20位，addi 的低12位重定位引用 auipc 处的标签
+  char *hi = format(".Lpcrel_hi%d", PCREL_COUNT++);
+  obj_label(hi);
+  obj_reloc(R_RISCV_PCREL_HI20, sym);
+  obj_inst(rv_u(RV_AUIPC, rd, 0));
+  obj_reloc(R_RISCV_PCREL_LO12_I, hi);
+  obj_inst(rv_i(RV_ADDI, rd, rd, 0));
+}
+
+// call sym
+static void emit_call(char *sym) {
+  if (!OPT_C) {
+    println("  call %s", sym);
+    return;
+  }
+
+  obj_reloc(R_RISCV_CALL, sym);
+  obj_inst(rv_u(RV_AUIPC, RA, 0));
+  obj_inst(rv_i(RV_JALR, RA, RA, 0));
+}
+
+// ret
+static void emit_ret(void) {
+  if (OPT_C)
+    obj_inst(rv_i(RV_JALR, ZERO, RA, 0));
+  else
+    println("  ret");
+}
+
+// 格式化标签名的缓冲区
+static _Thread_local char *LABEL_BUF;
+static _Thread_local int LABEL_CAP;
+
+// 按 fmt 格式化标签名，结果在下一次调用前有效
+static char *label_name(char *fmt, va_list va) {
+  va_list va2;
+  va_copy(va2, va);
+  int len = vsnprintf(LABEL_BUF, LABEL_CAP, fmt, va);
+  if (len >= LABEL_CAP) {
+    LABEL_CAP = len + 1;
+    LABEL_BUF = realloc(LABEL_BUF, LABEL_CAP);
+    if (!LABEL_BUF)
+      error("out of memory");
+    vsnprintf(LABEL_BUF, LABEL_CAP, fmt, va2);
+  }
+  va_end(va2);
+  return LABEL_BUF;
+}
+
+// 定义标签，标签名由 fmt 格式化得到
+static void emit_label(char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  if (OPT_C) {
+    obj_label(label_name(fmt, va));
+  } else {
+    vprint(fmt, va);
+    out_write(":\n", 2);
+  }
+  va_end(va);
+}
+
+// j 标签
+static void emit_j(char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  if (OPT_C) {
+    obj_reloc(R_RISCV_JAL, label_name(fmt, va));
+    obj_inst(rv_j(RV_JAL, ZERO, 0));
+  } else {
+    print("  j ");
+    vprint(fmt, va);
+    out_char('\n');
+  }
+  va_end(va);
+}
+
+// beqz rs, 标签
+static void emit_beqz(Reg rs, char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  if (OPT_C) {
+    obj_reloc(R_RISCV_BRANCH, label_name(fmt, va));
+    obj_inst(rv_b(RV_BEQ, rs, ZERO, 0));
+  } else {
+    print("  beqz %s, ", REG_NAMES[rs]);
+    vprint(fmt, va);
+    out_char('\n');
+  }
+  va_end(va);
+}
+
+// 切换到节 kind，suffix 不为 NULL 时切换到其中单独的节 <前缀>.<suffix>
+static void emit_section(SectionKind kind, char *suffix) {
+  if (!suffix) {
+    if (OPT_C)
+      obj_section(kind);
+    else
+      println("  %s", SECTION_DIRECTIVES[kind]);
+    return;
+  }
+
+  SectionAttr *attr = &SECTION_ATTRS[kind];
+  char *name = format("%s.%s", attr->prefix, suffix);
+  if (OPT_C)
+    obj_named_section(kind, name);
+  else
+    println("  .section %s,\"%s\",@%s", name, attr->flags, attr->type);
+}
+
+// .globl sym
+static void emit_globl(char *sym) {
+  if (OPT_C)
+    obj_global(sym);
+  else
+    println("  .globl %s", sym);
+}
+
+// .type sym, @function | @object
+static void emit_type(char *sym, bool is_func) {
+  if (OPT_C)
+    obj_type(sym, is_func);
+  else
+    println("  .type %s, @%s", sym, is_func ? "function" : "object");
+}
+
+// .size sym, .-sym
+static void emit_size(char *sym) {
+  if (OPT_C)
+    obj_size(sym);
+  else
+    println("  .size %s, .-%s", sym, sym);
 }
 
 // (1) 函数
 
 // 参数寄存器
-static char *func_arg_regs[] = {"a0", "a1", "a2", "a3", "a4", "a5"};
+static Reg func_arg_regs[] = {A0, A1, A2, A3, A4, A5};
 // 当前函数
-static Object *CUR_FUNC;
+static _Thread_local Object *CUR_FUNC;
+// 当前函数的节点池
+static _Thread_local NodePool *CUR_POOL;
+
+// 返回当前函数的节点
+static Node *get_node(NodeId id) { return node_at(CUR_POOL, id); }
 
 // (2) 栈
 // 生成的代码中,利用栈保存中间数据
@@ -38,160 +554,223 @@ static Object *CUR_FUNC;
 // 当前预设数据长度为 64bit/8byte
 
 // 当前分析代码的栈深度
-static int STACK_DEPTH;
+static _Thread_local int STACK_DEPTH;
 
 // 压栈
 // 将 a0 寄存器中的值压入栈中
 static void push(void) {
-  println("  # 压栈, 将a0的值存入栈顶");
-  println("  addi sp, sp, -8");
-  println("  sd a0, 0(sp)");
+  comment("  # 压栈, 将a0的值存入栈顶");
+  emit_opi("addi", RV_ADDI, SP, SP, -8);
+  emit_store("sd", RV_SD, A0, 0, SP);
   STACK_DEPTH++;
 }
 
 // 出栈
 // 将栈顶的数据弹出到寄存器 reg 中
-static void pop(char *reg) {
-  println("  # 弹栈, 将栈顶的值存入%s", reg);
-  println("  ld %s, 0(sp)", reg);
-  println("  addi sp, sp, 8");
+static void pop(Reg reg) {
+  comment("  # 弹栈, 将栈顶的值存入%s", REG_NAMES[reg]);
+  emit_load("ld", RV_LD, reg, 0, SP);
+  emit_opi("addi", RV_ADDI, SP, SP, 8);
   STACK_DEPTH--;
 }
 
+// 当前函数中已生成的代码段编号
+// 标签名中含有函数名，各函数分别编号，一个函数的变化不会改变其他函数的标签
+static _Thread_local int LABEL_COUNT;
+
 // 每次调用都会生成一个新的 count
 // 用来区分不同的代码段
-static int count(void) {
-  static int I = 1;
-  return I++;
-}
+static int count(void) { return ++LABEL_COUNT; }
 
 // 将 n 对其到 align 的整数倍
-static int align_to(int n, int align) {
+int align_to(int n, int align) {
   return (n + align - 1) / align * align;
 }
 
-// 为链表中每个 Function 计算本地变量偏移及栈大小
-static void assign_local_val_offsets(Object *prog) {
+// 计算函数的本地变量偏移及栈大小
+static void assign_local_val_offsets(Object *f) {
+  int offset = 0;
 
-  for (Object *f = prog; f; f = f->next) {
-    if (!f->is_function)
-      continue;
+  // 计算每个 local var 相对于栈顶的偏移
+  for (Object *var = f->locals; var; var = var->next) {
+    offset += var->type->size;
+    var->offset = -offset;
+  }
 
-    int offset = 0;
+  // 计算栈的长度,并对齐到 16
+  f->stack_size = align_to(offset, 16);
+}
 
-    // 计算每个 local var 相对于栈顶的偏移
-    for (Object *var = f->locals; var; var = var->next) {
-      offset += var->type->size;
-      var->offset = -offset;
-    }
+// a0 中保存了一个地址
+// 将此地址的值加载到 a0 中
+static void load(Type *type) {
+  if (type->kind == TY_ARRAY)
+    return;
+  comment("  # 读取a0中存放的地址, 得到的值存入a0");
+  if (type->size == 1)
+    emit_load("lb", RV_LB, A0, 0, A0);
+  else
+    emit_load("ld", RV_LD, A0, 0, A0);
+}
+
+// 栈保存了一个地址
+// 将此地址 pop 到 a1 中
+// 将 a0 中的值保存到此地址
+static void store(Type *type) {
+  pop(A1);
+  comment("  # 将a0的值, 写入到 a1 中存放的地址");
+  if (type->size == 1)
+    emit_store("sb", RV_SB, A0, 0, A1);
+  else
+    emit_store("sd", RV_SD, A0, 0, A1);
+}
 
-    // 计算栈的长度,并对齐到 16
-    f->stack_size = align_to(offset, 16);
+// (3) 工作栈
+// 代码生成不在本机栈上递归，而是将待处理的节点压入显式的工作栈，
+// 每个工作项记录节点、生成方式及处理进度，因此可以处理任意深度的语法树
+//
+// 处理某个节点时，若需要先生成子节点，则将自身连同下一步的进度压栈，
+// 再将子节点压栈；子节点处理完毕后，从记录的进度处继续
+
+typedef enum {
+  GEN_EXPR, // 计算表达式，结果存入 a0
+  GEN_ADDR, // 计算地址，结果存入 a0
+  GEN_STMT, // 生成语句
+} GenMode;
+
+typedef struct {
+  NodeId id;    // 节点
+  GenMode mode; // 生成方式
+  int step;     // 处理进度，0 表示刚开始处理该节点
+  int label;    // 分支、循环语句的标签编号
+} GenItem;
+
+static _Thread_local GenItem *WORK;
+static _Thread_local int WORK_LEN;
+static _Thread_local int WORK_CAP;
+
+// 压入一个工作项
+static void push_work(NodeId id, GenMode mode, int step, int label) {
+  if (WORK_LEN == WORK_CAP) {
+    WORK_CAP = WORK_CAP ? WORK_CAP * 2 : 256;
+    WORK = realloc(WORK, sizeof(GenItem) * WORK_CAP);
+    if (!WORK)
+      error("out of memory");
   }
+  WORK[WORK_LEN++] = (GenItem){id, mode, step, label};
+}
+
+// 先生成子节点 child，完成后从进度 step 处继续处理 item
+static void resume_after(GenItem *item, int step, NodeId child, GenMode mode) {
+  push_work(item->id, item->mode, step, item->label);
+  push_work(child, mode, 0, 0);
+}
+
+// 按顺序生成节点的所有子节点
+static void push_kids(Node *node, GenMode mode) {
+  // 逆序压栈，使第一个子节点最先出栈
+  for (int i = node->nkids - 1; i >= 0; i--)
+    push_work(node_kid(CUR_POOL, node, i), mode, 0, 0);
 }
 
 // 计算给定节点的内存地址
 // 将地址保存在 a0 寄存器中
-static void gen_addr(Node *node) {
+static void addr_step(GenItem *item) {
+  Node *node = get_node(item->id);
 
   switch (node->kind) {
   case ND_VAR: // Object var 为指针, 在 prog 中被修改后, 同时也能从 Node 访问
     if (node->var->is_local) { // local var
-      println("  # 获取变量%s的栈内地址为%d(fp)", node->var->name,
+      comment("  # 获取变量%s的栈内地址为%d(fp)", node->var->name,
               node->var->offset);
-      println("  addi a0, fp, %d", node->var->offset);
+      emit_opi("addi", RV_ADDI, A0, FP, node->var->offset);
     } else { // global var
-      println("  # 获取全局变量%s的地址", node->var->name);
+      comment("  # 获取全局变量%s的地址", node->var->name);
       // la 指令是一个伪指令，将 %s symbol 标记的内存地址加载到 a0 中
-      println("  la a0, %s", node->var->name);
+      emit_la(A0, node->var->name);
     }
     return;
   case ND_DEREF: // 对一个解引用expr进行取地址
-    gen_expr(node->lhs);
+    push_work(node->lhs, GEN_EXPR, 0, 0);
     return;
   default:
     break;
   }
 
-  error_token(node->token, "not an lvalue");
-}
-
-// a0 中保存了一个地址
-// 将此地址的值加载到 a0 中
-static void load(Type *type) {
-  if (type->kind == TY_ARRAY)
-    return;
-  println("  # 读取a0中存放的地址, 得到的值存入a0");
-  if (type->size == 1)
-    println("  lb a0, 0(a0)");
-  else
-    println("  ld a0, 0(a0)");
-}
-
-// 栈保存了一个地址
-// 将此地址 pop 到 a1 中
-// 将 a0 中的值保存到此地址
-static void store(Type *type) {
-  pop("a1");
-  println("  # 将a0的值, 写入到 a1 中存放的地址");
-  if (type->size == 1)
-    println("sb a0, 0(a1)");
-  else
-    println("  sd a0, 0(a1)");
+  error_srcloc(node->loc, "not an lvalue");
 }
 
-// 词法分析
-// 生成代码
-void gen_expr(Node *node) {
-  // .loc <文件编号> 行号
-  println("  .loc 1 %d", node->token->line);
+// 生成表达式的一步
+static void expr_step(GenItem *item) {
+  Node *node = get_node(item->id);
+  if (item->step == 0) {
+    // .loc <文件编号> 行号
+    emit_loc(node->loc);
+  }
 
   switch (node->kind) {
   case ND_NUM:
     // 若根节点为数字(叶子节点), 则只加载到 a0 寄存器中
-    println("  # 将%d加载到a0中", node->val);
-    println("  li a0, %d", node->val);
+    comment("  # 将%d加载到a0中", node->val);
+    emit_li(A0, node->val);
     return;
   case ND_NEG:
     // 一元运算符子为单臂二叉树,子节点保留在左侧
-    // 因此向左递归直到遇到数字
-    gen_expr(node->lhs);
-    println("  # 对a0值进行取反");
-    println("  neg a0, a0");
+    if (item->step == 0) {
+      resume_after(item, 1, node->lhs, GEN_EXPR);
+      return;
+    }
+    comment("  # 对a0值进行取反");
+    emit_pseudo("neg", A0, A0, rv_r(RV_SUB, A0, ZERO, A0));
     return;
   case ND_ADDR:
     // 计算单臂指向的变量的地址，保存到 a0 中
-    gen_addr(node->lhs);
+    push_work(node->lhs, GEN_ADDR, 0, 0);
     return;
   case ND_DEREF:
-    // 解引用向右递归
-    gen_expr(node->lhs);
+    // 先计算指针的值，再解引用
+    if (item->step == 0) {
+      resume_after(item, 1, node->lhs, GEN_EXPR);
+      return;
+    }
     load(node->type);
     return;
   case ND_VAR:
-    gen_addr(node);
+    if (item->step == 0) {
+      resume_after(item, 1, item->id, GEN_ADDR);
+      return;
+    }
     load(node->type);
     return;
   case ND_ASSIGN:
-    // 左值
-    gen_addr(node->lhs);
-    push();
-    // 右值
-    gen_expr(node->rhs);
-    store(node->type);
-    return;
+    switch (item->step) {
+    case 0:
+      // 左值
+      resume_after(item, 1, node->lhs, GEN_ADDR);
+      return;
+    case 1:
+      push();
+      // 右值
+      resume_after(item, 2, node->rhs, GEN_EXPR);
+      return;
+    default:
+      store(node->type);
+      return;
+    }
   case ND_STMT_EXPR:
-    for (Node *n = node->body; n; n = n->next)
-      gen_stmt(n);
+    push_kids(node, GEN_STMT);
     return;
   case ND_FNCALL: {
-    int argc = 0;
+    int argc = node->nkids;
 
     // 遍历所有参数，并将参数逐个压入栈中
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      gen_expr(arg);
+    // 进度 i 表示前 i 个参数已经计算完毕
+    if (item->step > 0)
       push();
-      argc++;
+    if (item->step < argc) {
+      resume_after(item, item->step + 1, node_kid(CUR_POOL, node, item->step),
+                   GEN_EXPR);
+      return;
     }
 
     // 上述指令执行完毕时，参数必然按顺序放置在栈上
@@ -200,8 +779,10 @@ void gen_expr(Node *node) {
       pop(func_arg_regs[i]);
     }
 
-    println("  # 调用函数%s", node->func_name);
-    println("  call %s", node->func_name);
+    // 函数名称为调用处的标识符
+    char *func_name = srcloc_ident(node->loc);
+    comment("  # 调用函数%s", func_name);
+    emit_call(func_name);
 
     return;
   }
@@ -209,145 +790,257 @@ void gen_expr(Node *node) {
     break;
   }
 
-  // 递归右节点
-  gen_expr(node->rhs);
-  // 右侧的结果保存在 a0 中,压入到栈
-  push();
-  // 递归左节点
-  gen_expr(node->lhs);
+  switch (item->step) {
+  case 0:
+    // 先计算右节点
+    resume_after(item, 1, node->rhs, GEN_EXPR);
+    return;
+  case 1:
+    // 右侧的结果保存在 a0 中,压入到栈
+    push();
+    // 再计算左节点
+    resume_after(item, 2, node->lhs, GEN_EXPR);
+    return;
+  default:
+    break;
+  }
+
   // 左侧结果保存在 a0 中
-  // 同时由于左侧计算完毕,栈回到递归右侧完毕时的状态
+  // 同时由于左侧计算完毕,栈回到计算右侧完毕时的状态
   // 即栈顶的就是右子树的结果
-  pop("a1");
+  pop(A1);
 
   // 此时 a0 保存了 lhs 的结果,而 a1 保存了 rhs 的结果
   switch (node->kind) {
   case ND_ADD:
-    println("  # a0+a1,结果写入a0");
-    println("  add a0, a0, a1");
+    comment("  # a0+a1,结果写入a0");
+    emit_op("add", RV_ADD, A0, A0, A1);
     return;
   case ND_SUB:
-    println("  # a0-a1,结果写入a0");
-    println("  sub a0, a0, a1");
+    comment("  # a0-a1,结果写入a0");
+    emit_op("sub", RV_SUB, A0, A0, A1);
     return;
   case ND_MUL:
-    println("  # a0×a1,结果写入a0");
-    println("  mul a0, a0, a1");
+    comment("  # a0×a1,结果写入a0");
+    emit_op("mul", RV_MUL, A0, A0, A1);
     return;
   case ND_DIV:
-    println("  # a0÷a1,结果写入a0");
-    println("  div a0, a0, a1");
+    comment("  # a0÷a1,结果写入a0");
+    emit_op("div", RV_DIV, A0, A0, A1);
     return;
   case ND_EQ:
   case ND_NE:
-    println("  # 判断是否a0%sa1", node->kind == ND_EQ ? "=" : "≠");
-    println("  xor a0, a0 ,a1");
+    comment("  # 判断是否a0%sa1", node->kind == ND_EQ ? "=" : "≠");
+    emit_op("xor", RV_XOR, A0, A0, A1);
     if (node->kind == ND_EQ) {
       // a0 = 1 if a0 = 0
-      println("  seqz a0, a0");
+      emit_pseudo("seqz", A0, A0, rv_i(RV_SLTIU, A0, A0, 1));
     } else {
       // a0 = 1 if a0 != 0
-      println("  snez a0, a0");
+      emit_pseudo("snez", A0, A0, rv_r(RV_SLTU, A0, ZERO, A0));
     }
     return;
   case ND_LT:
-    println("  # 判断a0<a1");
-    println("  slt a0, a0, a1");
+    comment("  # 判断a0<a1");
+    emit_op("slt", RV_SLT, A0, A0, A1);
     return;
   case ND_LE:
     // a0 <= a1 == !(a1 < a0) == (a1 < a0) xor 1
-    println("  # 判断是否a0≤a1");
-    println("  slt a0, a1, a0");
-    println("xori a0, a0, 1");
+    comment("  # 判断是否a0≤a1");
+    emit_op("slt", RV_SLT, A0, A1, A0);
+    emit_opi("xori", RV_XORI, A0, A0, 1);
     return;
   default:
     break;
   }
-  error_token(node->token, "invalid expression");
+  error_srcloc(node->loc, "invalid expression");
 }
 
-static void gen_stmt(Node *node) {
-  // .loc <文件编号> 行号
-  println("  .loc 1 %d", node->token->line);
+// 生成语句的一步
+static void stmt_step(GenItem *item) {
+  Node *node = get_node(item->id);
+  if (item->step == 0) {
+    // .loc <文件编号> 行号
+    emit_loc(node->loc);
+  }
 
   switch (node->kind) {
   case ND_EXPR_STMT:
-    gen_expr(node->lhs);
+    push_work(node->lhs, GEN_EXPR, 0, 0);
     return;
   case ND_RETURN:
-    println("# 返回语句");
-    gen_expr(node->lhs);
-    println("  # 跳转到.L.return.%s段", CUR_FUNC->name);
-    println("  j .L.return.%s", CUR_FUNC->name);
+    if (item->step == 0) {
+      comment("# 返回语句");
+      resume_after(item, 1, node->lhs, GEN_EXPR);
+      return;
+    }
+    comment("  # 跳转到.L.return.%s段", CUR_FUNC->name);
+    emit_j(".L.return.%s", CUR_FUNC->name);
     return;
   case ND_BLOCK:
-    for (Node *n = node->body; n; n = n->next) {
-      gen_stmt(n);
-    }
+    push_kids(node, GEN_STMT);
     return;
   case ND_IF: {
-    int c = count();
-
-    // condition
-    println("\n# =====分支语句%d==============", c);
-    println("\n# cond表达式%d", c);
-    gen_expr(node->cond);
-    println("  # 若a0为0,则跳转到分支%d的.L.else.%d段", c, c);
-    println("  beqz a0, .L.else.%d", c);
-
-    println("\n# Then语句%d", c);
-    gen_stmt(node->then);
-    println("\n# Else语句%d", c);
-    println("# 分支%d的.L.else.%d段标签", c, c);
-    println("  j .L.end.%d", c);
-
-    // else 逻辑
-    println(".L.else.%d:", c);
-    if (node->els)
-      gen_stmt(node->els);
+    switch (item->step) {
+    case 0:
+      item->label = count();
+      // condition
+      comment("\n# =====分支语句%d==============", item->label);
+      comment("\n# cond表达式%d", item->label);
+      resume_after(item, 1, node_kid(CUR_POOL, node, KID_COND), GEN_EXPR);
+      return;
+    case 1: {
+      int c = item->label;
+      comment("  # 若a0为0,则跳转到分支%d的.L.else.%d段", c, c);
+      emit_beqz(A0, ".L.else.%s.%d", CUR_FUNC->name, c);
+
+      comment("\n# Then语句%d", c);
+      resume_after(item, 2, node_kid(CUR_POOL, node, KID_THEN), GEN_STMT);
+      return;
+    }
+    case 2: {
+      int c = item->label;
+      comment("\n# Else语句%d", c);
+      comment("# 分支%d的.L.else.%d段标签", c, c);
+      emit_j(".L.end.%s.%d", CUR_FUNC->name, c);
+
+      // else 逻辑
+      emit_label(".L.else.%s.%d", CUR_FUNC->name, c);
+      NodeId els = node_kid(CUR_POOL, node, KID_ELS);
+      if (els) {
+        resume_after(item, 3, els, GEN_STMT);
+        return;
+      }
+      break;
+    }
+    default:
+      break;
+    }
     // end 标签
-    println("\n# 分支%d的.L.end.%d段标签", c, c);
-    println(".L.end.%d:", c);
+    int c = item->label;
+    comment("\n# 分支%d的.L.end.%d段标签", c, c);
+    emit_label(".L.end.%s.%d", CUR_FUNC->name, c);
     return;
   }
   case ND_FOR: { // 生成 for 或 while 循环代码
-    int c = count();
+    NodeId init = node_kid(CUR_POOL, node, KID_INIT);
+    NodeId cond = node_kid(CUR_POOL, node, KID_COND);
+    NodeId inc = node_kid(CUR_POOL, node, KID_INC);
 
-    println("\n# =====循环语句%d===============", c);
-    if (node->init) {
-      println("\n# Init语句%d", c);
-      gen_stmt(node->init);
-    }
-
-    println("\n# 循环%d的.L.begin.%d段标签", c, c);
-    println(".L.begin.%d:", c);
-    // 循环条件
-    if (node->cond) {
-      println("# Cond表达式%d", c);
-      gen_expr(node->cond);
-      println("  # 若a0为0,则跳转到循环%d的.L.end.%d段", c, c);
-      println("  beqz a0, .L.end.%d", c);
-    }
+    switch (item->step) {
+    case 0:
+      item->label = count();
+      comment("\n# =====循环语句%d===============", item->label);
+      if (init) {
+        comment("\n# Init语句%d", item->label);
+        resume_after(item, 1, init, GEN_STMT);
+        return;
+      }
+      // fallthrough
+    case 1:
+      comment("\n# 循环%d的.L.begin.%d段标签", item->label, item->label);
+      emit_label(".L.begin.%s.%d", CUR_FUNC->name, item->label);
+      // 循环条件
+      if (cond) {
+        comment("# Cond表达式%d", item->label);
+        resume_after(item, 2, cond, GEN_EXPR);
+        return;
+      }
+      // fallthrough
+    case 2:
+      if (cond) {
+        comment("  # 若a0为0,则跳转到循环%d的.L.end.%d段", item->label,
+                item->label);
+        emit_beqz(A0, ".L.end.%s.%d", CUR_FUNC->name, item->label);
+      }
 
-    println("\n# Then语句%d", c);
-    gen_stmt(node->then);
-    // 循环递增语句
-    if (node->inc) {
-      println("\n# Inc语句%d", c);
-      gen_expr(node->inc);
+      comment("\n# Then语句%d", item->label);
+      resume_after(item, 3, node_kid(CUR_POOL, node, KID_THEN), GEN_STMT);
+      return;
+    case 3:
+      // 循环递增语句
+      if (inc) {
+        comment("\n# Inc语句%d", item->label);
+        resume_after(item, 4, inc, GEN_EXPR);
+        return;
+      }
+      // fallthrough
+    default:
+      break;
     }
 
-    println("  # 跳转到循环%d的.L.begin.%d段", c, c);
-    println("  j .L.begin.%d", c);
-    println("\n# 循环%d的.L.end.%d段标签", c, c);
-    println(".L.end.%d:", c);
+    int c = item->label;
+    comment("  # 跳转到循环%d的.L.begin.%d段", c, c);
+    emit_j(".L.begin.%s.%d", CUR_FUNC->name, c);
+    comment("\n# 循环%d的.L.end.%d段标签", c, c);
+    emit_label(".L.end.%s.%d", CUR_FUNC->name, c);
     return;
   }
   default:
     break;
   }
 
-  error_token(node->token, "invalid statement");
+  error_srcloc(node->loc, "invalid statement");
+}
+
+// 生成以 id 为根的子树，直到工作栈中只剩下调用前已有的工作项
+static void gen(NodeId id, GenMode mode) {
+  int base = WORK_LEN;
+  push_work(id, mode, 0, 0);
+
+  while (WORK_LEN > base) {
+    GenItem item = WORK[--WORK_LEN];
+    switch (item.mode) {
+    case GEN_EXPR:
+      expr_step(&item);
+      break;
+    case GEN_ADDR:
+      addr_step(&item);
+      break;
+    case GEN_STMT:
+      stmt_step(&item);
+      break;
+    }
+  }
+}
+
+// 生成语句
+static void gen_stmt(NodeId id) { gen(id, GEN_STMT); }
+
+// 生成字符串字面量 var，suffix 为单独的节名的后缀
+static void emit_string(Object *var, char *suffix) {
+  // 字符串字面量放入只读数据段
+  emit_section(SEC_RODATA, suffix);
+  emit_label("%s", var->name);
+  if (OPT_C) {
+    obj_bytes(var->init_data, var->type->size);
+    return;
+  }
+  // 将初始值内容进行打印
+  for (int i = 0; i < var->type->size; i++) {
+    char c = var->init_data[i];
+    if (isprint(c) && !OPT_TERSE)
+      println("  .byte %d\t# 字符:  %c", c, c);
+    else
+      println("  .byte %d", c);
+  }
+}
+
+static void emit_cached_data(Object *f);
+
+// 生成函数 f 中的所有字符串字面量
+static void emit_literals(Object *f) {
+  if (f->cached) {
+    emit_cached_data(f);
+    return;
+  }
+
+  // -fdata-sections 时各函数的字符串字面量在一个单独的节中，随函数一起保留
+  char *suffix = OPT_DATA_SECTIONS ? f->name : NULL;
+  for (Object *var = f->literals; var; var = var->next) {
+    comment("\n  # 数据段标签");
+    emit_string(var, suffix);
+  }
 }
 
 // 生成 .data 段
@@ -355,30 +1048,423 @@ static void gen_stmt(Node *node) {
 // 存放 全局变量
 static void emit_data(Object *prog) {
   for (Object *var = prog; var; var = var->next) {
-    if (var->is_function)
+    // 字符串字面量随所在的函数一起生成
+    if (var->is_function) {
+      emit_literals(var);
       continue;
+    }
 
-    println("\n  # 数据段标签");
-    println("  .data");
-
-    // 判断变量是否有初始值
-    if (var->init_data) {
-      println("%s:", var->name);
-      // 将初始值内容进行打印
-      for (int i = 0; i < var->type->size; i++) {
-        char c = var->init_data[i];
-        if (isprint(c))
-          println("  .byte %d\t# 字符:  %c", c, c);
-        else
-          println("  .byte %d", c);
-      }
-    } else {
-      println("  .globl %s", var->name);
-      println("  # 全局变量%s", var->name);
-      println("%s:", var->name);
-      println("  # 零填充%d位", var->type->size);
+    comment("\n  # 数据段标签");
+    emit_section(SEC_BSS, OPT_DATA_SECTIONS ? var->name : NULL);
+    if (!var->is_static)
+      emit_globl(var->name);
+    comment("  # 全局变量%s", var->name);
+    if (OPT_DATA_SECTIONS)
+      emit_type(var->name, false);
+    emit_label("%s", var->name);
+    comment("  # 零填充%d位", var->type->size);
+    if (OPT_C)
+      obj_zero(var->type->size);
+    else
       println("  .zero %d", var->type->size);
+    if (OPT_DATA_SECTIONS)
+      emit_size(var->name);
+  }
+}
+
+// 生成函数 f 的代码
+static void emit_function_code(Object *f) {
+  comment("  # 定义全局%s段", f->name);
+  if (!f->is_static)
+    emit_globl(f->name);
+  emit_section(SEC_TEXT, OPT_FUNCTION_SECTIONS ? f->name : NULL);
+  comment("# =====%s段开始===============", f->name);
+  comment("# %s段标签", f->name);
+  if (OPT_FUNCTION_SECTIONS)
+    emit_type(f->name, true);
+  emit_label("%s", f->name);
+
+  CUR_FUNC = f;
+  CUR_POOL = f->pool;
+  LAST_LOC_FILE = LAST_LOC_LINE = 0;
+  LABEL_COUNT = 0;
+
+  // 栈布局
+  //-------------------------------// sp
+  //              ra
+  //-------------------------------// ra = sp-8
+  //              fp
+  //-------------------------------// fp = sp-16
+  //             变量
+  //-------------------------------// sp = sp-16-StackSize
+  //           表达式计算
+  //-------------------------------//
+
+  // Prologue
+  emit_opi("addi", RV_ADDI, SP, SP, -16);
+  comment("  # 将ra压栈");
+  emit_store("sd", RV_SD, RA, 8, SP);
+
+  comment("  # 将fp压栈,fp属于“被调用者保存”的寄存器,需要恢复原值");
+  emit_store("sd", RV_SD, FP, 0, SP);
+
+  comment("  # 将sp的值写入fp");
+  emit_pseudo("mv", FP, SP, rv_i(RV_ADDI, FP, SP, 0));
+
+  comment("  # sp腾出StackSize大小的栈空间");
+  emit_opi("addi", RV_ADDI, SP, SP, -f->stack_size);
+
+  int i = 0;
+  for (Object *var = f->params; var; var = var->next) {
+    comment("  # 将%s寄存器的值存入%s的栈地址", REG_NAMES[func_arg_regs[i]],
+            var->name);
+    if (var->type->size == 1)
+      emit_store("sb", RV_SB, func_arg_regs[i++], var->offset, FP);
+    else
+      emit_store("sd", RV_SD, func_arg_regs[i++], var->offset, FP);
+  }
+
+  comment("\n# =====%s段主体===============", f->name);
+  gen_stmt(f->body);
+  assert(STACK_DEPTH == 0);
+
+  // Epilogue
+  comment("\n# =====%s段结束===============", f->name);
+  comment("# %s return段标签", f->name);
+  emit_label(".L.return.%s", f->name);
+
+  comment("  # 将fp的值写回sp");
+  emit_pseudo("mv", SP, FP, rv_i(RV_ADDI, SP, FP, 0));
+
+  comment("  # 恢复fp、ra和sp");
+  emit_load("ld", RV_LD, FP, 0, SP);
+  emit_load("ld", RV_LD, RA, 8, SP);
+  emit_opi("addi", RV_ADDI, SP, SP, 16);
+
+  comment("  # 返回a0值给系统调用");
+  emit_ret();
+
+  // 分支都跳转到函数内的标签，函数结束时即可全部解析
+  if (OPT_C)
+    obj_resolve();
+  if (OPT_FUNCTION_SECTIONS)
+    emit_size(f->name);
+}
+
+// (4) 函数缓存
+//
+// 缓存的代码依次为 CachedCode、.loc 记录、字符串字面量的数据、函数的代码。
+// 函数的代码中不含 .loc，写出时按函数定义当前的位置重新生成，
+// 因此之前的代码增删行后，函数仍可使用缓存
+
+typedef struct {
+  uint32_t nlocs;    // .loc 的数量
+  uint32_t data_len; // 字符串字面量的数据的长度
+  uint32_t text_len; // 函数的代码的长度
+  uint32_t pad;
+} CachedCode;
+
+// 返回缓存的代码中的各部分
+static CachedLoc *cached_locs(char *buf) {
+  return (CachedLoc *)(buf + sizeof(CachedCode));
+}
+static char *cached_data(char *buf) {
+  return (char *)(cached_locs(buf) + ((CachedCode *)buf)->nlocs);
+}
+static char *cached_text(char *buf) {
+  return cached_data(buf) + ((CachedCode *)buf)->data_len;
+}
+
+// 写出函数 f 缓存的字符串字面量
+static void emit_cached_data(Object *f) {
+  out_write(cached_data(f->cached), ((CachedCode *)f->cached)->data_len);
+}
+
+// 写出缓存的函数代码，按函数 f 定义当前的位置生成 .loc
+static void emit_cached_text(Object *f, char *buf) {
+  CachedCode *code = (CachedCode *)buf;
+  CachedLoc *locs = cached_locs(buf);
+  char *text = cached_text(buf);
+  int file_no = srcloc_file_no(f->def_loc);
+  int line = srcloc_line(f->def_loc);
+
+  uint32_t pos = 0;
+  for (uint32_t i = 0; i < code->nlocs; i++) {
+    out_write(text + pos, locs[i].off - pos);
+    pos = locs[i].off;
+    if (locs[i].file_no)
+      println("  .loc %d %d", locs[i].file_no, locs[i].line);
+    else
+      println("  .loc %d %d", file_no, line + locs[i].line);
+  }
+  out_write(text + pos, code->text_len - pos);
+}
+
+// 将缓冲区中 [start, end) 的内容复制到 dst
+static void out_copy(size_t start, size_t end, char *dst) {
+  while (start < end) {
+    size_t off = start % OUT_CHUNK_SIZE;
+    size_t n = OUT_CHUNK_SIZE - off;
+    if (n > end - start)
+      n = end - start;
+    memcpy(dst, OUT.chunks[start / OUT_CHUNK_SIZE] + off, n);
+    dst += n;
+    start += n;
+  }
+}
+
+// 丢弃缓冲区中 pos 之后的内容
+static void out_truncate(size_t pos) {
+  if (!OUT.nchunks)
+    return;
+  // 恰好位于块的末尾时仍停留在该块，下一次写入时再切换
+  OUT.cur = pos ? (pos - 1) / OUT_CHUNK_SIZE : 0;
+  OUT.used = pos - (size_t)OUT.cur * OUT_CHUNK_SIZE;
+}
+
+// 生成函数 f 的代码并存入函数缓存
+// 生成的内容先按缓存的格式取出，再与命中缓存时一样写出，两者的结果必然相同
+static void cache_function(Object *f) {
+  size_t start = out_size();
+  emit_literals(f);
+  size_t data_end = out_size();
+
+  REC = (LocRecorder){
+      .on = true,
+      .start = data_end,
+      .file_no = srcloc_file_no(f->def_loc),
+      .line = srcloc_line(f->def_loc),
+      .locs = REC.locs,
+      .cap = REC.cap,
+  };
+  emit_function_code(f);
+  REC.on = false;
+  size_t end = out_size();
+
+  CachedCode code = {
+      .nlocs = REC.len,
+      .data_len = data_end - start,
+      .text_len = end - data_end,
+  };
+  size_t locs_size = sizeof(CachedLoc) * REC.len;
+  size_t len = sizeof(code) + locs_size + (end - start);
+  char *buf = malloc(len);
+  if (!buf)
+    error("out of memory");
+  memcpy(buf, &code, sizeof(code));
+  memcpy(cached_locs(buf), REC.locs, locs_size);
+  out_copy(start, end, cached_data(buf));
+
+  // 字符串字面量仍在数据段中生成，此处只写出函数的代码
+  out_truncate(start);
+  cache_store_function(f->cache_key, buf, len);
+  emit_cached_text(f, buf);
+  free(buf);
+}
+
+// 查找函数 func 的缓存，命中时记录在 func->cached 中
+bool codegen_load_cached(Object *func) {
+  char *buf;
+  size_t len;
+  if (!cache_load_function(func->cache_key, &buf, &len))
+    return false;
+
+  // 检查缓存的代码是否完整
+  CachedCode *code = (CachedCode *)buf;
+  if (len < sizeof(CachedCode) ||
+      len != sizeof(CachedCode) + sizeof(CachedLoc) * code->nlocs +
+                 code->data_len + code->text_len)
+    return false;
+  CachedLoc *locs = cached_locs(buf);
+  for (uint32_t i = 0; i < code->nlocs; i++)
+    if (locs[i].off > code->text_len || (i && locs[i].off < locs[i - 1].off))
+      return false;
+
+  func->cached = buf;
+  func->cached_len = len;
+  return true;
+}
+
+// 生成函数 f，开启函数缓存时使用或存入缓存
+static void emit_function(Object *f) {
+  if (f->cached)
+    emit_cached_text(f, f->cached);
+  else if (f->cache_key)
+    cache_function(f);
+  else
+    emit_function_code(f);
+}
+
+// (5) 并行生成
+//
+// 函数之间互不依赖：标签按函数编号，生成的状态都在线程局部变量中。
+// 多个线程各自把函数生成到自己的缓冲区，再按原来的顺序写出，
+// 结果与逐个生成时完全相同。-c 时所有函数共用目标文件的节及符号，仍逐个生成。
+// 报告的错误与逐个生成时相同，都是源码中最靠前的一个
+
+// 并行生成各函数代码的线程数(-j)
+_Thread_local int OPT_CODEGEN_THREADS;
+
+typedef struct {
+  Object **funcs;    // 待生成的函数，按写出的顺序排列
+  char **bufs;       // 各函数生成的代码
+  size_t *lens;      // 各函数代码的长度
+  int len;           // 函数的数量
+  atomic_int next;   // 下一个待生成的函数
+  atomic_int failed; // 出错的函数中最靠前的一个，都未出错时为 len
+  char **diags;      // 各函数的错误信息
+
+  // 新建的线程从主线程继承的状态
+  SourceState source;
+  bool terse;
+  bool function_sections;
+  bool data_sections;
+  char *cache_dir;
+} CodegenJob;
+
+// 不断领取下一个函数生成代码，直到全部生成完毕
+// 出错的函数之后的函数无需再生成，只需找出最靠前的错误
+static void run_codegen_job(CodegenJob *job) {
+  jmp_buf *saved_jmp;
+  FILE *saved_out;
+  get_error_handler(&saved_jmp, &saved_out);
+
+  for (;;) {
+    int i = atomic_fetch_add(&job->next, 1);
+    if (i >= job->len || i > atomic_load(&job->failed))
+      break;
+
+    // 缓冲区中可能已有主线程生成的数据段，只取出本函数的部分
+    size_t start = out_size();
+
+    // 错误信息先写入内存，最后只报告最靠前的一个
+    char *diag = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&diag, &len);
+    if (!out)
+      error("out of memory");
+    jmp_buf jmp;
+    bool aborted = false;
+    set_error_handler(&jmp, out);
+    if (!setjmp(jmp))
+      emit_function(job->funcs[i]);
+    else
+      aborted = true;
+    set_error_handler(saved_jmp, saved_out);
+    fclose(out);
+
+    if (aborted) {
+      job->diags[i] = diag;
+      int failed = atomic_load(&job->failed);
+      while (i < failed &&
+             !atomic_compare_exchange_weak(&job->failed, &failed, i))
+        ;
+
+      // 出错中止时可能停在任意深度，丢弃未完成的代码及状态
+      out_truncate(start);
+      STACK_DEPTH = WORK_LEN = 0;
+      REC.on = false;
+      REC.len = 0;
+      continue;
+    }
+    free(diag);
+
+    job->lens[i] = out_size() - start;
+    job->bufs[i] = malloc(job->lens[i]);
+    if (!job->bufs[i])
+      error("out of memory");
+    out_copy(start, start + job->lens[i], job->bufs[i]);
+    out_truncate(start);
+  }
+}
+
+static void *codegen_thread(void *arg) {
+  CodegenJob *job = arg;
+  use_source_state(job->source);
+  OPT_TERSE = job->terse;
+  OPT_FUNCTION_SECTIONS = job->function_sections;
+  OPT_DATA_SECTIONS = job->data_sections;
+  OPT_CACHE_DIR = job->cache_dir;
+
+  run_codegen_job(job);
+
+  // 线程退出前释放线程局部的缓冲区及区域
+  codegen_reset();
+  tokenize_reset();
+  OPT_TERSE = OPT_FUNCTION_SECTIONS = OPT_DATA_SECTIONS = false;
+  OPT_CACHE_DIR = NULL;
+  for (int i = 0; i < ARENA_NUM; i++)
+    arena_release(i);
+  return NULL;
+}
+
+// 由 nthreads 个线程生成 .text 段，主线程也参与生成
+static void emit_text_parallel(Object *prog, int nthreads) {
+  CodegenJob job = {
+      .source = get_source_state(),
+      .terse = OPT_TERSE,
+      .function_sections = OPT_FUNCTION_SECTIONS,
+      .data_sections = OPT_DATA_SECTIONS,
+      .cache_dir = OPT_CACHE_DIR,
+  };
+  for (Object *f = prog; f; f = f->next)
+    if (f->is_function)
+      job.len++;
+  job.failed = job.len;
+  job.funcs = calloc(job.len, sizeof(Object *));
+  job.bufs = calloc(job.len, sizeof(char *));
+  job.lens = calloc(job.len, sizeof(size_t));
+  job.diags = calloc(job.len, sizeof(char *));
+  if (!job.funcs || !job.bufs || !job.lens || !job.diags)
+    error("out of memory");
+  int n = 0;
+  for (Object *f = prog; f; f = f->next)
+    if (f->is_function)
+      job.funcs[n++] = f;
+
+  if (nthreads > job.len)
+    nthreads = job.len;
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  if (!threads)
+    error("out of memory");
+  // 线程引用着 job，创建失败时也要等已创建的线程结束后才能报错
+  int created = 1;
+  for (; created < nthreads; created++)
+    if (pthread_create(&threads[created], NULL, codegen_thread, &job))
+      break;
+  if (created < nthreads)
+    atomic_store(&job.next, job.len);
+  else
+    run_codegen_job(&job);
+  for (int i = 1; i < created; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+
+  // 无错误时按原来的顺序写出
+  int failed = atomic_load(&job.failed);
+  char *diag = failed < job.len ? job.diags[failed] : NULL;
+  for (int i = 0; i < job.len; i++) {
+    if (!diag && created == nthreads) {
+      out_write(job.bufs[i], job.lens[i]);
+      if (out_size() >= OUT_FLUSH_SIZE)
+        flush_output();
     }
+    free(job.bufs[i]);
+    if (i != failed)
+      free(job.diags[i]);
+  }
+  free(job.funcs);
+  free(job.bufs);
+  free(job.lens);
+  free(job.diags);
+
+  if (created < nthreads)
+    error("pthread_create failed");
+  if (diag) {
+    // 错误信息已以换行结尾
+    char *msg = format("%.*s", (int)strlen(diag) - 1, diag);
+    free(diag);
+    error("%s", msg);
   }
 }
 
@@ -390,80 +1476,82 @@ static void emit_text(Object *prog) {
     if (!f->is_function)
       continue;
 
-    println("  # 定义全局%s段", f->name);
-    println("  .globl %s", f->name);
-    println("  .text");
-    println("# =====%s段开始===============", f->name);
-    println("# %s段标签", f->name);
-    println("%s:", f->name);
-
-    CUR_FUNC = f;
-
-    // 栈布局
-    //-------------------------------// sp
-    //              ra
-    //-------------------------------// ra = sp-8
-    //              fp
-    //-------------------------------// fp = sp-16
-    //             变量
-    //-------------------------------// sp = sp-16-StackSize
-    //           表达式计算
-    //-------------------------------//
-
-    // Prologue
-    println("  addi sp, sp, -16");
-    println("  # 将ra压栈");
-    println("  sd ra, 8(sp)");
-
-    println("  # 将fp压栈,fp属于“被调用者保存”的寄存器,需要恢复原值");
-    println("  sd fp, 0(sp)");
-
-    println("  # 将sp的值写入fp");
-    println("  mv fp, sp");
-
-    println("  # sp腾出StackSize大小的栈空间");
-    println("  addi sp, sp, -%d", f->stack_size);
-
-    int i = 0;
-    for (Object *var = f->params; var; var = var->next) {
-      println("  # 将%s寄存器的值存入%s的栈地址", func_arg_regs[i], var->name);
-      if (var->type->size == 1)
-        println("  sb %s, %d(fp)", func_arg_regs[i++], var->offset);
-      else
-        println("  sd %s, %d(fp)", func_arg_regs[i++], var->offset);
-    }
-
-    println("\n# =====%s段主体===============", f->name);
-    gen_stmt(f->body);
-    assert(STACK_DEPTH == 0);
-
-    // Epilogue
-    println("\n# =====%s段结束===============", f->name);
-    println("# %s return段标签", f->name);
-    println(".L.return.%s:", f->name);
-
-    println("  # 将fp的值写回sp");
-    println("  mv sp, fp");
-
-    println("  # 恢复fp、ra和sp");
-    println("  ld fp, 0(sp)");
-    println("  ld ra, 8(sp)");
-    println("  addi sp, sp, 16");
-
-    println("  # 返回a0值给系统调用");
-    println("  ret");
+    emit_function(f);
+    if (out_size() >= OUT_FLUSH_SIZE)
+      flush_output();
   }
 }
 
+// 写出缓冲的汇编，-c 时写出目标文件
+static void emit_end(void) {
+  if (OPT_C)
+    obj_write(OUTPUT_FILE);
+  else
+    flush_output();
+}
+
 void codegen(Object *prog, FILE *out) {
   OUTPUT_FILE = out;
 
+  // 在汇编代码开头增加其他信息
+  emit_file_names();
+
   // 计算每个 Function 中的局部变量偏移
-  assign_local_val_offsets(prog);
+  for (Object *f = prog; f; f = f->next)
+    if (f->is_function)
+      assign_local_val_offsets(f);
 
   // 生成 .data 段
   emit_data(prog);
 
   // 生成 .text 段
-  emit_text(prog);
+  if (OPT_CODEGEN_THREADS > 1 && !OPT_C)
+    emit_text_parallel(prog, OPT_CODEGEN_THREADS);
+  else
+    emit_text(prog);
+  emit_end();
+}
+
+// 生成单个函数的代码，用于逐个函数地流式生成
+void codegen_function(Object *func, FILE *out) {
+  OUTPUT_FILE = out;
+  emit_file_names();
+  assign_local_val_offsets(func);
+  emit_function(func);
+
+  if (out_size() >= OUT_FLUSH_SIZE)
+    flush_output();
+}
+
+// 生成所有全局变量的数据段
+void codegen_data(Object *prog, FILE *out) {
+  OUTPUT_FILE = out;
+  emit_file_names();
+  emit_data(prog);
+  emit_end();
+}
+
+// 清空计数器及已输出的文件编号，以便同一线程编译下一个文件
+// 输出缓冲区及工作栈留给下一个文件继续使用
+void codegen_reset(void) {
+  OUTPUT_FILE = NULL;
+  LAST_LOC_FILE = LAST_LOC_LINE = 0;
+  FILE_NAMES_LEN = 0;
+  LABEL_COUNT = 0;
+  PCREL_COUNT = 0;
+  STACK_DEPTH = 0;
+
+  // 工作线程退出时线程局部变量随之消失，缓冲区须在此释放
+  for (int i = 0; i < OUT.nchunks; i++)
+    free(OUT.chunks[i]);
+  free(OUT.chunks);
+  OUT = (OutBuf){};
+  free(WORK);
+  WORK = NULL;
+  WORK_LEN = WORK_CAP = 0;
+  free(LABEL_BUF);
+  LABEL_BUF = NULL;
+  LABEL_CAP = 0;
+  free(REC.locs);
+  REC = (LocRecorder){};
 }
@@ -0,0 +1,561 @@
+#include "rvcc.h"
+#include <elf.h>
+
+//
+// 目标文件
+//
+// -c 时代码生成不输出汇编，而是将指令直接编码为 RV64IM 机器码，
+// 连同数据、符号表及重定位一起写成 ELF64 可重定位目标文件。
+//
+// 与汇编器相同，跳转到本文件内标签的分支在生成时直接计算偏移；
+// 函数调用及全局变量的地址则通过重定位交由链接器填入
+//
+
+// (1) 指令编码
+
+// 取出 imm 的第 lo 至 hi 位，放到第 pos 位
+static uint32_t bits(long imm, int hi, int lo, int pos) {
+  return ((uint32_t)(imm >> lo) & ((1u << (hi - lo + 1)) - 1)) << pos;
+}
+
+// 判断 imm 能否表示为 n 位有符号整数
+static bool fits(long imm, int n) {
+  return -(1L << (n - 1)) <= imm && imm < (1L << (n - 1));
+}
+
+uint32_t rv_r(uint32_t op, int rd, int rs1, int rs2) {
+  return op | rd << 7 | rs1 << 15 | rs2 << 20;
+}
+
+uint32_t rv_i(uint32_t op, int rd, int rs1, int imm) {
+  if (!fits(imm, 12))
+    error("immediate out of range: %d", imm);
+  return op | rd << 7 | rs1 << 15 | bits(imm, 11, 0, 20);
+}
+
+uint32_t rv_s(uint32_t op, int rs2, int rs1, int imm) {
+  if (!fits(imm, 12))
+    error("immediate out of range: %d", imm);
+  return op | bits(imm, 4, 0, 7) | rs1 << 15 | rs2 << 20 |
+         bits(imm, 11, 5, 25);
+}
+
+uint32_t rv_b(uint32_t op, int rs1, int rs2, int imm) {
+  return op | bits(imm, 11, 11, 7) | bits(imm, 4, 1, 8) | rs1 << 15 |
+         rs2 << 20 | bits(imm, 10, 5, 25) | bits(imm, 12, 12, 31);
+}
+
+// imm 为高 20 位的值
+uint32_t rv_u(uint32_t op, int rd, int imm) {
+  return op | rd << 7 | bits(imm, 19, 0, 12);
+}
+
+uint32_t rv_j(uint32_t op, int rd, int imm) {
+  return op | rd << 7 | bits(imm, 19, 12, 12) | bits(imm, 11, 11, 20) |
+         bits(imm, 10, 1, 21) | bits(imm, 20, 20, 31);
+}
+
+// 以小端序读写 32 位的指令
+static uint32_t read32(char *p) {
+  unsigned char *u = (unsigned char *)p;
+  return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t)u[3] << 24;
+}
+
+static void write32(char *p, uint32_t val) {
+  for (int i = 0; i < 4; i++)
+    p[i] = val >> (i * 8);
+}
+
+// (2) 节、符号及重定位
+
+typedef struct {
+  char *name;     // 名称
+  int shndx;      // 所在节在节头表中的编号，未定义时为0
+  uint64_t value; // 在所在节中的偏移
+  uint64_t size;  // 大小
+  uint8_t type;   // STT_*
+  bool is_global; // 是否为全局符号
+  bool is_used;   // 是否被写出的重定位引用
+  int index;      // 在符号表中的编号
+} ObjSymbol;
+
+typedef struct {
+  uint64_t offset; // 需要修改的位置
+  int type;        // R_RISCV_*
+  ObjSymbol *sym;  // 引用的符号
+} ObjReloc;
+
+typedef struct {
+  char *name;       // 节名
+  uint32_t type;    // SHT_*
+  uint64_t flags;   // SHF_*
+  uint64_t align;   // 对齐要求
+  uint64_t entsize; // 每一项的大小，不是表时为0
+  uint32_t link;    // sh_link
+  uint32_t info;    // sh_info
+  char *data;       // 内容，.bss 没有内容
+  size_t len;       // 大小
+  size_t cap;       // data 的容量
+  ObjReloc *relocs; // 重定位
+  int nrelocs;      // 重定位的数量
+  int reloc_cap;    // relocs 的容量
+  int resolved;     // 代码节中已解析的重定位数量，此后的重定位尚未解析
+} ObjSection;
+
+static _Thread_local ObjSection SECTIONS[SEC_NUM] = {
+    [SEC_TEXT] = {".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 4},
+    [SEC_DATA] = {".data", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, 1},
+    [SEC_BSS] = {".bss", SHT_NOBITS, SHF_ALLOC | SHF_WRITE, 1},
+    [SEC_RODATA] = {".rodata", SHT_PROGBITS, SHF_ALLOC, 1},
+};
+
+// 单独的节(-ffunction-sections, -fdata-sections)，编号接在 SECTIONS 之后
+static _Thread_local ObjSection *NAMED_SECTIONS;
+static _Thread_local int NAMED_LEN;
+static _Thread_local int NAMED_CAP;
+// 节名到节编号加 1 的映射
+static _Thread_local HashMap NAMED_MAP;
+
+// 当前写入的节的编号
+static _Thread_local int CUR_SEC;
+// 分支待解析的代码节的编号
+static _Thread_local int CODE_SEC;
+
+// 所有符号，按创建的顺序排列
+static _Thread_local ObjSymbol **SYMBOLS;
+static _Thread_local int SYMBOLS_LEN;
+static _Thread_local int SYMBOLS_CAP;
+// 符号名到符号的映射
+static _Thread_local HashMap SYMBOL_MAP;
+
+// 上一次 obj_resolve 之后在代码节中定义的标签
+static _Thread_local ObjSymbol **PENDING_LABELS;
+static _Thread_local int PENDING_LEN;
+static _Thread_local int PENDING_CAP;
+
+// 编号为 i 的节在节头表中的编号，0号为空节
+static int shndx(int i) { return i + 1; }
+
+// 节的数量
+static int nsections(void) { return SEC_NUM + NAMED_LEN; }
+
+// 返回编号为 i 的节
+// 新建单独的节时 NAMED_SECTIONS 可能扩容，返回的指针不应长期持有
+static ObjSection *section(int i) {
+  return i < SEC_NUM ? &SECTIONS[i] : &NAMED_SECTIONS[i - SEC_NUM];
+}
+
+// 保证 sec 还能写入 n 字节，返回写入的位置
+static char *sec_reserve(ObjSection *sec, size_t n) {
+  if (sec->len + n > sec->cap) {
+    while (sec->len + n > sec->cap)
+      sec->cap = sec->cap ? sec->cap * 2 : 4096;
+    sec->data = realloc(sec->data, sec->cap);
+    if (!sec->data)
+      error("out of memory");
+  }
+  return sec->data + sec->len;
+}
+
+// 向 sec 追加 len 字节，返回其在节中的偏移
+static size_t sec_append(ObjSection *sec, void *buf, size_t len) {
+  memcpy(sec_reserve(sec, len), buf, len);
+  sec->len += len;
+  return sec->len - len;
+}
+
+// 向 arr 追加一个指针
+static void push_ptr(ObjSymbol ***arr, int *len, int *cap, ObjSymbol *sym) {
+  if (*len == *cap) {
+    *cap = *cap ? *cap * 2 : 256;
+    *arr = realloc(*arr, sizeof(ObjSymbol *) * *cap);
+    if (!*arr)
+      error("out of memory");
+  }
+  (*arr)[(*len)++] = sym;
+}
+
+// 返回名为 name 的符号，不存在时创建一个未定义的符号
+static ObjSymbol *get_symbol(char *name) {
+  ObjSymbol *sym = hashmap_get(&SYMBOL_MAP, name);
+  if (sym)
+    return sym;
+
+  sym = arena_alloc(ARENA_SYMBOL, sizeof(ObjSymbol));
+  sym->name = arena_strndup(name, strlen(name));
+  hashmap_put(&SYMBOL_MAP, sym->name, sym);
+  push_ptr(&SYMBOLS, &SYMBOLS_LEN, &SYMBOLS_CAP, sym);
+  return sym;
+}
+
+// 切换到编号为 i 的节
+static void switch_section(int i) {
+  CUR_SEC = i;
+  if (section(i)->flags & SHF_EXECINSTR)
+    CODE_SEC = i;
+}
+
+void obj_section(SectionKind kind) { switch_section(kind); }
+
+void obj_named_section(SectionKind kind, char *name) {
+  intptr_t i = (intptr_t)hashmap_get(&NAMED_MAP, name);
+  if (i) {
+    switch_section(i - 1);
+    return;
+  }
+
+  if (NAMED_LEN == NAMED_CAP) {
+    NAMED_CAP = NAMED_CAP ? NAMED_CAP * 2 : 64;
+    NAMED_SECTIONS =
+        realloc(NAMED_SECTIONS, sizeof(ObjSection) * NAMED_CAP);
+    if (!NAMED_SECTIONS)
+      error("out of memory");
+  }
+
+  // 属性与 kind 对应的节相同，内容为空
+  ObjSection *tmpl = &SECTIONS[kind];
+  ObjSection *sec = &NAMED_SECTIONS[NAMED_LEN++];
+  *sec = (ObjSection){arena_strndup(name, strlen(name)), tmpl->type,
+                      tmpl->flags, tmpl->align};
+  hashmap_put(&NAMED_MAP, sec->name, (void *)(intptr_t)nsections());
+  switch_section(nsections() - 1);
+}
+
+void obj_inst(uint32_t inst) {
+  ObjSection *sec = section(CUR_SEC);
+  write32(sec_reserve(sec, 4), inst);
+  sec->len += 4;
+}
+
+void obj_bytes(char *buf, int len) {
+  ObjSection *sec = section(CUR_SEC);
+  if (sec->type == SHT_NOBITS)
+    unreachable();
+  sec_append(sec, buf, len);
+}
+
+void obj_zero(int len) {
+  ObjSection *sec = section(CUR_SEC);
+  if (sec->type != SHT_NOBITS)
+    memset(sec_reserve(sec, len), 0, len);
+  sec->len += len;
+}
+
+void obj_label(char *name) {
+  ObjSymbol *sym = get_symbol(name);
+  if (sym->shndx)
+    error("symbol already defined: %s", name);
+  sym->shndx = shndx(CUR_SEC);
+  sym->value = section(CUR_SEC)->len;
+
+  if (CUR_SEC == CODE_SEC)
+    push_ptr(&PENDING_LABELS, &PENDING_LEN, &PENDING_CAP, sym);
+}
+
+void obj_global(char *name) { get_symbol(name)->is_global = true; }
+
+void obj_type(char *name, bool is_func) {
+  get_symbol(name)->type = is_func ? STT_FUNC : STT_OBJECT;
+}
+
+void obj_size(char *name) {
+  ObjSymbol *sym = get_symbol(name);
+  sym->size = section(CUR_SEC)->len - sym->value;
+}
+
+void obj_reloc(int type, char *name) {
+  ObjSection *sec = section(CUR_SEC);
+  if (sec->nrelocs == sec->reloc_cap) {
+    sec->reloc_cap = sec->reloc_cap ? sec->reloc_cap * 2 : 256;
+    sec->relocs = realloc(sec->relocs, sizeof(ObjReloc) * sec->reloc_cap);
+    if (!sec->relocs)
+      error("out of memory");
+  }
+  sec->relocs[sec->nrelocs++] = (ObjReloc){sec->len, type, get_symbol(name)};
+}
+
+// (3) 分支解析
+
+// 判断重定位是否为跳转到同一代码节中已定义标签的分支
+// 不同节之间的距离在链接时才确定，交由链接器处理
+static bool is_local_branch(ObjReloc *r) {
+  return (r->type == R_RISCV_BRANCH || r->type == R_RISCV_JAL) &&
+         r->sym->shndx == shndx(CODE_SEC);
+}
+
+// 重定位 r 的目标相对于其位置的偏移
+static long branch_offset(ObjReloc *r) {
+  return (long)r->sym->value - (long)r->offset;
+}
+
+// 条件分支只能跳转 ±4KiB，将超出范围的 b<cond> rs1, rs2, L
+// 改写为 b<!cond> rs1, rs2, 8; j L
+static void relax_branch(ObjReloc *r) {
+  ObjSection *text = section(CODE_SEC);
+  uint64_t off = r->offset;
+
+  // 在分支之后插入一条指令，其后的标签及重定位随之后移
+  sec_reserve(text, 4);
+  memmove(text->data + off + 8, text->data + off + 4, text->len - off - 4);
+  text->len += 4;
+  for (int i = 0; i < PENDING_LEN; i++)
+    if (PENDING_LABELS[i]->value > off)
+      PENDING_LABELS[i]->value += 4;
+  for (int i = text->resolved; i < text->nrelocs; i++)
+    if (text->relocs[i].offset > off)
+      text->relocs[i].offset += 4;
+
+  // funct3 的最低位决定条件是否取反
+  uint32_t inst = read32(text->data + off) ^ (1 << 12);
+  write32(text->data + off, inst | rv_b(0, 0, 0, 8));
+  write32(text->data + off + 4, rv_j(RV_JAL, 0, 0));
+  r->offset = off + 4;
+  r->type = R_RISCV_JAL;
+}
+
+void obj_resolve(void) {
+  ObjSection *text = section(CODE_SEC);
+
+  // 改写分支会使其后的代码后移，之前在范围内的分支可能因此超出范围，
+  // 所以每次改写后都从头检查
+  for (int i = text->resolved; i < text->nrelocs; i++) {
+    ObjReloc *r = &text->relocs[i];
+    if (is_local_branch(r) && r->type == R_RISCV_BRANCH &&
+        !fits(branch_offset(r), 13)) {
+      relax_branch(r);
+      i = text->resolved - 1;
+    }
+  }
+
+  // 填入偏移，已解析的重定位不再写出
+  int n = text->resolved;
+  for (int i = text->resolved; i < text->nrelocs; i++) {
+    ObjReloc *r = &text->relocs[i];
+    if (!is_local_branch(r)) {
+      text->relocs[n++] = *r;
+      continue;
+    }
+
+    char *p = text->data + r->offset;
+    long off = branch_offset(r);
+    if (r->type == R_RISCV_BRANCH) {
+      write32(p, read32(p) | rv_b(0, 0, 0, off));
+    } else {
+      if (!fits(off, 21))
+        error("jump target out of range: %s", r->sym->name);
+      write32(p, read32(p) | rv_j(0, 0, off));
+    }
+  }
+  text->nrelocs = text->resolved = n;
+  PENDING_LEN = 0;
+}
+
+// (4) 写出 ELF 文件
+
+// 将 off 对齐到 align 的整数倍
+static size_t align_off(size_t off, size_t align) {
+  return (off + align - 1) / align * align;
+}
+
+// 向字符串表追加 name，返回其偏移
+static uint32_t add_string(ObjSection *strtab, char *name) {
+  return sec_append(strtab, name, strlen(name) + 1);
+}
+
+// 判断符号是否需要写入符号表
+// 与汇编器相同，未被重定位引用的 .L 开头的局部标签不写入
+static bool is_emitted(ObjSymbol *sym) {
+  return sym->is_global || !sym->shndx || sym->is_used ||
+         strncmp(sym->name, ".L", 2);
+}
+
+// 生成符号表，局部符号在前，全局符号在后
+static void build_symtab(ObjSection *symtab, ObjSection *strtab) {
+  for (int i = 0; i < nsections(); i++)
+    for (int j = 0; j < section(i)->nrelocs; j++)
+      section(i)->relocs[j].sym->is_used = true;
+
+  add_string(strtab, "");
+  sec_append(symtab, &(Elf64_Sym){}, sizeof(Elf64_Sym));
+
+  for (int global = 0; global < 2; global++) {
+    if (global)
+      symtab->info = symtab->len / sizeof(Elf64_Sym);
+
+    for (int i = 0; i < SYMBOLS_LEN; i++) {
+      ObjSymbol *sym = SYMBOLS[i];
+      // 未定义的符号总是全局的
+      if ((sym->is_global || !sym->shndx) != global || !is_emitted(sym))
+        continue;
+
+      sym->index = symtab->len / sizeof(Elf64_Sym);
+      Elf64_Sym esym = {
+          .st_name = add_string(strtab, sym->name),
+          .st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, sym->type),
+          .st_shndx = sym->shndx,
+          .st_value = sym->value,
+          .st_size = sym->size,
+      };
+      sec_append(symtab, &esym, sizeof(esym));
+    }
+  }
+}
+
+// 写出 len 个0
+static void write_zero(FILE *out, size_t len) {
+  for (size_t i = 0; i < len; i++)
+    fputc(0, out);
+}
+
+void obj_write(FILE *out) {
+  obj_resolve();
+
+  // 节头表依次为：空节、各节、各节的重定位表、符号表、字符串表、节名表
+  // 之后不再新建节，可以持有节的指针
+  int nobj = nsections();
+  ObjSection **secs = calloc(nobj * 2 + 4, sizeof(ObjSection *));
+  ObjSection *rela = calloc(nobj, sizeof(ObjSection));
+  uint32_t *names = calloc(nobj * 2 + 4, sizeof(uint32_t));
+  size_t *offsets = calloc(nobj * 2 + 4, sizeof(size_t));
+  if (!secs || !rela || !names || !offsets)
+    error("out of memory");
+  int nsecs = 1;
+  for (int i = 0; i < nobj; i++)
+    secs[nsecs++] = section(i);
+
+  int nrela = 0;
+  for (int i = 0; i < nobj; i++)
+    if (section(i)->nrelocs)
+      nrela++;
+  int symtab_idx = nsecs + nrela;
+
+  ObjSection symtab = {".symtab", SHT_SYMTAB, 0, 8, sizeof(Elf64_Sym)};
+  ObjSection strtab = {".strtab", SHT_STRTAB, 0, 1};
+  ObjSection shstrtab = {".shstrtab", SHT_STRTAB, 0, 1};
+  build_symtab(&symtab, &strtab);
+
+  for (int i = 0; i < nobj; i++) {
+    ObjSection *sec = section(i);
+    if (!sec->nrelocs)
+      continue;
+
+    ObjSection *r = &rela[i];
+    *r = (ObjSection){format(".rela%s", sec->name), SHT_RELA, SHF_INFO_LINK,
+                      8, sizeof(Elf64_Rela), symtab_idx, shndx(i)};
+    for (int j = 0; j < sec->nrelocs; j++) {
+      ObjReloc *rel = &sec->relocs[j];
+      Elf64_Rela erel = {
+          .r_offset = rel->offset,
+          .r_info = ELF64_R_INFO(rel->sym->index, rel->type),
+      };
+      sec_append(r, &erel, sizeof(erel));
+    }
+    secs[nsecs++] = r;
+  }
+
+  symtab.link = nsecs + 1;
+  secs[nsecs++] = &symtab;
+  secs[nsecs++] = &strtab;
+  secs[nsecs++] = &shstrtab;
+
+  // 计算各节在文件中的位置
+  add_string(&shstrtab, "");
+  for (int i = 1; i < nsecs; i++)
+    names[i] = add_string(&shstrtab, secs[i]->name);
+
+  size_t off = sizeof(Elf64_Ehdr);
+  for (int i = 1; i < nsecs; i++) {
+    off = offsets[i] = align_off(off, secs[i]->align);
+    if (secs[i]->type != SHT_NOBITS)
+      off += secs[i]->len;
+  }
+  size_t shoff = align_off(off, 8);
+
+  Elf64_Ehdr eh = {
+      .e_type = ET_REL,
+      .e_machine = EM_RISCV,
+      .e_version = EV_CURRENT,
+      .e_shoff = shoff,
+      // 链接器要求浮点 ABI 一致，才能与 lp64d 的库链接
+      .e_flags = EF_RISCV_FLOAT_ABI_DOUBLE,
+      .e_ehsize = sizeof(Elf64_Ehdr),
+      .e_shentsize = sizeof(Elf64_Shdr),
+      .e_shnum = nsecs,
+      .e_shstrndx = nsecs - 1,
+  };
+  memcpy(eh.e_ident, ELFMAG, SELFMAG);
+  eh.e_ident[EI_CLASS] = ELFCLASS64;
+  eh.e_ident[EI_DATA] = ELFDATA2LSB;
+  eh.e_ident[EI_VERSION] = EV_CURRENT;
+  eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  fwrite(&eh, sizeof(eh), 1, out);
+
+  // 依次写出各节的内容，节之间以0填充
+  off = sizeof(Elf64_Ehdr);
+  for (int i = 1; i < nsecs; i++) {
+    if (secs[i]->type == SHT_NOBITS || !secs[i]->len)
+      continue;
+    write_zero(out, offsets[i] - off);
+    fwrite(secs[i]->data, 1, secs[i]->len, out);
+    off = offsets[i] + secs[i]->len;
+  }
+  write_zero(out, shoff - off);
+
+  // 节头表
+  fwrite(&(Elf64_Shdr){}, sizeof(Elf64_Shdr), 1, out);
+  for (int i = 1; i < nsecs; i++) {
+    ObjSection *sec = secs[i];
+    Elf64_Shdr sh = {
+        .sh_name = names[i],
+        .sh_type = sec->type,
+        .sh_flags = sec->flags,
+        .sh_offset = offsets[i],
+        .sh_size = sec->len,
+        .sh_link = sec->link,
+        .sh_info = sec->info,
+        .sh_addralign = sec->align,
+        .sh_entsize = sec->entsize,
+    };
+    fwrite(&sh, sizeof(sh), 1, out);
+  }
+
+  for (int i = 0; i < nobj; i++)
+    free(rela[i].data);
+  free(rela);
+  free(secs);
+  free(names);
+  free(offsets);
+  free(symtab.data);
+  free(strtab.data);
+  free(shstrtab.data);
+
+  if (fflush(out) != 0 || ferror(out))
+    error("write failed: %s", strerror(errno));
+}
+
+// 释放所有节、符号及重定位，以便同一线程生成下一个目标文件
+void obj_reset(void) {
+  for (int i = 0; i < nsections(); i++) {
+    ObjSection *sec = section(i);
+    free(sec->data);
+    free(sec->relocs);
+    sec->data = NULL;
+    sec->relocs = NULL;
+    sec->len = sec->cap = 0;
+    sec->nrelocs = sec->reloc_cap = sec->resolved = 0;
+  }
+  free(NAMED_SECTIONS);
+  NAMED_SECTIONS = NULL;
+  NAMED_LEN = NAMED_CAP = 0;
+  hashmap_free(&NAMED_MAP);
+
+  // 符号本身分配在区域中
+  hashmap_free(&SYMBOL_MAP);
+  free(SYMBOLS);
+  SYMBOLS = NULL;
+  SYMBOLS_LEN = SYMBOLS_CAP = 0;
+  free(PENDING_LABELS);
+  PENDING_LABELS = NULL;
+  PENDING_LEN = PENDING_CAP = 0;
+  CUR_SEC = CODE_SEC = SEC_TEXT;
+}
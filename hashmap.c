@@ -0,0 +1,166 @@
+#include "rvcc.h"
+
+//
+// 哈希表
+//
+// 开放寻址法实现的哈希表，键为字符串（不要求以'\0'结尾），值为任意指针
+// 冲突时线性探测，删除时留下墓碑，负载过高时扩容重建
+//
+
+// 初始桶数
+#define INIT_SIZE 16
+// 使用率超过该百分比时进行重建
+#define HIGH_WATERMARK 70
+// 重建后使用率不超过该百分比
+#define LOW_WATERMARK 50
+// 墓碑：表示该位置曾被删除，查找时需要继续向后探测
+#define TOMBSTONE ((void *)-1)
+
+// FNV-1a 哈希函数
+uint64_t fnv_hash(char *s, int len) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (int i = 0; i < len; i++) {
+    hash *= 0x100000001b3;
+    hash ^= (unsigned char)s[i];
+  }
+  return hash;
+}
+
+// 扩容并重建哈希表，同时清除所有墓碑
+static void rehash(HashMap *map) {
+  // 统计有效键的数量
+  int nkeys = 0;
+  for (int i = 0; i < map->capacity; i++)
+    if (map->buckets[i].key && map->buckets[i].key != TOMBSTONE)
+      nkeys++;
+
+  // 计算新的容量，保证重建后使用率不超过 LOW_WATERMARK
+  int cap = map->capacity;
+  while ((nkeys * 100) / cap >= LOW_WATERMARK)
+    cap = cap * 2;
+  assert(cap > 0);
+
+  // 将所有有效键插入到新表中
+  HashMap map2 = {};
+  map2.buckets = calloc(cap, sizeof(HashEntry));
+  map2.capacity = cap;
+
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[i];
+    if (ent->key && ent->key != TOMBSTONE)
+      hashmap_put2(&map2, ent->key, ent->keylen, ent->val);
+  }
+
+  assert(map2.used == nkeys);
+  free(map->buckets);
+  *map = map2;
+}
+
+// 判断桶中的键是否与给定键相同
+static bool match(HashEntry *ent, char *key, int keylen) {
+  return ent->key && ent->key != TOMBSTONE && ent->keylen == keylen &&
+         memcmp(ent->key, key, keylen) == 0;
+}
+
+// 查找键对应的桶，不存在则返回NULL
+static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
+  if (!map->buckets)
+    return NULL;
+
+  uint64_t hash = fnv_hash(key, keylen);
+
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) % map->capacity];
+    if (match(ent, key, keylen))
+      return ent;
+    // 遇到从未使用过的桶，说明键不存在
+    if (ent->key == NULL)
+      return NULL;
+  }
+  unreachable();
+}
+
+// 查找键对应的桶，不存在则分配一个新桶
+static HashEntry *get_or_insert_entry(HashMap *map, char *key, int keylen) {
+  if (!map->buckets) {
+    map->buckets = calloc(INIT_SIZE, sizeof(HashEntry));
+    map->capacity = INIT_SIZE;
+  } else if ((map->used * 100) / map->capacity >= HIGH_WATERMARK) {
+    rehash(map);
+  }
+
+  uint64_t hash = fnv_hash(key, keylen);
+  // 键不存在时使用的桶：探测路径上的第一个墓碑或空桶
+  HashEntry *slot = NULL;
+
+  for (int i = 0; i < map->capacity; i++) {
+    HashEntry *ent = &map->buckets[(hash + i) % map->capacity];
+
+    if (match(ent, key, keylen))
+      return ent;
+
+    // 墓碑之后可能还有相同的键，先记下，继续探测
+    if (ent->key == TOMBSTONE) {
+      if (!slot)
+        slot = ent;
+      continue;
+    }
+
+    // 遇到从未使用过的桶，说明键不存在，优先复用墓碑
+    if (ent->key == NULL) {
+      if (!slot) {
+        slot = ent;
+        map->used++;
+      }
+      break;
+    }
+  }
+
+  // 负载不超过 HIGH_WATERMARK，总能找到空桶或墓碑
+  if (!slot)
+    unreachable();
+  slot->key = key;
+  slot->keylen = keylen;
+  return slot;
+}
+
+// 查找以'\0'结尾的键
+void *hashmap_get(HashMap *map, char *key) {
+  return hashmap_get2(map, key, strlen(key));
+}
+
+// 查找长度为 keylen 的键
+void *hashmap_get2(HashMap *map, char *key, int keylen) {
+  HashEntry *ent = get_entry(map, key, keylen);
+  return ent ? ent->val : NULL;
+}
+
+// 插入或更新以'\0'结尾的键
+void hashmap_put(HashMap *map, char *key, void *val) {
+  hashmap_put2(map, key, strlen(key), val);
+}
+
+// 插入或更新长度为 keylen 的键
+// 哈希表不会复制 key，调用者需保证 key 的生命周期不短于哈希表
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val) {
+  HashEntry *ent = get_or_insert_entry(map, key, keylen);
+  ent->val = val;
+}
+
+// 删除以'\0'结尾的键
+void hashmap_delete(HashMap *map, char *key) {
+  hashmap_delete2(map, key, strlen(key));
+}
+
+// 删除长度为 keylen 的键
+void hashmap_delete2(HashMap *map, char *key, int keylen) {
+  HashEntry *ent = get_entry(map, key, keylen);
+  if (ent)
+    ent->key = TOMBSTONE;
+}
+
+// 释放所有桶，哈希表恢复为空表
+void hashmap_free(HashMap *map) {
+  free(map->buckets);
+  *map = (HashMap){};
+}
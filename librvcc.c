@@ -0,0 +1,98 @@
+#include "librvcc.h"
+#include "rvcc.h"
+
+struct RvccContext {
+  char *out;        // 生成的汇编
+  size_t out_len;   // 汇编的长度
+  char *diags;      // 错误信息
+  size_t diags_len; // 错误信息的长度
+};
+
+// 重置所有编译阶段的状态，以便当前线程开始下一次编译
+// 区域中的内存留待下一次编译复用，规范类型及映射的终结符缓存继续保留
+void reset_compilation(void) {
+  tokenize_reset();
+  preprocess_reset();
+  token_cache_reset();
+  parse_reset();
+  type_reset();
+  codegen_reset();
+  obj_reset();
+
+  for (int i = 0; i < ARENA_NUM; i++)
+    if (i != ARENA_TYPE)
+      arena_reset(i);
+}
+
+// 当前线程的上下文，区域等线程局部的状态归它所有
+static _Thread_local RvccContext *CONTEXT;
+
+RvccContext *rvcc_new(void) {
+  if (CONTEXT)
+    return NULL;
+  CONTEXT = calloc(1, sizeof(RvccContext));
+  return CONTEXT;
+}
+
+void rvcc_free(RvccContext *ctx) {
+  if (!ctx)
+    return;
+  // 其他线程创建的上下文不拥有当前线程的状态
+  bool owner = ctx == CONTEXT;
+  free(ctx->out);
+  free(ctx->diags);
+  free(ctx);
+  if (!owner)
+    return;
+  CONTEXT = NULL;
+
+  type_release();
+  token_cache_release();
+  for (int i = 0; i < ARENA_NUM; i++)
+    arena_release(i);
+}
+
+int rvcc_compile(RvccContext *ctx, const char *src, size_t len, char **out,
+                 size_t *out_len, char **diags) {
+  if (ctx != CONTEXT) {
+    *out = *diags = NULL;
+    *out_len = 0;
+    return -1;
+  }
+
+  free(ctx->out);
+  free(ctx->diags);
+  ctx->out = ctx->diags = NULL;
+  ctx->out_len = ctx->diags_len = 0;
+
+  FILE *out_file = open_memstream(&ctx->out, &ctx->out_len);
+  FILE *diag_file = open_memstream(&ctx->diags, &ctx->diags_len);
+  if (!out_file || !diag_file) {
+    if (out_file)
+      fclose(out_file);
+    if (diag_file)
+      fclose(diag_file);
+    return -1;
+  }
+
+  // 出错时由 error 等函数返回到这里，之后统一清理
+  jmp_buf jmp;
+  volatile int status = -1;
+  set_error_handler(&jmp, diag_file);
+  if (!setjmp(jmp)) {
+    SourceFile *file = new_source_buffer("<input>", (char *)src, len);
+    Object *prog = parse(preprocess_file(file), NULL);
+    codegen(prog, out_file);
+    status = 0;
+  }
+  set_error_handler(NULL, NULL);
+
+  fclose(out_file);
+  fclose(diag_file);
+  reset_compilation();
+
+  *out = ctx->out;
+  *out_len = ctx->out_len;
+  *diags = ctx->diags;
+  return status;
+}
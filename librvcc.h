@@ -0,0 +1,34 @@
+#ifndef LIBRVCC_H
+#define LIBRVCC_H
+
+#include <stddef.h>
+
+//
+// librvcc：在进程内将内存中的源码编译为内存中的汇编
+//
+// 编译状态都存放在线程局部变量中，每次编译结束后重置，
+// 不同线程可以同时各自使用自己的上下文进行编译。
+// 出错时不会退出程序，错误信息通过上下文返回
+//
+// 上下文与创建它的线程共用线程局部的区域及规范类型表，
+// 因此每个线程同时只能有一个上下文，且只能在创建它的线程中使用
+//
+
+typedef struct RvccContext RvccContext;
+
+// 创建编译上下文，当前线程已有上下文时返回 NULL
+RvccContext *rvcc_new(void);
+
+// 销毁编译上下文，释放当前线程为编译保留的内存
+// 须在创建它的线程中调用
+void rvcc_free(RvccContext *ctx);
+
+// 编译 src 中长度为 len 的源码
+// *out, *out_len 返回生成的汇编；*diags 返回以 '\0' 结尾的错误信息，
+// 无错误时为空串。返回的内容归上下文所有，在下一次调用前有效
+// 成功时返回 0，出错时返回 -1
+// 不在创建上下文的线程中调用时返回 -1，*out 及 *diags 为 NULL
+int rvcc_compile(RvccContext *ctx, const char *src, size_t len, char **out,
+                 size_t *out_len, char **diags);
+
+#endif
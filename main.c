@@ -1,15 +1,84 @@
 #include "rvcc.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-static char *OUTPUT_PATH;
-static char *INPUT_PATH;
+// 选项都存放在线程局部变量中，
+// 编译服务的每个请求及 -j 的每个工作线程各自解析一遍参数
+
+static _Thread_local char *OUTPUT_PATH;
+// 输入文件
+typedef struct {
+  char *path;
+  long size; // 文件大小，决定编译的先后
+} Input;
+
+static _Thread_local Input *INPUTS;
+static _Thread_local int INPUTS_LEN;
+// 同时编译的文件数或编译服务的线程数(-j)，为 0 时未指定
+// 只有一个输入文件时为并行解析函数体及生成代码的线程数
+static _Thread_local int OPT_J;
+// 是否输出内存区域的使用统计
+static _Thread_local bool OPT_ARENA_STATS;
+// 是否只进行预处理(-E)
+static _Thread_local bool OPT_E;
+// 是否逐个函数地流式生成代码(--stream)
+static _Thread_local bool OPT_STREAM;
+// 是否由三个线程流水线式地预处理、解析及生成代码(--pipeline)
+static _Thread_local bool OPT_PIPELINE;
+// 是否生成汇编(-S)，优先于 -c
+static _Thread_local bool OPT_S;
+
+// 编译服务正在处理的请求
+typedef struct {
+  int fd;         // 客户端的连接
+  char *input;    // 客户端转发的标准输入
+  size_t len;     // 标准输入的长度
+  FILE *diag;     // 错误信息及统计信息
+  char *buf;      // 当前输出文件的内容
+  size_t buf_len; // 当前输出文件的长度
+} Reply;
+
+// 当前线程正在处理的请求，不在编译服务中时为 NULL
+static _Thread_local Reply *REPLY;
 
 static void usage(int status) {
-  fprintf(stderr, "rvcc [ -o <path> ] <file>\n");
-  exit(status);
+  char *msg = "rvcc [ -o <path> ] [ -E ] [ -S ] [ -c ] [ -I <dir> ] "
+              "[ --arena-stats ] [ --verify-types ] "
+              "[ --token-cache <dir> ] [ --cache-dir <dir> ] "
+              "[ --cache-size <MiB> ] [ --stream ] [ --pipeline ] "
+              "[ --terse ] [ --lazy ] [ --keep <func> ] [ -j <n> ] "
+              "[ -ffunction-sections ] [ -fdata-sections ] "
+              "[ --server <sock> ] [ --client <sock> ] <file>...";
+  // 编译服务不能退出进程，作为错误返回给客户端
+  if (status || REPLY)
+    error("%s", msg);
+  fprintf(stderr, "%s\n", msg);
+  exit(0);
+}
+
+// 清空当前线程的选项
+static void reset_options(void) {
+  OUTPUT_PATH = NULL;
+  free(INPUTS);
+  INPUTS = NULL;
+  INPUTS_LEN = 0;
+  OPT_J = OPT_PARSE_THREADS = OPT_CODEGEN_THREADS = 0;
+  OPT_ARENA_STATS = OPT_E = OPT_STREAM = OPT_PIPELINE = OPT_S = false;
+  OPT_C = OPT_TERSE = OPT_VERIFY_TYPES = OPT_LAZY = false;
+  OPT_FUNCTION_SECTIONS = OPT_DATA_SECTIONS = false;
+  OPT_TOKEN_CACHE = NULL;
+  OPT_CACHE_DIR = NULL;
+  OPT_CACHE_SIZE = DEFAULT_CACHE_SIZE;
+  clear_include_paths();
+  clear_keep_functions();
 }
 
 static void parse_args(int argc, char **argv) {
+  reset_options();
+
   for (int i = 1; i < argc; i++) {
     // 解析 -h | --help
     if (!strcmp(argv[i], "-h"))
@@ -27,18 +96,179 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    // 解析 -E
+    if (!strcmp(argv[i], "-E")) {
+      OPT_E = true;
+      continue;
+    }
+
+    // 解析 -S
+    if (!strcmp(argv[i], "-S")) {
+      OPT_S = true;
+      continue;
+    }
+
+    // 解析 -c
+    if (!strcmp(argv[i], "-c")) {
+      OPT_C = true;
+      continue;
+    }
+
+    // 解析 -ffunction-sections
+    if (!strcmp(argv[i], "-ffunction-sections")) {
+      OPT_FUNCTION_SECTIONS = true;
+      continue;
+    }
+
+    // 解析 -fdata-sections
+    if (!strcmp(argv[i], "-fdata-sections")) {
+      OPT_DATA_SECTIONS = true;
+      continue;
+    }
+
+    // 解析 -I<dir> | -I <dir>
+    if (!strncmp(argv[i], "-I", 2)) {
+      char *dir = argv[i][2] ? argv[i] + 2 : argv[++i];
+      if (!dir)
+        usage(1);
+      add_include_path(dir);
+      continue;
+    }
+
+    // 解析 -j<n> | -j <n>
+    if (!strncmp(argv[i], "-j", 2)) {
+      char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+      if (!n)
+        usage(1);
+      OPT_J = atoi(n);
+      if (OPT_J < 1)
+        error("invalid argument: -j %s", n);
+      continue;
+    }
+
+    // 解析 --arena-stats
+    if (!strcmp(argv[i], "--arena-stats")) {
+      OPT_ARENA_STATS = true;
+      continue;
+    }
+
+    // 解析 --verify-types
+    if (!strcmp(argv[i], "--verify-types")) {
+      OPT_VERIFY_TYPES = true;
+      continue;
+    }
+
+    // 解析 --stream
+    if (!strcmp(argv[i], "--stream")) {
+      OPT_STREAM = true;
+      continue;
+    }
+
+    // 解析 --pipeline
+    if (!strcmp(argv[i], "--pipeline")) {
+      OPT_PIPELINE = true;
+      continue;
+    }
+
+    // 解析 --terse
+    if (!strcmp(argv[i], "--terse")) {
+      OPT_TERSE = true;
+      continue;
+    }
+
+    // 解析 --lazy
+    if (!strcmp(argv[i], "--lazy")) {
+      OPT_LAZY = true;
+      continue;
+    }
+
+    // 解析 --keep <func>
+    if (!strcmp(argv[i], "--keep")) {
+      if (!argv[++i])
+        usage(1);
+      add_keep_function(argv[i]);
+      continue;
+    }
+
+    // 解析 --token-cache <dir>
+    if (!strcmp(argv[i], "--token-cache")) {
+      if (!argv[++i])
+        usage(1);
+      OPT_TOKEN_CACHE = argv[i];
+      continue;
+    }
+
+    // 解析 --cache-dir <dir>
+    if (!strcmp(argv[i], "--cache-dir")) {
+      if (!argv[++i])
+        usage(1);
+      OPT_CACHE_DIR = argv[i];
+      continue;
+    }
+
+    // 解析 --cache-size <MiB>
+    if (!strcmp(argv[i], "--cache-size")) {
+      if (!argv[++i])
+        usage(1);
+      char *end;
+      unsigned long n = strtoul(argv[i], &end, 10);
+      if (*end || end == argv[i])
+        error("invalid argument: --cache-size %s", argv[i]);
+      OPT_CACHE_SIZE = (size_t)n << 20;
+      continue;
+    }
+
     // 解析 <file>
     if (argv[i][0] == '-' && argv[i][1] != '\0')
       error("invalid argument: %s", argv[i]);
 
-    INPUT_PATH = argv[i];
+    struct stat st;
+    INPUTS = realloc(INPUTS, sizeof(Input) * (INPUTS_LEN + 1));
+    INPUTS[INPUTS_LEN++] = (Input){
+        argv[i], stat(resolve_path(argv[i]), &st) == 0 ? st.st_size : 0};
   }
 
-  if (!INPUT_PATH)
+  if (OPT_S)
+    OPT_C = false;
+}
+
+static void check_inputs(void) {
+  if (INPUTS_LEN == 0)
     error("no input files");
+
+  // 多个输入文件各自生成输出文件
+  if (INPUTS_LEN > 1 && (OUTPUT_PATH || OPT_E))
+    error("cannot specify -o or -E with multiple files");
+
+  // 只有一个输入文件时，-j 的线程用于并行解析函数体及生成各函数的代码
+  OPT_PARSE_THREADS = OPT_CODEGEN_THREADS = INPUTS_LEN == 1 ? OPT_J : 0;
+}
+
+// 从参数中取出 name <value>，返回 value，不存在时返回 NULL
+static char *take_option(int *argc, char **argv, char *name) {
+  for (int i = 1; i < *argc; i++) {
+    if (strcmp(argv[i], name))
+      continue;
+    if (i + 1 == *argc)
+      usage(1);
+    char *val = argv[i + 1];
+    // 连同结尾的 NULL 一起前移
+    memmove(argv + i, argv + i + 2, sizeof(char *) * (*argc - i - 1));
+    *argc -= 2;
+    return val;
+  }
+  return NULL;
 }
 
 static FILE *open_file(char *path) {
+  // 编译服务先将输出写入内存，完成后再发回客户端
+  if (REPLY) {
+    FILE *out = open_memstream(&REPLY->buf, &REPLY->buf_len);
+    if (!out)
+      error("out of memory");
+    return out;
+  }
+
   if (!path || strcmp(path, "-") == 0)
     return stdout;
 
@@ -50,23 +280,274 @@ static FILE *open_file(char *path) {
   return out;
 }
 
+static void close_file(FILE *out, char *path) {
+  if (!REPLY) {
+    if (out != stdout)
+      fclose(out);
+    return;
+  }
+
+  fclose(out);
+  char *name = path && strcmp(path, "-") ? path : "";
+  send_frame(REPLY->fd, FRAME_FILE, name, strlen(name));
+  send_frame(REPLY->fd, FRAME_DATA, REPLY->buf, REPLY->buf_len);
+  free(REPLY->buf);
+  REPLY->buf = NULL;
+}
+
+// 输出预处理后的终结符
+static void print_tokens(FILE *out, Token token) {
+  for (; tok_kind(token) != TK_EOF; token++) {
+    // 已输出的终结符不再需要
+    release_tokens(token);
+    if (token > 0 && (tok_flags(token) & PP_BOL))
+      fprintf(out, "\n");
+    else if (token > 0 && (tok_flags(token) & PP_SPACE))
+      fprintf(out, " ");
+    fprintf(out, "%.*s", tok_len(token), tok_loc(token));
+  }
+  fprintf(out, "\n");
+}
+
+// 当前线程的输出文件
+static _Thread_local FILE *OUT;
+
+// 函数解析完毕即生成代码，随后释放其语法树及局部变量，
+// 峰值内存只与最大的函数有关
+static void stream_function(Object *func, Token end) {
+  codegen_function(func, OUT);
+
+  arena_release(ARENA_AST);
+  arena_release(ARENA_LOCAL);
+  func->params = func->locals = NULL;
+  func->pool = NULL;
+  func->body = 0;
+}
+
+// 返回输入文件对应的输出文件：当前目录下同名的 .s 或 .o 文件
+static char *output_path(char *input) {
+  char *base = strrchr(input, '/');
+  base = base ? base + 1 : input;
+  char *dot = strrchr(base, '.');
+  int len = dot ? dot - base : strlen(base);
+  return format("%.*s.%s", len, base, OPT_C ? "o" : "s");
+}
+
+// 开启编译缓存时输出先写入内存，编译完成后存入缓存再写出
+static _Thread_local char *CACHE_BUF;
+static _Thread_local size_t CACHE_LEN;
+
+static FILE *open_output(char *path, bool caching) {
+  if (!caching)
+    return open_file(path);
+  FILE *out = open_memstream(&CACHE_BUF, &CACHE_LEN);
+  if (!out)
+    error("out of memory");
+  return out;
+}
+
+// 编译 input，并输出到 output
+// 编译的状态都存放在线程局部变量中，结束后全部重置，
+// 同一线程可以接着编译下一个文件
+static void compile(char *input, char *output) {
+  // 命中编译缓存时直接写出缓存的输出
+  CacheKey key;
+  CacheHit hit;
+  // --pipeline 的结果与 --stream 相同，共用缓存
+  bool stream = OPT_STREAM || OPT_PIPELINE;
+  char *opts = format("%d%d%d%d%d%d", OPT_C, OPT_TERSE, stream, OPT_LAZY,
+                      OPT_FUNCTION_SECTIONS, OPT_DATA_SECTIONS);
+  int nkeep;
+  char **keep = get_keep_functions(&nkeep);
+  for (int i = 0; i < nkeep; i++)
+    opts = format("%s,%s", opts, keep[i]);
+  bool caching = OPT_CACHE_DIR && !OPT_E && cache_key(input, opts, &key);
+  if (caching && cache_load(&key, &hit)) {
+    OUT = open_file(output);
+    fwrite(hit.data, 1, hit.len, OUT);
+    cache_release(&hit);
+    close_file(OUT, output);
+    OUT = NULL;
+    reset_compilation();
+    return;
+  }
+
+  // 1. 词法分析，预处理
+  // 编译服务中 "-" 为客户端转发的标准输入
+  Token token;
+  if (REPLY && !strcmp(input, "-"))
+    token = preprocess_file(new_source_buffer("-", REPLY->input, REPLY->len));
+  else
+    token = preprocess(input);
+
+  // -E 只输出预处理的结果
+  if (OPT_E) {
+    OUT = open_file(output);
+    print_tokens(OUT, token);
+  } else if (OPT_PIPELINE) {
+    // --pipeline 由另外两个线程解析及生成代码，当前线程只预处理
+    OUT = open_output(output, caching);
+    run_pipeline(token, OUT);
+  } else if (OPT_STREAM) {
+    // --stream 在解析的同时逐个函数地生成代码，全局变量最后统一生成
+    OUT = open_output(output, caching);
+    Object *prog = parse(token, stream_function);
+    codegen_data(prog, OUT);
+  } else {
+    // 2. 语法分析
+    Object *prog = parse(token, NULL);
+
+    // 3. 语义分析
+    OUT = open_output(output, caching);
+    codegen(prog, OUT);
+  }
+
+  if (caching) {
+    fclose(OUT);
+    cache_store(&key, CACHE_BUF, CACHE_LEN);
+    OUT = open_file(output);
+    fwrite(CACHE_BUF, 1, CACHE_LEN, OUT);
+    free(CACHE_BUF);
+    CACHE_BUF = NULL;
+  }
+  close_file(OUT, output);
+  OUT = NULL;
+
+  // 多个线程的统计信息不应交错输出
+  if (OPT_ARENA_STATS) {
+    FILE *stats = REPLY ? REPLY->diag : stderr;
+    flockfile(stats);
+    arena_print_stats(stats);
+    funlockfile(stats);
+  }
+
+  reset_compilation();
+}
+
+// 处理编译服务的一个请求，参数中的相对路径相对于客户端的当前目录 cwd
+static void handle_request(int fd, char *cwd, int argc, char **argv,
+                           char *input, size_t len) {
+  char *diags = NULL;
+  size_t diags_len = 0;
+  Reply reply = {fd, input, len, open_memstream(&diags, &diags_len)};
+  if (!reply.diag)
+    return;
+  REPLY = &reply;
+  set_work_dir(cwd);
+
+  // 出错时返回到这里，丢弃未完成的输出并重置编译的状态
+  jmp_buf jmp;
+  volatile int status = 1;
+  set_error_handler(&jmp, reply.diag);
+  if (!setjmp(jmp)) {
+    parse_args(argc, argv);
+    check_inputs();
+    for (int i = 0; i < INPUTS_LEN; i++) {
+      char *path = INPUTS[i].path;
+      compile(path, INPUTS_LEN == 1 ? OUTPUT_PATH : output_path(path));
+    }
+    status = 0;
+  } else {
+    if (OUT)
+      fclose(OUT);
+    OUT = NULL;
+    free(reply.buf);
+    free(CACHE_BUF);
+    CACHE_BUF = NULL;
+    reset_compilation();
+  }
+  set_error_handler(NULL, NULL);
+  set_work_dir(NULL);
+  REPLY = NULL;
+
+  fclose(reply.diag);
+  send_frame(fd, FRAME_DIAG, diags, diags_len);
+  send_frame(fd, FRAME_EXIT, &(char){status}, 1);
+  free(diags);
+}
+
+// 命令行参数，新建的工作线程据此解析自己的选项
+static int ARGC;
+static char **ARGV;
+
+// 所有工作线程共享的输入文件
+static Input *JOBS;
+static int JOBS_LEN;
+
+// 下一个待编译的输入文件
+static atomic_int NEXT_INPUT;
+
+// 工作线程不断领取下一个输入文件，直到全部编译完毕
+// arg 为线程的编号，主线程为 0，新建的线程其线程局部的选项需重新解析
+static void *worker(void *arg) {
+  int id = (intptr_t)arg;
+  if (id)
+    parse_args(ARGC, ARGV);
+
+  for (;;) {
+    int i = atomic_fetch_add(&NEXT_INPUT, 1);
+    if (i >= JOBS_LEN)
+      break;
+    compile(JOBS[i].path, output_path(JOBS[i].path));
+  }
+
+  // 所有文件编译完成，一次性释放所有阶段的内存
+  if (id)
+    reset_options();
+  type_release();
+  token_cache_release();
+  for (int i = 0; i < ARENA_NUM; i++)
+    arena_release(i);
+  return NULL;
+}
+
+// 按文件大小降序排列，最大的文件最先开始编译，
+// 避免最后只剩一个大文件在编译而其余线程空闲
+static int by_size_desc(const void *a, const void *b) {
+  long x = ((Input *)a)->size;
+  long y = ((Input *)b)->size;
+  return (x < y) - (x > y);
+}
+
 int main(int argc, char **argv) {
+  // --server 及 --client 决定进程的运行方式，其余参数由编译服务解析
+  char *server = take_option(&argc, argv, "--server");
+  char *client = take_option(&argc, argv, "--client");
+  if (client)
+    return run_client(client, argc, argv);
+
   // 解析传入参数
+  ARGC = argc;
+  ARGV = argv;
   parse_args(argc, argv);
 
-  // 1. 词法分析
-  Token *token = tokenize_file(INPUT_PATH);
+  // 默认每个处理器一个线程
+  if (server)
+    run_server(server, OPT_J ? OPT_J : sysconf(_SC_NPROCESSORS_ONLN),
+               handle_request);
 
-  // 2. 语法分析
-  Object *prog = parse(token);
+  check_inputs();
+  if (INPUTS_LEN == 1) {
+    compile(INPUTS[0].path, OUTPUT_PATH);
+    return 0;
+  }
 
-  // 3. 语义分析
-  FILE *out = open_file(OUTPUT_PATH);
+  qsort(INPUTS, INPUTS_LEN, sizeof(Input), by_size_desc);
+  JOBS = INPUTS;
+  JOBS_LEN = INPUTS_LEN;
 
-  // 在汇编代码开头增加其他信息
-  // .file <文件编号> <文件名>
-  fprintf(out, ".file 1 \"%s\"\n", INPUT_PATH);
-  codegen(prog, out);
+  int nthreads = OPT_J ? OPT_J : 1;
+  if (nthreads > INPUTS_LEN)
+    nthreads = INPUTS_LEN;
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 1; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, worker, (void *)(intptr_t)i))
+      error("pthread_create failed");
 
+  // 主线程也参与编译
+  worker(NULL);
+  for (int i = 1; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
   return 0;
 }
@@ -1,4 +1,7 @@
 #include "rvcc.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 //
 // 二、语法分析， 生成AST
@@ -7,20 +10,35 @@
 // 局部和全局变量的域
 typedef struct VarScope VarScope;
 struct VarScope {
-  VarScope *next; // 下一变量域
-  char *name;     // 变量域名称
-  Object *var;    // 对应的变量
+  VarScope *next;   // 同一块域内的下一变量域
+  VarScope *shadow; // 被当前变量域遮蔽的外层同名变量域
+  char *name;       // 变量域名称
+  Object *var;      // 对应的变量
+  int seq;          // 全局变量的声明序号，局部变量为 INT_MAX
 };
 
 // 代码块域
+//
+// vars 同时作为撤销日志：离开块域时按头插的逆序恢复被遮蔽的变量域
 typedef struct BlockScope BlockScope;
 struct BlockScope {
   BlockScope *next; // 指向上一级的域
   VarScope *vars;   // 指向当前域内的变量
 };
 
-// 所有域的链表
-static BlockScope *BLOCK_SCOPES = &(BlockScope){};
+// 所有域的链表，最外层为全局域
+static _Thread_local BlockScope *BLOCK_SCOPES;
+
+// 变量名到当前可见变量域的映射，查找时无需遍历所有块域
+static _Thread_local HashMap VISIBLE_VARS;
+
+// 已声明的全局变量(包括函数)的数量，即下一个全局变量的序号
+static _Thread_local int GLOBAL_SEQ;
+
+// 并行解析函数体时 VISIBLE_VARS 中只有局部变量，全局变量在共用的
+// GLOBAL_SCOPE 中查找，其中只有序号小于 GLOBAL_LIMIT 的在函数体中可见
+static _Thread_local HashMap *GLOBAL_SCOPE;
+static _Thread_local int GLOBAL_LIMIT;
 
 /**
  * 进入块域
@@ -28,7 +46,7 @@ static BlockScope *BLOCK_SCOPES = &(BlockScope){};
  * 进入一个域，则将此域以头插法插入到BLOCK_SCOPES中
  */
 static void enter_scope(void) {
-  BlockScope *scope = calloc(1, sizeof(BlockScope));
+  BlockScope *scope = arena_alloc(ARENA_LOCAL, sizeof(BlockScope));
   scope->next = BLOCK_SCOPES;
   BLOCK_SCOPES = scope;
 }
@@ -36,9 +54,19 @@ static void enter_scope(void) {
 /**
  * 离开块域
  *
- * 移动BLOCK_SCOPES至上一个块域（链表头的next）
+ * 撤销当前块域内的所有变量域，恢复被其遮蔽的外层变量域，
+ * 然后移动BLOCK_SCOPES至上一个块域（链表头的next）
  */
-static void leave_scope(void) { BLOCK_SCOPES = BLOCK_SCOPES->next; }
+static void leave_scope(void) {
+  for (VarScope *var_scope = BLOCK_SCOPES->vars; var_scope;
+       var_scope = var_scope->next) {
+    if (var_scope->shadow)
+      hashmap_put(&VISIBLE_VARS, var_scope->name, var_scope->shadow);
+    else
+      hashmap_delete(&VISIBLE_VARS, var_scope->name);
+  }
+  BLOCK_SCOPES = BLOCK_SCOPES->next;
+}
 
 /**
  * 向块域插入变量
@@ -49,9 +77,15 @@ static void leave_scope(void) { BLOCK_SCOPES = BLOCK_SCOPES->next; }
  * @return 构造好的变量域
  */
 static VarScope *push_scope(char *name, Object *var) {
-  VarScope *var_scope = calloc(1, sizeof(VarScope));
+  VarScope *var_scope =
+      arena_alloc(var->is_local ? ARENA_LOCAL : ARENA_SYMBOL, sizeof(VarScope));
   var_scope->name = name;
   var_scope->var = var;
+  var_scope->seq = var->is_local ? INT_MAX : GLOBAL_SEQ++;
+
+  // 遮蔽外层（或同一块域内先前声明的）同名变量域
+  var_scope->shadow = hashmap_get(&VISIBLE_VARS, name);
+  hashmap_put(&VISIBLE_VARS, name, var_scope);
 
   // 将变量域以头插法的形式插入到当前的块域中
   var_scope->next = BLOCK_SCOPES->vars;
@@ -60,62 +94,58 @@ static VarScope *push_scope(char *name, Object *var) {
 }
 
 /**
- * 在所有块域中搜索与 ident token 同名的变量
+ * 查找与 ident token 同名的可见变量
  *
  * @param token 要检索的变量所属的token
  *
  * @return 匹配到的变量，没有找到则返回NULL
  */
-static Object *find_var_by_token(Token *token) {
-
-  // 从当前块域开始检索
-  for (BlockScope *scope = BLOCK_SCOPES; scope; scope = scope->next) {
-    // 遍历此块域的所有变量
-    for (VarScope *var_scope = scope->vars; var_scope;
-         var_scope = var_scope->next) {
-      if (equal(token, var_scope->name))
-        return var_scope->var;
-    }
+static Object *find_var_by_token(Token token) {
+  VarScope *var_scope = hashmap_get2(&VISIBLE_VARS, tok_loc(token), tok_len(token));
+
+  // 跳过在函数之后才声明的同名全局变量
+  if (!var_scope && GLOBAL_SCOPE) {
+    var_scope = hashmap_get2(GLOBAL_SCOPE, tok_loc(token), tok_len(token));
+    while (var_scope && var_scope->seq >= GLOBAL_LIMIT)
+      var_scope = var_scope->shadow;
   }
-  return NULL;
+  return var_scope ? var_scope->var : NULL;
 }
 
 // 变量实例均保存在全局的 LOCALS 链表中
-Object *LOCALS;
-Object *GLOBALS;
-
-// 获取标识符字符串
-static char *get_ident(Token *token) {
-  if (token->kind != TK_IDENT)
-    error_token(token, "expected an identifier");
-  return strndup(token->loc, token->len);
-}
+static _Thread_local Object *LOCALS;
+static _Thread_local Object *GLOBALS;
 
 // 获取数字
-static int get_num(Token *token) {
-  if (token->kind != TK_NUM)
+static int get_num(Token token) {
+  if (tok_kind(token) != TK_NUM)
     error_token(token, "expected a number");
 
-  return token->val;
+  return tok_val(token);
 }
 
 // 判断是否为类型名称
-static bool is_typename(Token *token) {
+static bool is_typename(Token token) {
   return equal(token, "char") | equal(token, "int");
 }
 
 /**
  * 创建新的变量
  *
+ * 局部变量及其变量域分配在局部区域中，函数生成代码后即可释放
+ *
  * @param name 变量的名称
  * @param type 变量的类型
+ * @param is_local 是否为局部变量
  *
  * @return 构造号的变量
  */
-static Object *new_var(char *name, Type *type) {
-  Object *var = calloc(1, sizeof(Object));
+static Object *new_var(char *name, Type *type, bool is_local) {
+  Object *var =
+      arena_alloc(is_local ? ARENA_LOCAL : ARENA_SYMBOL, sizeof(Object));
   var->name = name;
   var->type = type;
+  var->is_local = is_local;
 
   // 创建一个与变量名称相同的变量域，并插入到当前块域中
   push_scope(name, var);
@@ -125,8 +155,7 @@ static Object *new_var(char *name, Type *type) {
 // 创建 Local 变量，并头插到 LOCALS 中
 // 头插保证了每次 LOCALS 更新后，LOCALS 链表头都会变
 static Object *new_local_var(char *name, Type *type) {
-  Object *var = new_var(name, type);
-  var->is_local = true;
+  Object *var = new_var(name, type, true);
 
   // 头插法
   var->next = LOCALS;
@@ -136,8 +165,7 @@ static Object *new_local_var(char *name, Type *type) {
 
 // 创建 Global 变量，并头插到 GLOBALS 中
 static Object *new_global_var(char *name, Type *type) {
-  Object *var = new_var(name, type);
-  var->is_local = false;
+  Object *var = new_var(name, type, false);
 
   // 头插法
   var->next = GLOBALS;
@@ -145,144 +173,316 @@ static Object *new_global_var(char *name, Type *type) {
   return var;
 }
 
+// 正在解析的函数
+static _Thread_local Object *CUR_FUNC;
+// 当前函数中已生成的匿名变量数量
+static _Thread_local int UNIQUE_ID;
+
 // 生成唯一的变量名称(对匿名变量而言)
+// 名称中含有所在的函数，一个函数的变化不会改变其他函数中的名称
 static char *new_unique_name(void) {
-  static int id = 0;
-  return format(".L..%d", id++);
+  return format(".L..%s.%d", CUR_FUNC->name, UNIQUE_ID++);
 }
 
-// 创建匿名的 Global 变量
-static Object *new_anon_glabol_var(Type *type) {
-  return new_global_var(new_unique_name(), type);
-}
-
-// 新增字符串字面量
+// 新增字符串字面量，头插到所在函数的 literals 中
+// 字面量随函数一起生成，不加入任何作用域
 static Object *new_string_literal(char *str, Type *type) {
-  Object *var = new_anon_glabol_var(type);
+  Object *var = arena_alloc(ARENA_SYMBOL, sizeof(Object));
+  var->name = new_unique_name();
+  var->type = type;
   // 字面量的初始值为双引号包裹的部分，而不包括双引号
   var->init_data = str;
+  var->next = CUR_FUNC->literals;
+  CUR_FUNC->literals = var;
   return var;
 }
 
-// 递归地将函数形参加入到 Local 中
+// 最近一次解析的函数声明符中各形参标识符的位置
+// 规范类型不保存名称，因此形参的名称单独记录在这里
+static _Thread_local SrcLoc *PARAM_NAMES;
+
+// 将函数形参逆序头插到 Local 中，使 LOCALS 按形参的顺序排列
 static void insert_param_to_locals(Type *type) {
-  if (type) {
-    insert_param_to_locals(type->next);
-    new_local_var(get_ident(type->token), type);
+  for (int i = type->nparams - 1; i >= 0; i--)
+    new_local_var(srcloc_ident(PARAM_NAMES[i]), type->params[i]);
+}
+
+// 节点池每块中节点数量的位数
+#define NODE_CHUNK_BITS 8
+// 节点池每块中节点的数量
+#define NODE_CHUNK_SIZE (1 << NODE_CHUNK_BITS)
+
+// 节点池
+//
+// 节点按块分配，块的地址固定，因此节点的地址也不会随节点池增长而改变
+struct NodePool {
+  Node **chunks;      // 节点块
+  uint32_t chunk_cap; // 节点块数组的容量
+  uint32_t len;       // 节点的数量(包括下标为0的空节点)
+
+  NodeId *kids;       // 子节点侧表
+  uint32_t kids_len;  // 侧表中子节点的数量
+  uint32_t kids_cap;  // 侧表的容量
+};
+
+// 当前函数的节点池
+static _Thread_local NodePool *CUR_POOL;
+
+// 正在构造的节点栈
+// 子节点列表、二元表达式的操作数等嵌套地压入栈中，构造完成后再弹出，
+// 子节点列表弹出时整体复制到节点池的侧表中
+static _Thread_local NodeId *NODE_STACK;
+static _Thread_local int NODE_STACK_LEN;
+static _Thread_local int NODE_STACK_CAP;
+
+typedef struct BinOp BinOp;
+
+// 尚未归约的运算符
+// 运算符的终结符可能在归约前就已移出终结符流，因此只记录归约所需的信息
+typedef struct {
+  NodeKind kind; // 节点种类
+  BinOp *bin;    // 二元运算符，其余运算符为 NULL
+  SrcLoc loc;    // 运算符的位置
+} PendingOp;
+
+// 尚未归约的运算符栈，用于迭代地解析二元、一元表达式及 else if 链
+static _Thread_local PendingOp *OP_STACK;
+static _Thread_local int OP_STACK_LEN;
+static _Thread_local int OP_STACK_CAP;
+
+// 语句、括号等递归结构的嵌套深度
+static _Thread_local int NEST_DEPTH;
+// 嵌套深度的上限，超过时报错，避免耗尽本机栈
+#define MAX_NEST_DEPTH 2048
+
+// 创建一个空的节点池
+NodePool *new_node_pool(void) {
+  NodePool *pool = arena_alloc(ARENA_AST, sizeof(NodePool));
+  // 占用下标 0 作为空节点
+  pool->len = 1;
+  pool->chunk_cap = 16;
+  pool->chunks = arena_alloc(ARENA_AST, pool->chunk_cap * sizeof(Node *));
+  pool->chunks[0] = arena_alloc(ARENA_AST, NODE_CHUNK_SIZE * sizeof(Node));
+  return pool;
+}
+
+// 返回节点池中的节点，节点的地址在节点池存续期间不会改变
+Node *node_at(NodePool *pool, NodeId id) {
+  return &pool->chunks[id >> NODE_CHUNK_BITS][id & (NODE_CHUNK_SIZE - 1)];
+}
+
+// 返回节点的第 i 个子节点
+NodeId node_kid(NodePool *pool, Node *node, int i) {
+  return pool->kids[node->kids + i];
+}
+
+// 在节点池中分配一个节点
+static NodeId alloc_node(NodePool *pool) {
+  NodeId id = pool->len++;
+  uint32_t chunk = id >> NODE_CHUNK_BITS;
+  if ((id & (NODE_CHUNK_SIZE - 1)) == 0) {
+    // 节点块数组已满，扩容（旧数组随区域一起释放）
+    if (chunk == pool->chunk_cap) {
+      Node **chunks = arena_alloc(ARENA_AST, chunk * 2 * sizeof(Node *));
+      memcpy(chunks, pool->chunks, chunk * sizeof(Node *));
+      pool->chunks = chunks;
+      pool->chunk_cap = chunk * 2;
+    }
+    pool->chunks[chunk] =
+        arena_alloc(ARENA_AST, NODE_CHUNK_SIZE * sizeof(Node));
+  }
+  return id;
+}
+
+// 将 n 个子节点连续地复制到节点池的侧表中，返回第一个子节点的下标
+static uint32_t add_kids(NodePool *pool, NodeId *ids, int n) {
+  if (pool->kids_len + n > pool->kids_cap) {
+    uint32_t cap = pool->kids_cap ? pool->kids_cap : 64;
+    while (cap < pool->kids_len + n)
+      cap *= 2;
+    NodeId *kids = arena_alloc(ARENA_AST, cap * sizeof(NodeId));
+    if (pool->kids)
+      memcpy(kids, pool->kids, pool->kids_len * sizeof(NodeId));
+    pool->kids = kids;
+    pool->kids_cap = cap;
   }
+
+  uint32_t start = pool->kids_len;
+  memcpy(pool->kids + start, ids, n * sizeof(NodeId));
+  pool->kids_len += n;
+  return start;
+}
+
+// 返回当前节点池中的节点
+static Node *get_node(NodeId id) { return node_at(CUR_POOL, id); }
+
+// 将节点压入节点栈中
+static void push_node(NodeId id) {
+  if (NODE_STACK_LEN == NODE_STACK_CAP) {
+    NODE_STACK_CAP = NODE_STACK_CAP ? NODE_STACK_CAP * 2 : 64;
+    NODE_STACK = realloc(NODE_STACK, NODE_STACK_CAP * sizeof(NodeId));
+    if (!NODE_STACK)
+      error("out of memory");
+  }
+  NODE_STACK[NODE_STACK_LEN++] = id;
+}
+
+// 将运算符压入运算符栈中
+static void push_op(NodeKind kind, BinOp *bin, Token token) {
+  if (OP_STACK_LEN == OP_STACK_CAP) {
+    OP_STACK_CAP = OP_STACK_CAP ? OP_STACK_CAP * 2 : 64;
+    OP_STACK = realloc(OP_STACK, OP_STACK_CAP * sizeof(PendingOp));
+    if (!OP_STACK)
+      error("out of memory");
+  }
+  OP_STACK[OP_STACK_LEN++] = (PendingOp){kind, bin, tok_srcloc(token)};
+}
+
+// 进入一层递归结构，嵌套过深时报错
+static void enter_nest(Token token) {
+  if (++NEST_DEPTH > MAX_NEST_DEPTH)
+    error_token(token, "nesting is too deep");
 }
 
+// 离开一层递归结构
+static void leave_nest(void) { NEST_DEPTH--; }
+
 // Node 的构造方法
-static Node *new_node(NodeKind kind, Token *token) {
-  Node *node = calloc(1, sizeof(Node));
+// 节点的类型由各构造方法在设置完子节点后调用 add_type 计算
+static NodeId new_node(NodeKind kind, SrcLoc loc) {
+  NodeId id = alloc_node(CUR_POOL);
+  Node *node = get_node(id);
   node->kind = kind;
-  node->token = token;
-  return node;
+  node->loc = loc;
+  return id;
+}
+
+// 构造带有 n 个子节点的节点
+static NodeId new_node_kids(NodeKind kind, NodeId *kids, int n, SrcLoc loc) {
+  NodeId id = new_node(kind, loc);
+  Node *node = get_node(id);
+  node->kids = add_kids(CUR_POOL, kids, n);
+  node->nkids = n;
+  add_type(CUR_POOL, id);
+  return id;
 }
 
-static Node *new_node_unary(NodeKind kind, Node *expr, Token *token) {
-  Node *node = new_node(kind, token);
+// 以栈中 base 之上的节点为子节点构造节点，并将其弹出
+static NodeId new_node_list(NodeKind kind, int base, SrcLoc loc) {
+  NodeId id =
+      new_node_kids(kind, NODE_STACK + base, NODE_STACK_LEN - base, loc);
+  NODE_STACK_LEN = base;
+  return id;
+}
+
+static NodeId new_node_unary(NodeKind kind, NodeId expr, SrcLoc loc) {
+  NodeId id = new_node(kind, loc);
   // 单臂默认使用 lhs
-  node->lhs = expr;
-  return node;
+  get_node(id)->lhs = expr;
+  add_type(CUR_POOL, id);
+  return id;
 }
 
-static Node *new_node_bin(NodeKind kind, Node *lhs, Node *rhs, Token *token) {
-  Node *node = new_node(kind, token);
+static NodeId new_node_bin(NodeKind kind, NodeId lhs, NodeId rhs, SrcLoc loc) {
+  NodeId id = new_node(kind, loc);
+  Node *node = get_node(id);
   node->lhs = lhs;
   node->rhs = rhs;
-  return node;
+  add_type(CUR_POOL, id);
+  return id;
 }
 
-static Node *new_node_num(int val, Token *token) {
-  Node *node = new_node(ND_NUM, token);
-  node->val = val;
-  return node;
+static NodeId new_node_num(int val, SrcLoc loc) {
+  NodeId id = new_node(ND_NUM, loc);
+  get_node(id)->val = val;
+  add_type(CUR_POOL, id);
+  return id;
 }
 
-static Node *new_node_var(Object *var, Token *token) {
-  Node *node = new_node(ND_VAR, token);
-  node->var = var;
-  return node;
+static NodeId new_node_var(Object *var, SrcLoc loc) {
+  NodeId id = new_node(ND_VAR, loc);
+  get_node(id)->var = var;
+  add_type(CUR_POOL, id);
+  return id;
 }
 
 // 创建ADD节点
 // num | ptr + num | ptr
 // 未声明 Type，因为调用者会使类型与 lhs 相同
-static Node *new_node_add(Node *lhs, Node *rhs, Token *token) {
-  add_type(lhs);
-  add_type(rhs);
+static NodeId new_node_add(NodeId lhs, NodeId rhs, SrcLoc loc) {
+  Type *lhs_type = get_node(lhs)->type;
+  Type *rhs_type = get_node(rhs)->type;
 
   // num + num
-  if (is_integer(lhs->type) && is_integer(rhs->type)) {
-    return new_node_bin(ND_ADD, lhs, rhs, token);
+  if (is_integer(lhs_type) && is_integer(rhs_type)) {
+    return new_node_bin(ND_ADD, lhs, rhs, loc);
   }
 
   // ptr + ptr
   // invalid
-  if (lhs->type->base && rhs->type->base)
-    error_token(token, "invalid operands");
+  if (lhs_type->base && rhs_type->base)
+    error_srcloc(loc, "invalid operands");
 
   // num + ptr
   // change to  ptr + num
-  if (!lhs->type->base && rhs->type->base) {
-    Node *temp = lhs;
+  if (!lhs_type->base && rhs_type->base) {
+    NodeId temp = lhs;
     lhs = rhs;
     rhs = temp;
+    lhs_type = rhs_type;
   }
 
   // 将 ptr + num 转化为 ptr + (num * size) 从而计算地址
   // size 为 ptr 所对应 base 的 size
-  rhs = new_node_bin(ND_MUL, rhs, new_node_num(lhs->type->base->size, token),
-                     token);
-  return new_node_bin(ND_ADD, lhs, rhs, token);
+  rhs = new_node_bin(ND_MUL, rhs, new_node_num(lhs_type->base->size, loc),
+                     loc);
+  return new_node_bin(ND_ADD, lhs, rhs, loc);
 }
 
 // 创建SUB节点
 // num | ptr - num | ptr
 // 未声明 Type，因为调用者会使类型与 lhs 相同
-static Node *new_node_sub(Node *lhs, Node *rhs, Token *token) {
-  add_type(lhs);
-  add_type(rhs);
+static NodeId new_node_sub(NodeId lhs, NodeId rhs, SrcLoc loc) {
+  Type *lhs_type = get_node(lhs)->type;
+  Type *rhs_type = get_node(rhs)->type;
 
   // num + num
-  if (is_integer(lhs->type) && is_integer(rhs->type)) {
-    return new_node_bin(ND_SUB, lhs, rhs, token);
+  if (is_integer(lhs_type) && is_integer(rhs_type)) {
+    return new_node_bin(ND_SUB, lhs, rhs, loc);
   }
 
   // ptr - num
-  if (lhs->type->base && is_integer(rhs->type)) {
-    rhs = new_node_bin(ND_MUL, rhs, new_node_num(lhs->type->base->size, token),
-                       token);
-    return new_node_bin(ND_SUB, lhs, rhs, token);
+  if (lhs_type->base && is_integer(rhs_type)) {
+    rhs = new_node_bin(ND_MUL, rhs, new_node_num(lhs_type->base->size, loc),
+                       loc);
+    return new_node_bin(ND_SUB, lhs, rhs, loc);
   }
 
   // ptr - ptr
   // 计算两个指针之间由多少元素
-  if (lhs->type->base && rhs->type->base) {
-    Node *node = new_node_bin(ND_SUB, lhs, rhs, token);
-    // 注意 ptr - ptr 的类型应当为 INT, 这样才有意义
-    node->type = TYPE_INT;
-    return new_node_bin(ND_DIV, node,
-                        new_node_num(lhs->type->base->size, token), token);
+  if (lhs_type->base && rhs_type->base) {
+    // 注意 ptr - ptr 的类型为 INT, 这样才有意义
+    NodeId node = new_node_bin(ND_SUB, lhs, rhs, loc);
+    return new_node_bin(ND_DIV, node, new_node_num(lhs_type->base->size, loc),
+                        loc);
   }
 
   // num - ptr
-  error_token(token, "invalid operands");
-  return NULL;
+  error_srcloc(loc, "invalid operands");
+  return 0;
 }
 
-// 传入 Token** 与 Token*，
+// 传入 Token* 与 Token，
 // 前者作为结果，让调用者能够感知，后者则作为递归中传递的变量
 // 因此以下任何一个函数执行完毕之后
 // *rest 都必须指向待分析的下一个 token
-// 而参数 Token* 仅是值拷贝，对调用者来说不可感知
-#define PARSER_DEFINE(name) static Node *(name)(Token * *rest, Token * token)
+// 而参数 Token 仅是值拷贝，对调用者来说不可感知
+#define PARSER_DEFINE(name) static NodeId(name)(Token *rest, Token token)
 
 // program = (function_def | global_variable_def) *
-// function_def = declspec function
+// function_def = "static"? declspec function
 // function = declspec declarator "{" compound_stmt*
-// global_variable_def = declspec global_variable
+// global_variable_def = "static"? declspec global_variable
 // global_variable = (declarator ("," declarator))* ";")*
 // declspec = "char" | "int"
 // declarator = "*"* ident type_suf
@@ -301,12 +501,10 @@ static Node *new_node_sub(Node *lhs, Node *rhs, Token *token) {
 //        expr_stmt
 // expr_stmt = expr? ";"
 // expr = assign
-// assign = equality ("=" assign)?
-// equality = relational ("==" relational | "!=" relational)*
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-// add = mul ("+" mul | "-" mul)*
-// mul = unary ("*" unary | "/" unary)*
-// unary = ("+" | "-" | "*" | "&") unary | postfix
+// assign = binary
+// binary = unary (binop unary)*
+//          binop 为二元运算符，优先级及结合性见 BIN_OPS
+// unary = ("+" | "-" | "*" | "&")* postfix
 // postfix = primary ("[" expr "]")*
 // primary = "(" "{" stmt+ "}" ")"
 //           | "(" expr ")"
@@ -322,16 +520,12 @@ PARSER_DEFINE(stmt);
 PARSER_DEFINE(expr_stmt);
 PARSER_DEFINE(expr);
 PARSER_DEFINE(assign);
-PARSER_DEFINE(equality);
-PARSER_DEFINE(relational);
-PARSER_DEFINE(add);
-PARSER_DEFINE(mul);
 PARSER_DEFINE(unary);
 PARSER_DEFINE(postfix);
 PARSER_DEFINE(primary);
 
-static Type *declspec(Token **rest, Token *token);
-static Type *declarator(Token **rest, Token *token, Type *type);
+static Type *declspec(Token *rest, Token token);
+static Type *declarator(Token *rest, Token token, Type *type, SrcLoc *name);
 
 /**
  * func_params = param ("," param)*)? ")"
@@ -343,13 +537,14 @@ static Type *declarator(Token **rest, Token *token, Type *type);
  *
  * @return 构造好的函数的 Type
  */
-static Type *func_params(Token **rest, Token *token, Type *type) {
-  // 存储形参
-  Type head = {};
-  Type *cur = &head;
+static Type *func_params(Token *rest, Token token, Type *type) {
+  // 存储形参的类型及名称
+  Type **params = NULL;
+  SrcLoc *names = NULL;
+  int nparams = 0;
 
   while (!equal(token, ")")) {
-    if (cur != &head)
+    if (nparams)
       token = skip(token, ",");
 
     Type *base_type = declspec(&token, token);
@@ -357,18 +552,25 @@ static Type *func_params(Token **rest, Token *token, Type *type) {
     // declarator 的前几个参数会先准备好，然后再调用 declspec
     // 而因此导致的 token 变化无法被 declarator 感知
     // 因此不能将 declspec 进行嵌套
-    Type *dec_type = declarator(&token, token, base_type);
-
-    // dec_type 为局部变量，地址不会改变，因此每次都需要拷贝，否则链表就会成环
-    cur->next = copy_type(dec_type);
-    cur = cur->next;
+    SrcLoc name;
+    Type *param_type = declarator(&token, token, base_type, &name);
+
+    params = realloc(params, (nparams + 1) * sizeof(Type *));
+    names = realloc(names, (nparams + 1) * sizeof(SrcLoc));
+    params[nparams] = param_type;
+    names[nparams] = name;
+    nparams++;
   }
 
   // 将参数加入到函数 Type 中
-  type = func_type(type);
-  type->params = head.next;
+  type = func_type(type, params, nparams);
 
-  *rest = token->next;
+  // 记录形参的名称，供函数定义使用
+  free(PARAM_NAMES);
+  PARAM_NAMES = names;
+  free(params);
+
+  *rest = token + 1;
   return type;
 }
 
@@ -379,13 +581,13 @@ static Type *func_params(Token **rest, Token *token, Type *type) {
  * @param token 正在处理的 token
  * @return 构造好的 Type。
  */
-static Type *type_suf(Token **rest, Token *token, Type *type) {
+static Type *type_suf(Token *rest, Token token, Type *type) {
   if (equal(token, "(")) // 函数
-    return func_params(rest, token->next, type);
+    return func_params(rest, token + 1, type);
 
   if (equal(token, "[")) {
-    int len = get_num(token->next);
-    token = skip(token->next->next, "]");
+    int len = get_num(token + 1);
+    token = skip(token + 2, "]");
     type = type_suf(rest, token, type);
     return array_type(type, len);
   }
@@ -401,9 +603,9 @@ static Type *type_suf(Token **rest, Token *token, Type *type) {
  * @param token 正在处理的 token
  * @return 构造好的 Type。
  */
-static Type *declspec(Token **rest, Token *token) {
+static Type *declspec(Token *rest, Token token) {
   if (equal(token, "char")) {
-    *rest = token->next;
+    *rest = token + 1;
     return TYPE_CHAR;
   }
   *rest = skip(token, "int");
@@ -418,53 +620,57 @@ static Type *declspec(Token **rest, Token *token) {
  *
  * @param rest 指向剩余token指针的指针
  * @param token 正在处理的 token
+ * @param name 保存 ident 的位置
  * @return 构造好的 Type。
  */
-static Type *declarator(Token **rest, Token *token, Type *type) {
+static Type *declarator(Token *rest, Token token, Type *type, SrcLoc *name) {
   // 处理多个 *
   // var, * -> * -> * -> * -> base_type
   while (consume(&token, token, "*")) {
     type = pointer_type(type);
   }
 
-  if (token->kind != TK_IDENT)
+  if (tok_kind(token) != TK_IDENT)
     error_token(token, "expected a variable name");
 
+  // 规范类型中不保存名称，ident 的位置单独返回给调用者
+  // 解析 type_suf 之后 ident 可能已移出终结符流，因此先记录
+  *name = tok_srcloc(token);
+
   // 若是变量，则保有传入的 type
   // 若是函数，则type会变为 FUNC， 并指向传入的类型
-  type = type_suf(rest, token->next, type);
-
-  // 将 TK_IDENT token 保存到 type 中
-  type->token = token;
+  type = type_suf(rest, token + 1, type);
 
   return type;
 }
 
 // compound_stmt = (declaration | stmt)* "}"
 PARSER_DEFINE(compound_stmt) {
-  Node head = {};
-  Node *cur = &head;
-  Node *node = new_node(ND_BLOCK, token);
+  SrcLoc start = tok_srcloc(token);
+  int base = NODE_STACK_LEN;
+  enter_nest(token);
 
   // 进入当前块域
   enter_scope();
 
   while (!equal(token, "}")) {
+    // 语句之间不会回看之前的终结符
+    release_tokens(token);
+
+    NodeId node;
     if (is_typename(token))
-      cur->next = declaration(&token, token);
+      node = declaration(&token, token);
     else
-      cur->next = stmt(&token, token);
-    cur = cur->next;
-    // 构造 stmt AST 之后，进行 add_type
-    add_type(cur);
+      node = stmt(&token, token);
+    push_node(node);
   }
 
   // 离开当前块域
   leave_scope();
+  leave_nest();
 
-  node->body = head.next;
-  *rest = token->next;
-  return node;
+  *rest = token + 1;
+  return new_node_list(ND_BLOCK, base, start);
 }
 
 // declaration =
@@ -473,8 +679,7 @@ PARSER_DEFINE(declaration) {
   Type *base_type = declspec(&token, token);
 
   // 处理多个 declarator ("=" expr)?
-  Node head = {};
-  Node *cur = &head;
+  int base = NODE_STACK_LEN;
 
   int i = 0;
   while (!equal(token, ";")) {
@@ -484,28 +689,26 @@ PARSER_DEFINE(declaration) {
       token = skip(token, ",");
 
     // 获取变量类型
-    Type *type = declarator(&token, token, base_type);
+    SrcLoc name;
+    Type *type = declarator(&token, token, base_type, &name);
     // 构造一个变量
-    Object *var = new_local_var(get_ident(type->token), type);
+    Object *var = new_local_var(srcloc_ident(name), type);
 
-    // 不存在赋值，则进行跳过(这种情况下cur不会进行更新，因此不能通过cur判断是否要跳过`,`)
+    // 不存在赋值，则进行跳过(这种情况下不会产生子节点，因此不能通过子节点判断是否要跳过`,`)
     if (!equal(token, "="))
       continue;
 
     // 左值为变量
-    Node *lhs = new_node_var(var, type->token);
+    NodeId lhs = new_node_var(var, name);
     // 解析赋值语句
-    Node *rhs = assign(&token, token->next);
-    Node *node = new_node_bin(ND_ASSIGN, lhs, rhs, token);
+    NodeId rhs = assign(&token, token + 1);
+    NodeId node = new_node_bin(ND_ASSIGN, lhs, rhs, tok_srcloc(token));
 
-    cur->next = new_node_unary(ND_EXPR_STMT, node, token);
-    cur = cur->next;
+    push_node(new_node_unary(ND_EXPR_STMT, node, tok_srcloc(token)));
   }
 
-  Node *node = new_node(ND_BLOCK, token);
-  node->body = head.next;
   *rest = token;
-  return node;
+  return new_node_list(ND_BLOCK, base, tok_srcloc(token));
 }
 
 // stmt = "return" expr ";"|
@@ -518,56 +721,90 @@ PARSER_DEFINE(stmt) {
 
   // 解析 return 语句
   if (equal(token, "return")) {
-    Node *node = new_node(ND_RETURN, token);
-    node->lhs = expr(&token, token->next);
+    SrcLoc start = tok_srcloc(token);
+    NodeId expr_node = expr(&token, token + 1);
     *rest = skip(token, ";");
-    return node;
+    return new_node_unary(ND_RETURN, expr_node, start);
   }
 
   // 解析 if 语句
+  // else if 链被迭代地解析，再由内向外构造，链再长也不会加深本机栈
   if (equal(token, "if")) {
-    Node *node = new_node(ND_IF, token);
-    token = skip(token->next, "(");
-    node->cond = expr(&token, token);
-    token = skip(token, ")");
-    node->then = stmt(&token, token);
-    if (equal(token, "else"))
-      node->els = stmt(&token, token->next);
+    int base = NODE_STACK_LEN;
+    int op_base = OP_STACK_LEN;
+    NodeId els = 0;
+
+    while (true) {
+      push_op(ND_IF, NULL, token);
+      token = skip(token + 1, "(");
+      push_node(expr(&token, token));
+      token = skip(token, ")");
+      enter_nest(token);
+      push_node(stmt(&token, token));
+      leave_nest();
+
+      if (!equal(token, "else"))
+        break;
+      token = token + 1;
+
+      // else 之后不是 if，则为最后一个分支
+      if (!equal(token, "if")) {
+        els = stmt(&token, token);
+        break;
+      }
+    }
+
+    while (OP_STACK_LEN > op_base) {
+      SrcLoc start = OP_STACK[--OP_STACK_LEN].loc;
+      NodeId kids[3];
+      kids[KID_THEN] = NODE_STACK[--NODE_STACK_LEN];
+      kids[KID_COND] = NODE_STACK[--NODE_STACK_LEN];
+      kids[KID_ELS] = els;
+      els = new_node_kids(ND_IF, kids, 3, start);
+    }
+    assert(NODE_STACK_LEN == base);
+
     *rest = token;
-    return node;
+    return els;
   }
 
   // 解析 for 语句
   if (equal(token, "for")) {
-    Node *node = new_node(ND_FOR, token);
-    token = skip(token->next, "(");
-    node->init = expr_stmt(&token, token);
+    SrcLoc start = tok_srcloc(token);
+    NodeId kids[4] = {};
+    enter_nest(token);
+    token = skip(token + 1, "(");
+    kids[KID_INIT] = expr_stmt(&token, token);
 
     if (!equal(token, ";"))
-      node->cond = expr(&token, token);
+      kids[KID_COND] = expr(&token, token);
     token = skip(token, ";");
 
     if (!equal(token, ")"))
-      node->inc = expr(&token, token);
+      kids[KID_INC] = expr(&token, token);
     token = skip(token, ")");
 
-    node->then = stmt(rest, token);
-    return node;
+    kids[KID_THEN] = stmt(rest, token);
+    leave_nest();
+    return new_node_kids(ND_FOR, kids, 4, start);
   }
 
   // 解析 while 语句
   if (equal(token, "while")) {
-    Node *node = new_node(ND_FOR, token);
-    token = skip(token->next, "(");
-    node->cond = expr(&token, token);
+    SrcLoc start = tok_srcloc(token);
+    NodeId kids[4] = {};
+    enter_nest(token);
+    token = skip(token + 1, "(");
+    kids[KID_COND] = expr(&token, token);
     token = skip(token, ")");
-    node->then = stmt(rest, token);
-    return node;
+    kids[KID_THEN] = stmt(rest, token);
+    leave_nest();
+    return new_node_kids(ND_FOR, kids, 4, start);
   }
 
   // 解析代码块
   if (equal(token, "{")) {
-    return compound_stmt(rest, token->next);
+    return compound_stmt(rest, token + 1);
   }
 
   // 解析 expr
@@ -577,167 +814,179 @@ PARSER_DEFINE(stmt) {
 // expr_stmt = expr? ";"
 PARSER_DEFINE(expr_stmt) {
   if (equal(token, ";")) {
-    *rest = token->next;
-    return new_node(ND_BLOCK, token);
+    *rest = token + 1;
+    return new_node_kids(ND_BLOCK, NULL, 0, tok_srcloc(token));
   }
 
-  Node *node = new_node(ND_EXPR_STMT, token);
-  node->lhs = expr(&token, token);
+  SrcLoc start = tok_srcloc(token);
+  NodeId node = expr(&token, token);
   *rest = skip(token, ";");
-  return node;
+  return new_node_unary(ND_EXPR_STMT, node, start);
 }
 
 // expr = assign
 PARSER_DEFINE(expr) { return assign(rest, token); }
 
-// assign = equality ("=" assign)?
-PARSER_DEFINE(assign) {
-  Node *node = equality(&token, token);
+// 二元运算符的优先级，数值越大结合越紧密
+enum {
+  PREC_ASSIGN = 1, // =
+  PREC_EQUALITY,   // == !=
+  PREC_RELATIONAL, // < <= > >=
+  PREC_ADD,        // + -
+  PREC_MUL,        // * /
+};
 
-  // a=b=1;
-  if (equal(token, "="))
-    return new_node_bin(ND_ASSIGN, node, assign(rest, token->next), token);
-  *rest = token;
-  return node;
-}
+// 二元运算符
+struct BinOp {
+  char *op;         // 运算符
+  int prec;         // 优先级
+  NodeKind kind;    // 对应的节点种类
+  bool swap;        // 是否交换左右操作数，lhs > rhs == rhs < lhs
+  bool right_assoc; // 是否右结合，a=b=1
+};
 
-// equality = relational ("==" relational | "!=" relational)*
-PARSER_DEFINE(equality) {
-  Node *node = relational(&token, token);
-  while (true) {
-    Token *start = token;
-    if (equal(token, "==")) {
-      node = new_node_bin(ND_EQ, node, relational(&token, token->next), start);
-      continue;
-    }
+// 二元运算符表
+static BinOp BIN_OPS[] = {
+    {"=", PREC_ASSIGN, ND_ASSIGN, false, true},
+    {"==", PREC_EQUALITY, ND_EQ},
+    {"!=", PREC_EQUALITY, ND_NE},
+    {"<", PREC_RELATIONAL, ND_LT},
+    {"<=", PREC_RELATIONAL, ND_LE},
+    {">", PREC_RELATIONAL, ND_LT, true},
+    {">=", PREC_RELATIONAL, ND_LE, true},
+    {"+", PREC_ADD, ND_ADD},
+    {"-", PREC_ADD, ND_SUB},
+    {"*", PREC_MUL, ND_MUL},
+    {"/", PREC_MUL, ND_DIV},
+};
 
-    if (equal(token, "!=")) {
-      node = new_node_bin(ND_NE, node, relational(&token, token->next), start);
-      continue;
-    }
-    break;
-  }
+// 返回 token 对应的二元运算符，不是二元运算符则返回NULL
+static BinOp *find_bin_op(Token token) {
+  if (tok_kind(token) != TK_PUNCT)
+    return NULL;
 
-  *rest = token;
-  return node;
+  for (int i = 0; i < sizeof(BIN_OPS) / sizeof(*BIN_OPS); i++)
+    if (equal(token, BIN_OPS[i].op))
+      return &BIN_OPS[i];
+  return NULL;
 }
 
-// relational = add ("<" add | "<=" add | ">" add | ">=" add)*
-PARSER_DEFINE(relational) {
-  Node *node = add(&token, token);
+// 构造二元运算符对应的节点
+static NodeId new_node_bin_op(BinOp *op, NodeId lhs, NodeId rhs, SrcLoc loc) {
+  // num | ptr + num | ptr 需要按指针的基类大小进行缩放
+  if (op->kind == ND_ADD)
+    return new_node_add(lhs, rhs, loc);
+  if (op->kind == ND_SUB)
+    return new_node_sub(lhs, rhs, loc);
+
+  if (op->swap)
+    return new_node_bin(op->kind, rhs, lhs, loc);
+  return new_node_bin(op->kind, lhs, rhs, loc);
+}
 
-  while (true) {
-    Token *start = token;
-    if (equal(token, "<")) {
-      node = new_node_bin(ND_LT, node, add(&token, token->next), start);
-      continue;
-    }
+// 归约运算符栈顶的二元运算符及操作数栈顶的两个操作数
+static void reduce_bin_op(void) {
+  PendingOp op = OP_STACK[--OP_STACK_LEN];
+  NodeId rhs = NODE_STACK[--NODE_STACK_LEN];
+  NodeId lhs = NODE_STACK[--NODE_STACK_LEN];
+  push_node(new_node_bin_op(op.bin, lhs, rhs, op.loc));
+}
 
-    if (equal(token, "<=")) {
-      node = new_node_bin(ND_LE, node, add(&token, token->next), start);
-      continue;
-    }
+/**
+ * binary = unary (binop unary)*
+ *
+ * 借助操作数栈与运算符栈迭代地进行优先级爬升：
+ * 新的运算符入栈前，先归约栈顶所有结合得更紧密的运算符。
+ * 每个操作数只需一次 unary 调用，且无论表达式多长都不会加深本机栈
+ */
+static NodeId binary(Token *rest, Token token) {
+  int base = NODE_STACK_LEN;
+  int op_base = OP_STACK_LEN;
 
-    // lhs > rhs == rhs < lhs
-    if (equal(token, ">")) {
-      node = new_node_bin(ND_LT, add(&token, token->next), node, start);
-      continue;
-    }
+  push_node(unary(&token, token));
 
-    if (equal(token, ">=")) {
-      node = new_node_bin(ND_LE, add(&token, token->next), node, start);
-      continue;
+  while (true) {
+    BinOp *op = find_bin_op(token);
+
+    // 栈顶运算符优先级更高，或优先级相同且为左结合时先归约
+    while (OP_STACK_LEN > op_base) {
+      BinOp *top = OP_STACK[OP_STACK_LEN - 1].bin;
+      if (op && (top->prec < op->prec ||
+                 (top->prec == op->prec && op->right_assoc)))
+        break;
+      reduce_bin_op();
     }
-    break;
+
+    if (!op)
+      break;
+
+    push_op(op->kind, op, token);
+    // 操作数之间不会回看之前的终结符，超长的表达式也只占用有限的缓冲区
+    release_tokens(token + 1);
+    push_node(unary(&token, token + 1));
   }
 
+  assert(NODE_STACK_LEN == base + 1);
   *rest = token;
-  return node;
+  return NODE_STACK[--NODE_STACK_LEN];
 }
 
-// add = mul ("+" mul | "-" mul)*
-PARSER_DEFINE(add) {
-  Node *node = mul(&token, token);
+// assign = binary
+PARSER_DEFINE(assign) { return binary(rest, token); }
+
+// unary = ("+" | "-" | "*" | "&")* postfix
+PARSER_DEFINE(unary) {
+  int op_base = OP_STACK_LEN;
 
-  // 遍历并构造多个 mul
-  // expr 由多个 mul 相加减构成
-  // 因此在生成一个 mul 之后，需要判断后续的 token 是否为 +|-
-  // 来决定是否继续生成 mul，直到不能构成 mul
+  // 迭代地收集所有前缀运算符
   while (true) {
-    Token *start = token;
+    // + 一元运算符无影响，跳过即可
     if (equal(token, "+")) {
-      node = new_node_add(node, mul(&token, token->next), start);
+      token = token + 1;
       continue;
     }
 
     if (equal(token, "-")) {
-      node = new_node_sub(node, mul(&token, token->next), start);
+      push_op(ND_NEG, NULL, token);
+      token = token + 1;
       continue;
     }
-    break;
-  }
-
-  // 完成一个 expr 构造后，设置rest指向的为 不是 expr 的第一个 token
-  // 返回 expr AST 的根节点
-  *rest = token;
-  return node;
-}
 
-// mul = unary ("*" unary | "/" unary)*
-PARSER_DEFINE(mul) {
-  Node *node = unary(&token, token);
-
-  while (true) {
-    Token *start = token;
     if (equal(token, "*")) {
-      node = new_node_bin(ND_MUL, node, unary(&token, token->next), start);
+      push_op(ND_DEREF, NULL, token);
+      token = token + 1;
       continue;
     }
-    if (equal(token, "/")) {
-      node = new_node_bin(ND_DIV, node, unary(&token, token->next), start);
+
+    if (equal(token, "&")) {
+      push_op(ND_ADDR, NULL, token);
+      token = token + 1;
       continue;
     }
     break;
   }
 
-  *rest = token;
-  return node;
-}
-
-// unary = ("+" | "-" | "*" | "&") unary | postfix
-PARSER_DEFINE(unary) {
-  // + 一元运算符无影响，跳过即可
-  // unary无论如何都会调用 primary 进行 rest 的设置
-  // 因此递归调用 unary 时，传入 rest 即可
-  // 否则则需要在每次生成新节点后，手动地再设置 rest
+  NodeId node = postfix(rest, token);
 
-  // "+" unary
-  if (equal(token, "+"))
-    return unary(rest, token->next);
-
-  // "+" unary
-  if (equal(token, "-"))
-    return new_node_unary(ND_NEG, unary(rest, token->next), token);
-
-  // "*" unary
-  if (equal(token, "*"))
-    return new_node_unary(ND_DEREF, unary(rest, token->next), token);
-
-  // "&" unary
-  if (equal(token, "&"))
-    return new_node_unary(ND_ADDR, unary(rest, token->next), token);
+  // 由内向外构造一元运算符节点
+  while (OP_STACK_LEN > op_base) {
+    PendingOp op = OP_STACK[--OP_STACK_LEN];
+    node = new_node_unary(op.kind, node, op.loc);
+  }
 
-  return postfix(rest, token);
+  return node;
 }
 
 // postfix = primary ("[" expr "]")*
 PARSER_DEFINE(postfix) {
-  Node *node = primary(&token, token);
+  NodeId node = primary(&token, token);
 
   // x[][]...[]
   while (equal(token, "[")) {
-    Token *start = token;
-    Node *index = expr(&token, token->next);
+    SrcLoc start = tok_srcloc(token);
+    enter_nest(token);
+    NodeId index = expr(&token, token + 1);
+    leave_nest();
     token = skip(token, "]");
     node = new_node_unary(ND_DEREF, new_node_add(node, index, start), start);
   }
@@ -748,58 +997,63 @@ PARSER_DEFINE(postfix) {
 
 // fncall = ident "(" (assign ("," assign)*)? ")"
 PARSER_DEFINE(fncall) {
-  Token *start = token;
-  token = token->next->next;
+  SrcLoc start = tok_srcloc(token);
+  enter_nest(token);
+  token = token + 2;
 
-  Node head = {};
-  Node *cur = &head;
+  int base = NODE_STACK_LEN;
 
   // 构造参数
   while (!equal(token, ")")) {
-    if (cur != &head)
+    if (NODE_STACK_LEN != base)
       token = skip(token, ",");
 
-    cur->next = assign(&token, token);
-    cur = cur->next;
+    push_node(assign(&token, token));
   }
 
-  Node *node = new_node(ND_FNCALL, start);
-  node->args = head.next;
-  node->func_name = strndup(start->loc, start->len);
+  leave_nest();
 
   // 跳过 ")"
   *rest = skip(token, ")");
-  return node;
+  // 函数名称即为 start 处的标识符
+  return new_node_list(ND_FNCALL, base, start);
 }
 
 // primary = "(" expr ")" | "sizeof" unary | ident | fncall | str | num
 PARSER_DEFINE(primary) {
   // "(" "{" stmt+ "}" ")"
-  if (equal(token, "(") && equal(token->next, "{")) {
-    Node *node = new_node(ND_STMT_EXPR, token);
-    node->body = compound_stmt(&token, token->next->next)->body;
+  if (equal(token, "(") && equal(token + 1, "{")) {
+    SrcLoc start = tok_srcloc(token);
+    Node *body = get_node(compound_stmt(&token, token + 2));
+    NodeId node = new_node(ND_STMT_EXPR, start);
+    // 直接复用代码块的语句
+    get_node(node)->kids = body->kids;
+    get_node(node)->nkids = body->nkids;
+    add_type(CUR_POOL, node);
     *rest = skip(token, ")");
     return node;
   }
 
   // "(" expr ")"
   if (equal(token, "(")) {
-    Node *node = expr(&token, token->next);
+    enter_nest(token);
+    NodeId node = expr(&token, token + 1);
+    leave_nest();
     *rest = skip(token, ")");
     return node;
   }
 
   // "sizeof" unary
   if (equal(token, "sizeof")) {
-    Node *node = unary(rest, token->next);
-    add_type(node);
-    return new_node_num(node->type->size, token);
+    SrcLoc start = tok_srcloc(token);
+    NodeId node = unary(rest, token + 1);
+    return new_node_num(get_node(node)->type->size, start);
   }
 
   // ident
-  if (token->kind == TK_IDENT) {
+  if (tok_kind(token) == TK_IDENT) {
     // fncall
-    if (equal(token->next, "(")) {
+    if (equal(token + 1, "(")) {
       return fncall(rest, token);
     }
 
@@ -808,26 +1062,27 @@ PARSER_DEFINE(primary) {
     if (!var) // 变量在声明中定义，必须存在`
       error_token(token, "undefined variable");
 
-    *rest = token->next;
-    return new_node_var(var, token);
+    *rest = token + 1;
+    return new_node_var(var, tok_srcloc(token));
   }
 
   // str
-  if (token->kind == TK_STR) {
-    Object *var = new_string_literal(token->str, token->type);
-    *rest = token->next;
-    return new_node_var(var, token);
+  if (tok_kind(token) == TK_STR) {
+    Object *var = new_string_literal(
+        tok_str(token), array_type(TYPE_CHAR, tok_str_len(token)));
+    *rest = token + 1;
+    return new_node_var(var, tok_srcloc(token));
   }
 
   // num
-  if (token->kind == TK_NUM) {
-    Node *node = new_node_num(token->val, token);
-    *rest = token->next;
+  if (tok_kind(token) == TK_NUM) {
+    NodeId node = new_node_num(tok_val(token), tok_srcloc(token));
+    *rest = token + 1;
     return node;
   }
 
   error_token(token, "expected an expression");
-  return NULL;
+  return 0;
 }
 
 /*
@@ -836,7 +1091,7 @@ PARSER_DEFINE(primary) {
  * 当前仅支持全局变量的声明
  * @param type 为基础类型，如 int
  */
-static Token *global_variable(Token *token, Type *base) {
+static Token global_variable(Token token, Type *base, bool is_static) {
   bool is_first = true;
   while (!consume(&token, token, ";")) {
     // 处理 int x,y 格式
@@ -844,65 +1099,604 @@ static Token *global_variable(Token *token, Type *base) {
       token = skip(token, ",");
     is_first = false;
 
-    Type *type = declarator(&token, token, base);
-    new_global_var(get_ident(type->token), type);
+    SrcLoc name;
+    Type *type = declarator(&token, token, base, &name);
+    new_global_var(srcloc_ident(name), type)->is_static = is_static;
   }
 
   return token;
 }
 
+// 函数缓存
+//
+// 函数定义的终结符及其引用的全局变量、函数的类型未变时，
+// 函数生成的代码也不会变，此时无需再解析函数体
+
+// 是否按函数缓存生成的代码
+// -c 生成的指令含有重定位，暂只缓存汇编
+static bool use_function_cache(void) { return OPT_CACHE_DIR && !OPT_C; }
+
+// 返回函数体 "{" ... "}" 之后的终结符，函数体不完整时返回 0
+static Token skip_body(Token token) {
+  if (!equal(token, "{"))
+    return 0;
+
+  int depth = 0;
+  for (TokenKind kind; (kind = tok_kind(token)) != TK_EOF; token++) {
+    // 只有标点需要比较内容
+    if (kind != TK_PUNCT)
+      continue;
+    if (equal(token, "{"))
+      depth++;
+    else if (equal(token, "}") && --depth == 0)
+      return token + 1;
+  }
+  return 0;
+}
+
+// 将类型的结构加入哈希
+static void hash_type(Sha256 *s, Type *type) {
+  int desc[3] = {type->kind, type->size,
+                 type->kind == TY_FUNC ? type->nparams : type->len};
+  sha256_update(s, desc, sizeof(desc));
+
+  switch (type->kind) {
+  case TY_PTR:
+  case TY_ARRAY:
+    hash_type(s, type->base);
+    return;
+  case TY_FUNC:
+    hash_type(s, type->ret_type);
+    for (int i = 0; i < type->nparams; i++)
+      hash_type(s, type->params[i]);
+    return;
+  default:
+    return;
+  }
+}
+
+// 计算函数定义 [start, end) 的缓存键
+//
+// 键包括所有终结符的内容及位置、其中引用的全局变量及函数的类型。
+// 与函数定义位于同一文件的终结符只记录相对于定义起始处的行号，
+// 之前的函数增删行时，本函数的键不变
+static CacheKey *function_key(Object *func, Token start, Token end) {
+  Sha256 s;
+  sha256_init(&s);
+  // 影响生成代码的选项
+  sha256_update(&s, &OPT_TERSE, sizeof(OPT_TERSE));
+  sha256_update(&s, &OPT_FUNCTION_SECTIONS, sizeof(OPT_FUNCTION_SECTIONS));
+  sha256_update(&s, &OPT_DATA_SECTIONS, sizeof(OPT_DATA_SECTIONS));
+  hash_type(&s, func->type);
+  // static 函数不导出符号
+  sha256_update(&s, &func->is_static, sizeof(func->is_static));
+
+  int file_no = srcloc_file_no(func->def_loc);
+  int line = srcloc_line(func->def_loc);
+  int pos[2] = {-1, 0};
+  for (Token token = start; token < end; token++) {
+    // 位置只在变化时写入，以 0xff 开头，与终结符的种类区分
+    SrcLoc loc = tok_srcloc(token);
+    int cur[2] = {srcloc_file_no(loc), srcloc_line(loc)};
+    if (cur[0] == file_no) {
+      cur[0] = 0;
+      cur[1] -= line;
+    }
+    if (cur[0] != pos[0] || cur[1] != pos[1]) {
+      sha256_update(&s, "\xff", 1);
+      sha256_update(&s, cur, sizeof(cur));
+      pos[0] = cur[0];
+      pos[1] = cur[1];
+    }
+
+    // 种类及以 '\0' 结尾的内容，源码中不含 '\0'
+    uint8_t kind = tok_kind(token);
+    sha256_update(&s, &kind, 1);
+    sha256_update(&s, tok_loc(token), tok_len(token));
+    sha256_update(&s, "", 1);
+
+    // 此时只有全局变量及函数可见
+    if (kind == TK_IDENT) {
+      Object *var = find_var_by_token(token);
+      uint8_t ref = var ? 1 + var->is_function : 0;
+      sha256_update(&s, &ref, 1);
+      if (var)
+        hash_type(&s, var->type);
+    }
+  }
+
+  CacheKey *key = arena_alloc(ARENA_SYMBOL, sizeof(CacheKey));
+  sha256_final(&s, key->hash);
+  return key;
+}
+
+// 推迟解析的函数体
+typedef struct {
+  Object *func; // 所属的函数
+  Token decl;   // 函数的声明符
+  Token end;    // 函数体之后的终结符
+  Type *base;   // 返回值的基础类型
+  int nglobals; // 函数体中可见的全局变量的数量
+} PendingBody;
+
+// 是否推迟解析函数体，待所有顶层声明解析完毕后再并行解析
+static _Thread_local bool DEFER_BODIES;
+// 推迟解析的函数体，按源码顺序排列
+static _Thread_local PendingBody *PENDING;
+static _Thread_local int PENDING_LEN;
+static _Thread_local int PENDING_CAP;
+
+// 推迟解析函数 func 的函数体，此时已声明的全局变量在函数体中可见
+static void defer_body(Object *func, Token decl, Token end, Type *base) {
+  if (PENDING_LEN == PENDING_CAP) {
+    PENDING_CAP = PENDING_CAP ? PENDING_CAP * 2 : 64;
+    PENDING = realloc(PENDING, PENDING_CAP * sizeof(PendingBody));
+  }
+  PENDING[PENDING_LEN++] = (PendingBody){func, decl, end, base, GLOBAL_SEQ};
+}
+
+// 解析函数 func 的函数体 "{" compound_stmt
+// 形参的名称取自最近一次解析的函数声明符
+static void function_body(Token *rest, Token token, Object *func) {
+  // 清空局部变量
+  LOCALS = NULL;
+
+  // 函数参数，位于函数独有的块域中，函数结束后不再可见
+  enter_scope();
+  insert_param_to_locals(func->type);
+  func->params = LOCALS;
+
+  // 函数体的节点存放在函数独有的节点池中
+  func->pool = CUR_POOL = new_node_pool();
+
+  token = skip(token, "{");
+  func->body = compound_stmt(rest, token);
+  func->locals = LOCALS;
+  leave_scope();
+
+  // 类型已在构造节点时计算，仅在调试时再遍历校验
+  if (OPT_VERIFY_TYPES)
+    verify_types(func->pool, func->body);
+}
+
 /*
  * function = declarator "{" compoundStmt*
  *
  * @param base 为基础类型，即返回值的类型
+ * @return 构造好的函数
  */
-static Token *function(Token *token, Type *base) {
+static Object *function(Token *rest, Token token, Type *base,
+                        bool is_static) {
   // type为函数类型
   // 指向 return type, 同时判断指针
-  // type->token 指向了 ident 对应的 token
-  Type *type = declarator(&token, token, base);
-  Object *func = new_global_var(get_ident(type->token), type);
+  // name 指向了 ident 对应的 token
+  Token start = token;
+  SrcLoc name;
+  Type *type = declarator(&token, token, base, &name);
+  Object *func = new_global_var(srcloc_ident(name), type);
   func->is_function = true;
+  func->is_static = is_static;
+  func->def_loc = tok_srcloc(start);
+  CUR_FUNC = func;
+  UNIQUE_ID = 0;
+
+  // 使用函数缓存或推迟解析时先跳过函数体，
+  // 函数体不完整时立即解析，以便报告其中的错误
+  Token end = use_function_cache() || DEFER_BODIES ? skip_body(token) : 0;
+
+  // 命中函数缓存时跳过函数体，由代码生成直接使用缓存的代码
+  if (end && use_function_cache()) {
+    func->cache_key = function_key(func, start, end);
+    if (codegen_load_cached(func)) {
+      // 惰性解析时仍需记录，以便找出其中引用的函数
+      if (DEFER_BODIES && OPT_LAZY)
+        defer_body(func, start, end, base);
+      *rest = end;
+      return func;
+    }
+  }
 
-  // 清空局部变量
-  LOCALS = NULL;
-
-  // 函数参数
-  insert_param_to_locals(type->params);
-  func->params = LOCALS;
+  if (end && DEFER_BODIES) {
+    defer_body(func, start, end, base);
+    *rest = end;
+    return func;
+  }
 
-  token = skip(token, "{");
-  func->body = compound_stmt(&token, token);
-  func->locals = LOCALS;
-  return token;
+  function_body(rest, token, func);
+  return func;
 }
 
-// 尝试生成 declarator 来判断是否是 FUNC
-static bool is_function(Token *token) {
-  Type dummy = {};
-  Type *type = declarator(&token, token, &dummy);
-  return type->kind == TY_FUNC;
+// 判断 declarator 是否为 FUNC
+// declarator = "*"* ident type_suf，ident 之后为 "(" 即为函数
+// 仅向前查看 token，无需构造类型，也不必重复解析 declarator
+static bool is_function(Token token) {
+  while (equal(token, "*"))
+    token++;
+
+  if (tok_kind(token) != TK_IDENT)
+    error_token(token, "expected a variable name");
+
+  return equal(token + 1, "(");
 }
 
 // program = (function_def | global_variable_def) *
 // function_def = declspec function
 // global_variable_def = declspec global_variable
-Object *parse(Token *token) {
-  GLOBALS = NULL;
-
-  while (token->kind != TK_EOF) {
+//
+// on_function 不为 NULL 时，每个函数定义解析完毕即调用，
+// 使函数在后续的声明解析之前就能生成代码并释放
+static void program(Token token, FunctionHandler on_function) {
+  while (tok_kind(token) != TK_EOF) {
+    // 顶层声明之间不会回看之前的终结符
+    release_tokens(token);
+
+    // 存储类型
+    bool is_static = consume(&token, token, "static");
     // 函数返回值类型
     Type *type = declspec(&token, token);
 
     // function
     if (is_function(token)) {
-      token = function(token, type);
+      Object *func = function(&token, token, type, is_static);
+      if (on_function)
+        on_function(func, token);
       continue;
     }
 
     // global_variable
-    token = global_variable(token, type);
+    token = global_variable(token, type, is_static);
+  }
+}
+
+// 惰性解析(--lazy)
+//
+// 与并行解析一样先略读所有顶层声明，记录各函数体的终结符范围。
+// 函数体中出现的标识符若为某个函数的名称，即视为引用了该函数。
+// 从入口函数(main、非 static 函数及 --keep 指定的函数)出发，
+// 沿引用关系可达的函数体才解析及生成代码；其余 static 函数直接丢弃，
+// 其函数体不再解析，其中的错误也不再报告
+
+// 是否只解析及生成从入口函数可达的函数(--lazy)
+_Thread_local bool OPT_LAZY;
+
+// 始终保留的函数(--keep)
+static _Thread_local char **KEEP_FUNCS;
+static _Thread_local int KEEP_FUNCS_LEN;
+
+// 惰性解析时始终保留名为 name 的函数(--keep)
+void add_keep_function(char *name) {
+  KEEP_FUNCS = realloc(KEEP_FUNCS, sizeof(char *) * (KEEP_FUNCS_LEN + 1));
+  KEEP_FUNCS[KEEP_FUNCS_LEN++] = name;
+}
+
+// 清空所有 --keep 指定的函数
+void clear_keep_functions(void) {
+  free(KEEP_FUNCS);
+  KEEP_FUNCS = NULL;
+  KEEP_FUNCS_LEN = 0;
+}
+
+// 返回所有 --keep 指定的函数，*len 为函数的数量
+char **get_keep_functions(int *len) {
+  *len = KEEP_FUNCS_LEN;
+  return KEEP_FUNCS;
+}
+
+// 判断 func 是否为入口函数
+static bool is_root(Object *func) {
+  if (!func->is_static || !strcmp(func->name, "main"))
+    return true;
+  for (int i = 0; i < KEEP_FUNCS_LEN; i++)
+    if (!strcmp(func->name, KEEP_FUNCS[i]))
+      return true;
+  return false;
+}
+
+// 丢弃从入口函数不可达的函数，只保留可达且需要解析的函数体
+static void drop_unreachable(void) {
+  // 函数名到函数体，同名的函数以最后定义的为准
+  HashMap bodies = {};
+  for (int i = 0; i < PENDING_LEN; i++)
+    hashmap_put(&bodies, PENDING[i].func->name, &PENDING[i]);
+
+  // 函数体按定义的顺序记录，数量不会为负
+  assert(PENDING_LEN >= 0);
+  bool *reached = calloc(PENDING_LEN, sizeof(bool));
+  int *stack = calloc(PENDING_LEN, sizeof(int));
+  if (!reached || !stack)
+    error("out of memory");
+  int len = 0;
+  for (int i = 0; i < PENDING_LEN; i++) {
+    if (is_root(PENDING[i].func)) {
+      reached[i] = true;
+      stack[len++] = i;
+    }
+  }
+
+  // 每个可达的函数体只扫描一次
+  while (len > 0) {
+    PendingBody *body = &PENDING[stack[--len]];
+    for (Token token = body->decl; token < body->end; token++) {
+      if (tok_kind(token) != TK_IDENT)
+        continue;
+      PendingBody *callee =
+          hashmap_get2(&bodies, tok_loc(token), tok_len(token));
+      if (callee && !reached[callee - PENDING]) {
+        reached[callee - PENDING] = true;
+        stack[len++] = callee - PENDING;
+      }
+    }
+  }
+  hashmap_free(&bodies);
+
+  // 全局变量按定义的逆序排列，其中的函数与函数体一一对应
+  int j = PENDING_LEN;
+  for (Object **var = &GLOBALS; *var;) {
+    if (!(*var)->is_function) {
+      var = &(*var)->next;
+      continue;
+    }
+    if (--j < 0 || PENDING[j].func != *var)
+      unreachable();
+    if (reached[j])
+      var = &(*var)->next;
+    else
+      *var = (*var)->next;
+  }
+
+  // 命中函数缓存的函数体无需解析
+  int n = 0;
+  for (int i = 0; i < PENDING_LEN; i++)
+    if (reached[i] && !PENDING[i].func->cached)
+      PENDING[n++] = PENDING[i];
+  PENDING_LEN = n;
+  free(reached);
+  free(stack);
+}
+
+// 并行解析
+//
+// 函数体只读取在它之前声明的全局变量，解析一个函数体不会影响其他声明。
+// 因此先略读所有顶层声明：声明全局变量及函数，函数体只按括号匹配跳过，
+// 再由多个线程同时解析各函数体。各线程使用自己的局部作用域、节点栈及区域，
+// 只读地共用终结符流及全局作用域，规范类型表加锁共用，
+// 结束后各线程的区域交由发起的线程接管。
+// 报告的错误与逐个解析时相同，都是源码中最靠前的一个
+
+// 并行解析函数体的线程数(-j)
+_Thread_local int OPT_PARSE_THREADS;
+
+typedef struct {
+  PendingBody *bodies; // 待解析的函数体
+  int len;             // 函数体的数量
+  atomic_int next;     // 下一个待解析的函数体
+  atomic_int failed;   // 出错的函数体中最靠前的一个，都未出错时为 len
+  char **diags;        // 各函数体的错误信息
+
+  // 新建的线程从发起线程继承的状态
+  SourceState source;
+  SharedTypes *types;
+  HashMap *globals;
+  bool verify_types;
+} ParseJob;
+
+typedef struct {
+  ParseJob *job;
+  pthread_t thread;
+  ArenaSet *arenas; // 线程退出前取出的区域
+} ParseWorker;
+
+// 解析一个推迟的函数体
+static void parse_body(PendingBody *body) {
+  GLOBAL_LIMIT = body->nglobals;
+  CUR_FUNC = body->func;
+  UNIQUE_ID = 0;
+
+  // 重新解析声明符，取得形参的名称及函数体的起始位置
+  Token token;
+  SrcLoc name;
+  declarator(&token, body->decl, body->base, &name);
+  function_body(&token, token, body->func);
+}
+
+// 不断领取下一个函数体解析，直到全部解析完毕
+// 出错的函数体之后的函数体无需再解析，只需找出最靠前的错误
+static void run_parse_job(ParseJob *job) {
+  jmp_buf *saved_jmp;
+  FILE *saved_out;
+  get_error_handler(&saved_jmp, &saved_out);
+  BlockScope *scopes = BLOCK_SCOPES;
+
+  for (;;) {
+    int i = atomic_fetch_add(&job->next, 1);
+    if (i >= job->len || i > atomic_load(&job->failed))
+      break;
+
+    // 错误信息先写入内存，最后只报告最靠前的一个
+    char *diag = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&diag, &len);
+    if (!out)
+      error("out of memory");
+    jmp_buf jmp;
+    set_error_handler(&jmp, out);
+    if (!setjmp(jmp)) {
+      parse_body(&job->bodies[i]);
+      fclose(out);
+      free(diag);
+      continue;
+    }
+
+    fclose(out);
+    job->diags[i] = diag;
+    int failed = atomic_load(&job->failed);
+    while (i < failed &&
+           !atomic_compare_exchange_weak(&job->failed, &failed, i))
+      ;
+
+    // 出错中止时可能停在任意深度，丢弃未完成的局部状态
+    hashmap_free(&VISIBLE_VARS);
+    BLOCK_SCOPES = scopes;
+    NODE_STACK_LEN = OP_STACK_LEN = NEST_DEPTH = 0;
   }
 
+  set_error_handler(saved_jmp, saved_out);
+}
+
+static void *parse_thread(void *arg) {
+  ParseWorker *worker = arg;
+  ParseJob *job = worker->job;
+  use_source_state(job->source);
+  use_shared_types(job->types);
+  OPT_VERIFY_TYPES = job->verify_types;
+  GLOBAL_SCOPE = job->globals;
+
+  run_parse_job(job);
+
+  // 语法树、局部变量等分配在本线程的区域中，交由发起的线程接管
+  worker->arenas = arena_detach();
+  parse_reset();
+  type_release();
+  tokenize_reset();
+  OPT_VERIFY_TYPES = false;
+  return NULL;
+}
+
+// 由 nthreads 个线程解析推迟的函数体，发起线程也参与解析
+// 返回源码中最靠前的错误信息，都未出错时返回 NULL
+static char *parse_bodies(int nthreads) {
+  if (PENDING_LEN == 0)
+    return NULL;
+
+  // 发起线程的 VISIBLE_VARS 同样只保存局部变量
+  HashMap globals = VISIBLE_VARS;
+  VISIBLE_VARS = (HashMap){};
+  GLOBAL_SCOPE = &globals;
+
+  ParseJob job = {
+      .bodies = PENDING,
+      .len = PENDING_LEN,
+      .failed = PENDING_LEN,
+      .diags = calloc(PENDING_LEN, sizeof(char *)),
+      .source = get_source_state(),
+      .types = share_types(),
+      .globals = &globals,
+      .verify_types = OPT_VERIFY_TYPES,
+  };
+  if (!job.diags)
+    error("out of memory");
+
+  if (nthreads > job.len)
+    nthreads = job.len;
+  ParseWorker *workers = calloc(nthreads, sizeof(ParseWorker));
+  for (int i = 1; i < nthreads; i++) {
+    workers[i].job = &job;
+    if (pthread_create(&workers[i].thread, NULL, parse_thread, &workers[i]))
+      error("pthread_create failed");
+  }
+  run_parse_job(&job);
+  for (int i = 1; i < nthreads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    arena_attach(workers[i].arenas);
+  }
+  free(workers);
+
+  unshare_types(job.types);
+  hashmap_free(&VISIBLE_VARS);
+  VISIBLE_VARS = globals;
+  GLOBAL_SCOPE = NULL;
+
+  char *diag = NULL;
+  for (int i = 0; i < job.len; i++) {
+    if (i == job.failed)
+      diag = job.diags[i];
+    else
+      free(job.diags[i]);
+  }
+  free(job.diags);
+  return diag;
+}
+
+// 先略读所有顶层声明，再由 nthreads 个线程并行解析函数体
+// 惰性解析时只解析可达的函数体
+static void parse_parallel(Token token, int nthreads) {
+  // 解析函数体时需回头访问略读过的终结符
+  keep_tokens();
+
+  // 略读时的错误先写入内存：之前的函数体中的错误在源码中更靠前，应先报告
+  jmp_buf *saved_jmp;
+  FILE *saved_out;
+  get_error_handler(&saved_jmp, &saved_out);
+  char *diag = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&diag, &len);
+  if (!out)
+    error("out of memory");
+
+  jmp_buf jmp;
+  bool failed = false;
+  set_error_handler(&jmp, out);
+  DEFER_BODIES = true;
+  if (setjmp(jmp)) {
+    failed = true;
+    NODE_STACK_LEN = OP_STACK_LEN = NEST_DEPTH = 0;
+  } else {
+    program(token, NULL);
+  }
+  DEFER_BODIES = false;
+  set_error_handler(saved_jmp, saved_out);
+  fclose(out);
+
+  // 略读出错时引用关系不完整，仍解析所有函数体以找出最靠前的错误
+  if (OPT_LAZY && !failed)
+    drop_unreachable();
+  char *body_diag = parse_bodies(nthreads);
+  PENDING_LEN = 0;
+
+  // 错误信息已以换行结尾
+  char *msg = body_diag ? body_diag : failed ? diag : NULL;
+  if (msg)
+    msg = format("%.*s", (int)strlen(msg) - 1, msg);
+  free(body_diag);
+  free(diag);
+  if (msg)
+    error("%s", msg);
+}
+
+// 语法解析入口函数
+Object *parse(Token token, FunctionHandler on_function) {
+  GLOBALS = NULL;
+  BLOCK_SCOPES = arena_alloc(ARENA_SYMBOL, sizeof(BlockScope));
+
+  // 逐个函数地生成代码时须按顺序解析，也不做惰性解析
+  if ((OPT_PARSE_THREADS > 1 || OPT_LAZY) && !on_function)
+    parse_parallel(token, OPT_PARSE_THREADS > 1 ? OPT_PARSE_THREADS : 1);
+  else
+    program(token, on_function);
   return GLOBALS;
-}
\ No newline at end of file
+}
+
+// 清空作用域及计数器，以便同一线程编译下一个文件
+void parse_reset(void) {
+  hashmap_free(&VISIBLE_VARS);
+  BLOCK_SCOPES = NULL;
+  LOCALS = GLOBALS = NULL;
+  CUR_FUNC = NULL;
+  UNIQUE_ID = 0;
+  GLOBAL_SEQ = GLOBAL_LIMIT = 0;
+  GLOBAL_SCOPE = NULL;
+  DEFER_BODIES = false;
+  free(PENDING);
+  PENDING = NULL;
+  PENDING_LEN = PENDING_CAP = 0;
+  free(NODE_STACK);
+  NODE_STACK = NULL;
+  NODE_STACK_LEN = NODE_STACK_CAP = 0;
+  free(OP_STACK);
+  OP_STACK = NULL;
+  OP_STACK_LEN = OP_STACK_CAP = 0;
+  free(PARAM_NAMES);
+  PARAM_NAMES = NULL;
+  // 出错中止时可能停在任意深度
+  NEST_DEPTH = 0;
+}
@@ -0,0 +1,361 @@
+#include "rvcc.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+//
+// 流水线编译(--pipeline)
+//
+// 当前线程预处理，将终结符按块交给语法分析线程；语法分析线程每解析完
+// 一个函数，就将其交给代码生成线程。相邻的阶段之间由单生产者单消费者的
+// 无锁队列连接，三个阶段同时进行。
+//
+// 结果与 --stream 完全相同：各函数生成时使用的源文件表与逐个生成时相同，
+// 全局变量最后统一生成。任一阶段出错即通知其他阶段停止，报告的错误也与
+// --stream 时相同：预处理的错误在语法分析读到出错位置时才报告，
+// 代码生成出错的函数则先于语法分析尚未读到的终结符
+//
+
+// 每块终结符的数量
+#define TOKEN_BLOCK_SIZE 1024
+// 预处理最多领先语法分析的块数
+#define TOKEN_QUEUE_SIZE 64
+// 语法分析最多领先代码生成的函数数
+#define FUNCTION_QUEUE_SIZE 256
+// 队列满或空时，阻塞等待之前自旋的次数
+#define SPIN_COUNT 64
+
+// 交给代码生成线程的函数
+typedef struct {
+  Object *func;       // 函数，为 NULL 时所有函数都已交出
+  Object *prog;       // 所有全局变量及函数，func 为 NULL 时有效
+  SourceState source; // 生成时使用的源文件表
+} FunctionItem;
+
+typedef struct {
+  SpscQueue *tokens; // 预处理 → 语法分析的终结符块
+  SpscQueue *funcs;  // 语法分析 → 代码生成的函数
+  atomic_bool stop;  // 有阶段已出错，其余阶段应尽快停止
+
+  // 自旋后仍无法继续的阶段在 wake 上等待，
+  // 队列有变化或有阶段出错时，若有阶段在等待则通知
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  atomic_int waiting; // 正在等待的阶段数
+  Token start;       // 第一个终结符
+  FILE *out;         // 输出文件
+
+  char *parse_diag;       // 语法分析的错误信息
+  char *codegen_diag;     // 代码生成的错误信息
+  ArenaSet *parse_arenas; // 语法分析线程退出前取出的区域
+
+  // 新建的线程从当前线程继承的状态
+  SourceState source;
+  SharedTypes *types; // 语法分析线程共用当前线程的规范类型表
+  bool verify_types;
+  bool terse;
+  bool c;
+  bool function_sections;
+  bool data_sections;
+  char *cache_dir;
+} Pipeline;
+
+// 当前线程所在的流水线
+static _Thread_local Pipeline *PIPELINE;
+
+// 其他阶段出错时中止当前阶段，不输出错误信息
+static void abort_stage(void) {
+  jmp_buf *jmp;
+  FILE *out;
+  get_error_handler(&jmp, &out);
+  longjmp(*jmp, 1);
+}
+
+// 队列有变化或有阶段出错后，唤醒正在等待的阶段
+static void notify(void) {
+  // 与 wait_queue 中的 fence 配对：
+  // 要么等待的阶段看到这次变化，要么这里看到有阶段在等待
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_load(&PIPELINE->waiting))
+    return;
+  pthread_mutex_lock(&PIPELINE->lock);
+  pthread_cond_broadcast(&PIPELINE->wake);
+  pthread_mutex_unlock(&PIPELINE->lock);
+}
+
+// 通知其他阶段停止
+static void stop_pipeline(void) {
+  atomic_store(&PIPELINE->stop, true);
+  notify();
+}
+
+// blocked(q) 成立时等待队列变化，*spins 为已等待的次数
+// 相邻的阶段通常很快就会跟上，先让出处理器自旋若干次，之后阻塞等待通知
+static void wait_queue(SpscQueue *q, bool (*blocked)(SpscQueue *), int *spins) {
+  if (++*spins < SPIN_COUNT) {
+    sched_yield();
+    return;
+  }
+
+  pthread_mutex_lock(&PIPELINE->lock);
+  atomic_fetch_add(&PIPELINE->waiting, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  while (blocked(q) && !atomic_load(&PIPELINE->stop))
+    pthread_cond_wait(&PIPELINE->wake, &PIPELINE->lock);
+  atomic_fetch_sub(&PIPELINE->waiting, 1);
+  pthread_mutex_unlock(&PIPELINE->lock);
+}
+
+// 放入一个元素，队列已满时等待，其他阶段出错时返回 false
+static bool send(SpscQueue *q, void *item) {
+  for (int spins = 0; !spsc_push(q, item);) {
+    if (atomic_load(&PIPELINE->stop))
+      return false;
+    wait_queue(q, spsc_full, &spins);
+  }
+  notify();
+  return true;
+}
+
+// 取出一个元素，队列为空时等待
+// 其他阶段出错时，取完其停止前放入的元素后中止当前阶段
+static void *receive(SpscQueue *q) {
+  for (int spins = 0;;) {
+    bool stop = atomic_load(&PIPELINE->stop);
+    void *item = spsc_pop(q);
+    if (item) {
+      notify();
+      return item;
+    }
+    if (stop)
+      abort_stage();
+    wait_queue(q, spsc_empty, &spins);
+  }
+}
+
+// 在 out 中记录错误信息，运行阶段 fn 的一次调用，返回其错误信息
+// 阶段出错时通知其他阶段停止；因其他阶段出错而中止时返回 NULL
+static char *run_stage(void (*fn)(void)) {
+  char *diag = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&diag, &len);
+  if (!out)
+    error("out of memory");
+
+  jmp_buf jmp;
+  set_error_handler(&jmp, out);
+  if (!setjmp(jmp))
+    fn();
+  else
+    stop_pipeline();
+  set_error_handler(NULL, NULL);
+  fclose(out);
+
+  if (len)
+    return diag;
+  free(diag);
+  return NULL;
+}
+
+// (1) 预处理
+
+// 预处理下一块终结符，出错时块中带有错误信息
+// 返回的块为最后一块时 *last 为 true
+static TokenBlock *next_block(bool *last) {
+  jmp_buf *saved_jmp;
+  FILE *saved_out;
+  get_error_handler(&saved_jmp, &saved_out);
+  char *diag = NULL;
+  size_t len = 0;
+  FILE *out = open_memstream(&diag, &len);
+  if (!out)
+    error("out of memory");
+
+  jmp_buf jmp;
+  char *msg = NULL;
+  set_error_handler(&jmp, out);
+  if (!setjmp(jmp)) {
+    *last = preprocess_block(TOKEN_BLOCK_SIZE);
+  } else {
+    // 错误信息已以换行结尾
+    fflush(out);
+    msg = format("%.*s", (int)len - 1, diag);
+    *last = true;
+  }
+  set_error_handler(saved_jmp, saved_out);
+  fclose(out);
+  free(diag);
+  return take_tokens(msg);
+}
+
+// 当前线程预处理，将终结符按块交给语法分析线程
+static void produce_tokens(void) {
+  bool last = false;
+  while (!last && !atomic_load(&PIPELINE->stop)) {
+    TokenBlock *block = next_block(&last);
+    if (!send(PIPELINE->tokens, block)) {
+      free(block);
+      return;
+    }
+  }
+}
+
+// (2) 语法分析
+
+// 取得预处理线程交出的下一块终结符
+static TokenBlock *fetch_tokens(void) { return receive(PIPELINE->tokens); }
+
+// 交出一个函数，其他阶段出错时中止
+static void send_item(FunctionItem item) {
+  FunctionItem *p = malloc(sizeof(FunctionItem));
+  if (!p)
+    error("out of memory");
+  *p = item;
+  if (!send(PIPELINE->funcs, p)) {
+    free(p);
+    abort_stage();
+  }
+}
+
+// 函数解析完毕即交给代码生成线程
+// 与 --stream 时一样，使用读到函数最后一个终结符时的源文件表
+static void send_function(Object *func, Token end) {
+  send_item((FunctionItem){func, NULL, source_state_at(end - 1)});
+}
+
+static void parse_program(void) {
+  Object *prog = parse(PIPELINE->start, send_function);
+  SourceState source = get_source_state();
+  source.tokens = NULL;
+  send_item((FunctionItem){NULL, prog, source});
+}
+
+static void *parse_stage(void *arg) {
+  PIPELINE = arg;
+  use_source_state(PIPELINE->source);
+  use_shared_types(PIPELINE->types);
+  set_token_source(fetch_tokens);
+  OPT_VERIFY_TYPES = PIPELINE->verify_types;
+  // 函数缓存的键包含影响生成代码的选项
+  OPT_TERSE = PIPELINE->terse;
+  OPT_C = PIPELINE->c;
+  OPT_FUNCTION_SECTIONS = PIPELINE->function_sections;
+  OPT_DATA_SECTIONS = PIPELINE->data_sections;
+  OPT_CACHE_DIR = PIPELINE->cache_dir;
+
+  PIPELINE->parse_diag = run_stage(parse_program);
+
+  // 语法树在代码生成完成前仍在使用，区域交由发起的线程接管
+  PIPELINE->parse_arenas = arena_detach();
+  parse_reset();
+  type_release();
+  tokenize_reset();
+  OPT_VERIFY_TYPES = false;
+  OPT_TERSE = OPT_C = OPT_FUNCTION_SECTIONS = OPT_DATA_SECTIONS = false;
+  OPT_CACHE_DIR = NULL;
+  return NULL;
+}
+
+// (3) 代码生成
+
+// 逐个生成交来的函数，最后生成全局变量
+static void generate(void) {
+  for (;;) {
+    FunctionItem *p = receive(PIPELINE->funcs);
+    FunctionItem item = *p;
+    free(p);
+
+    use_source_state(item.source);
+    if (!item.func) {
+      codegen_data(item.prog, PIPELINE->out);
+      return;
+    }
+    codegen_function(item.func, PIPELINE->out);
+  }
+}
+
+static void *codegen_stage(void *arg) {
+  PIPELINE = arg;
+  OPT_TERSE = PIPELINE->terse;
+  OPT_C = PIPELINE->c;
+  OPT_FUNCTION_SECTIONS = PIPELINE->function_sections;
+  OPT_DATA_SECTIONS = PIPELINE->data_sections;
+  OPT_CACHE_DIR = PIPELINE->cache_dir;
+
+  PIPELINE->codegen_diag = run_stage(generate);
+
+  // 线程退出前释放线程局部的缓冲区及区域
+  codegen_reset();
+  obj_reset();
+  tokenize_reset();
+  OPT_TERSE = OPT_C = OPT_FUNCTION_SECTIONS = OPT_DATA_SECTIONS = false;
+  OPT_CACHE_DIR = NULL;
+  for (int i = 0; i < ARENA_NUM; i++)
+    arena_release(i);
+  return NULL;
+}
+
+// 预处理、语法分析及代码生成分别在三个线程中同时进行，结果输出到 out
+// 当前线程已开始预处理，token 为第一个终结符
+void run_pipeline(Token token, FILE *out) {
+  SourceState source = get_source_state();
+  source.tokens = NULL;
+  Pipeline pipe = {
+      .tokens = spsc_new(TOKEN_QUEUE_SIZE),
+      .funcs = spsc_new(FUNCTION_QUEUE_SIZE),
+      .start = token,
+      .out = out,
+      .source = source,
+      .types = share_types(),
+      .verify_types = OPT_VERIFY_TYPES,
+      .terse = OPT_TERSE,
+      .c = OPT_C,
+      .function_sections = OPT_FUNCTION_SECTIONS,
+      .data_sections = OPT_DATA_SECTIONS,
+      .cache_dir = OPT_CACHE_DIR,
+  };
+  pthread_mutex_init(&pipe.lock, NULL);
+  pthread_cond_init(&pipe.wake, NULL);
+  PIPELINE = &pipe;
+
+  // 线程引用着 pipe，创建失败时也要等已创建的线程结束后才能报错
+  pthread_t parser, codegen;
+  bool has_parser = !pthread_create(&parser, NULL, parse_stage, &pipe);
+  bool has_codegen =
+      has_parser && !pthread_create(&codegen, NULL, codegen_stage, &pipe);
+  // 代码生成线程创建失败时不再交出终结符，语法分析线程随之停止
+  if (has_codegen)
+    produce_tokens();
+  else
+    stop_pipeline();
+  if (has_parser) {
+    pthread_join(parser, NULL);
+    arena_attach(pipe.parse_arenas);
+  }
+  if (has_codegen)
+    pthread_join(codegen, NULL);
+  PIPELINE = NULL;
+  unshare_types(pipe.types);
+
+  // 出错停止时队列中可能还有未处理的元素
+  for (TokenBlock *block; (block = spsc_pop(pipe.tokens));)
+    free(block);
+  for (FunctionItem *item; (item = spsc_pop(pipe.funcs));)
+    free(item);
+  spsc_free(pipe.tokens);
+  spsc_free(pipe.funcs);
+  pthread_mutex_destroy(&pipe.lock);
+  pthread_cond_destroy(&pipe.wake);
+
+  // 代码生成出错的函数在源码中先于语法分析出错的位置
+  char *diag = pipe.codegen_diag ? pipe.codegen_diag : pipe.parse_diag;
+  char *msg = NULL;
+  if (!has_codegen)
+    msg = "pthread_create failed";
+  else if (diag)
+    msg = format("%.*s", (int)strlen(diag) - 1, diag);
+  free(pipe.codegen_diag);
+  free(pipe.parse_diag);
+  if (msg)
+    error("%s", msg);
+}
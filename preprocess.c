@@ -0,0 +1,1338 @@
+#include "rvcc.h"
+
+//
+// 预处理
+//
+// 预处理器从文件栈中逐个读取终结符，执行预处理指令并展开宏，
+// 将结果依次加入终结符流。
+//
+// 每个文件只读取、解析一次，其终结符数组保存在缓存中；
+// 使用 include guard 或 #pragma once 的头文件再次被包含时直接跳过
+//
+
+// 展开时不能再次展开的宏名集合
+struct Hideset {
+  Hideset *next; // 下一个宏名
+  char *name;    // 宏名，不以'\0'结尾
+  int len;       // 宏名的长度
+};
+
+// 内置宏的处理函数，返回展开后的终结符
+typedef PPToken (*MacroHandler)(PPToken *tok);
+
+// 宏
+typedef struct {
+  bool is_objlike;      // 对象式宏或函数式宏
+  PPToken *params;      // 形参
+  int nparams;          // 形参的数量
+  bool is_variadic;     // 是否有可变参数 __VA_ARGS__
+  PPToken *body;        // 替换列表
+  int body_len;         // 替换列表的长度
+  MacroHandler handler; // 内置宏的处理函数
+} Macro;
+
+// 缓存的文件
+typedef struct {
+  SourceFile *file; // 源文件
+  PPToken *tokens;  // 预处理终结符，以 TK_EOF 结尾；主文件为 NULL
+  char *guard;      // include guard 的宏名，不以'\0'结尾
+  int guard_len;    // 宏名的长度
+  bool once;        // 是否使用了 #pragma once
+} CachedFile;
+
+// 正在读取的文件
+//
+// 解析为终结符数组的文件从 pos 处读取；
+// 其余文件(主文件)由 lex 逐个解析终结符，look 中暂存向前查看的终结符
+typedef struct {
+  CachedFile *file; // 文件
+  PPToken *pos;     // 下一个终结符
+  Lexer *lex;       // 词法分析器，从终结符数组中读取时为 NULL
+  PPToken look[2];  // 已解析但尚未读取的终结符
+  int look_len;     // look 中终结符的数量
+  int cond_len;     // 进入文件时条件编译栈的深度
+} FileFrame;
+
+// 条件编译
+typedef struct {
+  enum { IN_THEN, IN_ELIF, IN_ELSE } ctx; // 当前所在的分支
+  SrcLoc loc;                             // 指令的位置
+  bool included;                          // 是否已有分支被选中
+} CondIncl;
+
+// 终结符数组
+typedef struct {
+  PPToken *data; // 终结符
+  int len;       // 终结符的数量
+  int cap;       // 数组的容量
+} TokenBuf;
+
+// 所有定义的宏
+static _Thread_local HashMap MACROS;
+// 缓存的文件，键为文件路径
+static _Thread_local HashMap FILE_CACHE;
+
+// #include 的搜索路径
+static _Thread_local char **INCLUDE_PATHS;
+static _Thread_local int INCLUDE_PATHS_LEN;
+
+// 文件栈，栈顶为正在读取的文件
+static _Thread_local FileFrame *FRAMES;
+static _Thread_local int FRAMES_LEN;
+static _Thread_local int FRAMES_CAP;
+
+// 条件编译栈
+static _Thread_local CondIncl *CONDS;
+static _Thread_local int CONDS_LEN;
+static _Thread_local int CONDS_CAP;
+
+// 待读取的终结符(宏展开的结果)，栈顶为下一个终结符
+// 栈中的 TK_EOF 是单独展开一段终结符时的结束标记
+static _Thread_local TokenBuf PENDING;
+
+// 宏展开等过程中临时分配的内存
+// 出错时直接返回到恢复点，来不及释放的由 preprocess_reset 统一释放
+static _Thread_local void **SCRATCH;
+static _Thread_local int SCRATCH_LEN;
+static _Thread_local int SCRATCH_CAP;
+
+// 将临时内存 p 调整为 size 字节，p 为 NULL 时新分配一块
+static void *scratch_realloc(void *p, size_t size) {
+  // 临时内存大多按分配的逆序释放，从末尾开始查找
+  int i = SCRATCH_LEN - 1;
+  if (p) {
+    while (SCRATCH[i] != p)
+      i--;
+  } else {
+    if (SCRATCH_LEN == SCRATCH_CAP) {
+      SCRATCH_CAP = SCRATCH_CAP ? SCRATCH_CAP * 2 : 16;
+      SCRATCH = realloc(SCRATCH, sizeof(void *) * SCRATCH_CAP);
+      if (!SCRATCH)
+        error("out of memory");
+    }
+    i = SCRATCH_LEN++;
+    SCRATCH[i] = NULL;
+  }
+
+  void *q = realloc(p, size);
+  if (!q)
+    error("out of memory");
+  SCRATCH[i] = q;
+  return q;
+}
+
+// 分配 n 个 size 字节的临时内存并清零
+static void *scratch_calloc(size_t n, size_t size) {
+  void *p = scratch_realloc(NULL, n * size);
+  memset(p, 0, n * size);
+  return p;
+}
+
+// 释放临时内存
+static void scratch_free(void *p) {
+  if (!p)
+    return;
+  int i = SCRATCH_LEN - 1;
+  while (SCRATCH[i] != p)
+    i--;
+  SCRATCH[i] = SCRATCH[--SCRATCH_LEN];
+  free(p);
+}
+
+// 向数组末尾追加一个终结符
+static void buf_push(TokenBuf *buf, PPToken tok) {
+  if (buf->len == buf->cap) {
+    buf->cap = buf->cap ? buf->cap * 2 : 16;
+    buf->data = scratch_realloc(buf->data, sizeof(PPToken) * buf->cap);
+  }
+  buf->data[buf->len++] = tok;
+}
+
+// 释放数组
+static void buf_free(TokenBuf *buf) { scratch_free(buf->data); }
+
+// 将 toks[0..len) 放入待读取的终结符中，toks[0] 最先被读取
+static void push_pending(PPToken *toks, int len) {
+  for (int i = len - 1; i >= 0; i--)
+    buf_push(&PENDING, toks[i]);
+}
+
+// 返回终结符的文本
+static char *pp_text(PPToken *tok) { return srcloc_ptr(tok->loc); }
+
+// 判断终结符是否与 str 相同
+static bool pp_equal(PPToken *tok, char *str) {
+  return strlen(str) == tok->len && memcmp(pp_text(tok), str, tok->len) == 0;
+}
+
+// 判断两个终结符的文本是否相同
+static bool pp_same(PPToken *a, PPToken *b) {
+  return a->len == b->len && memcmp(pp_text(a), pp_text(b), a->len) == 0;
+}
+
+// 判断是否为位于行首的 #，即预处理指令的开始
+static bool is_hash(PPToken *tok) {
+  return (tok->flags & PP_BOL) && pp_equal(tok, "#");
+}
+
+// 文件的终结符数组中记录的是相对于文件起始的位置，
+// 因此终结符数组与文件在源码空间中的位置无关，可以直接缓存
+
+// 判断文件中的终结符是否与 str 相同
+static bool raw_equal(CachedFile *cf, PPToken *tok, char *str) {
+  return strlen(str) == tok->len &&
+         memcmp(cf->file->contents + tok->loc, str, tok->len) == 0;
+}
+
+// 判断文件中的终结符是否为位于行首的 #
+static bool raw_is_hash(CachedFile *cf, PPToken *tok) {
+  return (tok->flags & PP_BOL) && raw_equal(cf, tok, "#");
+}
+
+// 判断文件中的终结符是否为条件编译的开始
+static bool raw_is_if(CachedFile *cf, PPToken *tok) {
+  return raw_equal(cf, tok, "if") || raw_equal(cf, tok, "ifdef") ||
+         raw_equal(cf, tok, "ifndef");
+}
+
+// 将文件中的终结符转换为源码空间中的位置
+static PPToken relocate(CachedFile *cf, PPToken *tok) {
+  PPToken t = *tok;
+  t.loc += cf->file->base;
+  return t;
+}
+
+// 返回文件中尚未读取的第 n 个终结符(n < 2)，文件结束后总是返回 TK_EOF
+static PPToken *frame_peek(FileFrame *frame, int n) {
+  if (!frame->lex) {
+    PPToken *tok = frame->pos;
+    for (int i = 0; i < n && tok->kind != TK_EOF; i++)
+      tok++;
+    return tok;
+  }
+
+  while (frame->look_len <= n)
+    lex_token(frame->lex, &frame->look[frame->look_len++]);
+  return &frame->look[n];
+}
+
+// 跳过文件中的下一个终结符
+static void frame_advance(FileFrame *frame) {
+  if (!frame->lex) {
+    if (frame->pos->kind != TK_EOF)
+      frame->pos++;
+    return;
+  }
+
+  frame_peek(frame, 0);
+  frame->look[0] = frame->look[1];
+  frame->look_len--;
+}
+
+//
+// 宏名集合
+//
+
+// 由宏名创建集合
+static Hideset *new_hideset(PPToken *tok) {
+  Hideset *hs = arena_alloc(ARENA_TOKEN, sizeof(Hideset));
+  hs->name = pp_text(tok);
+  hs->len = tok->len;
+  return hs;
+}
+
+// 判断集合中是否包含宏名 name
+static bool hideset_contains(Hideset *hs, char *name, int len) {
+  for (; hs; hs = hs->next)
+    if (hs->len == len && memcmp(hs->name, name, len) == 0)
+      return true;
+  return false;
+}
+
+// 返回两个集合的并集
+static Hideset *hideset_union(Hideset *hs1, Hideset *hs2) {
+  Hideset head = {};
+  Hideset *cur = &head;
+
+  for (; hs1; hs1 = hs1->next) {
+    cur = cur->next = arena_alloc(ARENA_TOKEN, sizeof(Hideset));
+    cur->name = hs1->name;
+    cur->len = hs1->len;
+  }
+  cur->next = hs2;
+  return head.next;
+}
+
+// 返回两个集合的交集
+static Hideset *hideset_intersection(Hideset *hs1, Hideset *hs2) {
+  Hideset head = {};
+  Hideset *cur = &head;
+
+  for (; hs1; hs1 = hs1->next) {
+    if (!hideset_contains(hs2, hs1->name, hs1->len))
+      continue;
+    cur = cur->next = arena_alloc(ARENA_TOKEN, sizeof(Hideset));
+    cur->name = hs1->name;
+    cur->len = hs1->len;
+  }
+  return head.next;
+}
+
+//
+// 读取终结符
+//
+
+// 返回下一个终结符，但不读取
+//
+// 当前文件读取完毕时返回到包含它的文件中继续读取，
+// 所有文件都读取完毕时返回 TK_EOF
+static PPToken *peek_token(void) {
+  if (PENDING.len)
+    return &PENDING.data[PENDING.len - 1];
+
+  while (true) {
+    FileFrame *frame = &FRAMES[FRAMES_LEN - 1];
+    PPToken *next = frame_peek(frame, 0);
+    if (next->kind != TK_EOF || FRAMES_LEN == 1) {
+      static PPToken tok;
+      tok = relocate(frame->file, next);
+      return &tok;
+    }
+
+    // 被包含的文件读取完毕，检查条件编译是否都已结束
+    if (CONDS_LEN > frame->cond_len)
+      error_srcloc(CONDS[CONDS_LEN - 1].loc,
+                   "unterminated conditional directive");
+    FRAMES_LEN--;
+  }
+}
+
+// 读取下一个终结符
+static PPToken read_token(void) {
+  PPToken tok = *peek_token();
+  if (PENDING.len)
+    PENDING.len--;
+  else if (tok.kind != TK_EOF)
+    frame_advance(&FRAMES[FRAMES_LEN - 1]);
+  return tok;
+}
+
+// read_line 读取的一行终结符
+static _Thread_local TokenBuf LINE;
+
+// 读取当前文件中本行剩余的终结符，*len 返回终结符的数量
+// 返回的数组在下一次调用前有效
+static PPToken *read_line(int *len) {
+  FileFrame *frame = &FRAMES[FRAMES_LEN - 1];
+
+  LINE.len = 0;
+  for (PPToken *tok = frame_peek(frame, 0);
+       tok->kind != TK_EOF && !(tok->flags & PP_BOL);
+       frame_advance(frame), tok = frame_peek(frame, 0))
+    buf_push(&LINE, relocate(frame->file, tok));
+  *len = LINE.len;
+  return LINE.data;
+}
+
+//
+// 合成终结符
+//
+
+// 解析合成的文本，文本恰好构成一个终结符时返回 true
+static bool read_synthetic_token(char *text, PPToken *origin, PPToken *tok) {
+  SourceFile *file = new_source_text(text, origin->loc);
+  PPToken *toks = tokenize(file);
+  if (toks[0].kind == TK_EOF || toks[1].kind != TK_EOF)
+    return false;
+
+  *tok = toks[0];
+  tok->loc += file->base;
+  tok->flags = origin->flags;
+  tok->hideset = origin->hideset;
+  return true;
+}
+
+// 由合成的文本创建终结符
+static PPToken new_synthetic_token(char *text, PPToken *origin) {
+  PPToken tok;
+  if (!read_synthetic_token(text, origin, &tok))
+    error_srcloc(origin->loc, "'%s' is not a valid token", text);
+  return tok;
+}
+
+// 创建一个数字终结符
+static PPToken new_num_token(int val, PPToken *origin) {
+  return new_synthetic_token(format("%d", val), origin);
+}
+
+// 将 str 加上双引号，并对其中的 \ 和 " 进行转义
+static char *quote_string(char *str) {
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+
+  fputc('"', out);
+  for (char *p = str; *p; p++) {
+    if (*p == '\\' || *p == '"')
+      fputc('\\', out);
+    fputc(*p, out);
+  }
+  fputc('"', out);
+  fclose(out);
+
+  char *ret = arena_strndup(buf, len);
+  free(buf);
+  return ret;
+}
+
+// 创建一个字符串终结符
+static PPToken new_str_token(char *str, PPToken *origin) {
+  return new_synthetic_token(quote_string(str), origin);
+}
+
+// 将终结符的文本连接起来，终结符前有空白或换行时以一个空格分隔
+static char *join_tokens(PPToken *toks, int len) {
+  char *buf;
+  size_t buf_len;
+  FILE *out = open_memstream(&buf, &buf_len);
+
+  for (int i = 0; i < len; i++) {
+    if (i > 0 && (toks[i].flags & (PP_SPACE | PP_BOL)))
+      fputc(' ', out);
+    fwrite(pp_text(&toks[i]), 1, toks[i].len, out);
+  }
+  fclose(out);
+
+  char *ret = arena_strndup(buf, buf_len);
+  free(buf);
+  return ret;
+}
+
+// # 运算符，将实参转换为字符串
+static PPToken stringize(PPToken *hash, PPToken *arg, int len) {
+  return new_str_token(join_tokens(arg, len), hash);
+}
+
+// ## 运算符，将两个终结符拼接为一个
+static PPToken paste(PPToken *lhs, PPToken *rhs) {
+  char *text = format("%.*s%.*s", lhs->len, pp_text(lhs), rhs->len,
+                      pp_text(rhs));
+  PPToken tok;
+  if (!read_synthetic_token(text, lhs, &tok))
+    error_srcloc(lhs->loc, "pasting forms '%s', an invalid token", text);
+  return tok;
+}
+
+//
+// 宏
+//
+
+// 查找终结符对应的宏
+static Macro *find_macro(PPToken *tok) {
+  if (tok->kind != TK_IDENT)
+    return NULL;
+  return hashmap_get2(&MACROS, pp_text(tok), tok->len);
+}
+
+// 定义宏
+static Macro *add_macro(PPToken *name, bool is_objlike, PPToken *body,
+                        int body_len) {
+  Macro *m = arena_alloc(ARENA_SYMBOL, sizeof(Macro));
+  m->is_objlike = is_objlike;
+  m->body = body;
+  m->body_len = body_len;
+  hashmap_put2(&MACROS, pp_text(name), name->len, m);
+  return m;
+}
+
+// 将终结符复制到区域中，宏的定义在整个编译期间保持有效
+static PPToken *copy_tokens(PPToken *toks, int len) {
+  PPToken *copy = arena_alloc(ARENA_TOKEN, sizeof(PPToken) * len);
+  memcpy(copy, toks, sizeof(PPToken) * len);
+  return copy;
+}
+
+// 解析宏定义
+//
+// #define name body
+// #define name(params) body
+static void read_macro_definition(PPToken *dir, PPToken *line, int len) {
+  if (len == 0 || line[0].kind != TK_IDENT)
+    error_srcloc(dir->loc, "macro name must be an identifier");
+  PPToken *name = &line[0];
+  int i = 1;
+
+  // 对象式宏
+  // 函数式宏的左括号与宏名之间没有空白
+  if (i == len || !pp_equal(&line[i], "(") || (line[i].flags & PP_SPACE)) {
+    add_macro(name, true, copy_tokens(&line[i], len - i), len - i);
+    return;
+  }
+
+  // 形参
+  TokenBuf params = {};
+  bool is_variadic = false;
+  i++;
+  while (i < len && !pp_equal(&line[i], ")")) {
+    if (params.len > 0) {
+      if (!pp_equal(&line[i], ","))
+        error_srcloc(line[i].loc, "expected ','");
+      i++;
+    }
+    if (i < len && pp_equal(&line[i], "...")) {
+      is_variadic = true;
+      i++;
+      break;
+    }
+    if (i == len || line[i].kind != TK_IDENT)
+      error_srcloc(line[i < len ? i : len - 1].loc, "expected an identifier");
+    buf_push(&params, line[i++]);
+  }
+  if (i == len || !pp_equal(&line[i], ")"))
+    error_srcloc(line[len - 1].loc, "expected ')'");
+  i++;
+
+  Macro *m = add_macro(name, false, copy_tokens(&line[i], len - i), len - i);
+  m->params = copy_tokens(params.data, params.len);
+  m->nparams = params.len;
+  m->is_variadic = is_variadic;
+  buf_free(&params);
+}
+
+// 宏的实参
+typedef struct {
+  PPToken *toks;     // 未展开的实参
+  int len;           // 未展开的实参长度
+  TokenBuf expanded; // 完全展开后的实参
+  bool is_expanded;  // 是否已经展开
+} MacroArg;
+
+static bool expand_macro(PPToken *tok);
+
+// 对 toks[0..len) 单独进行完整的宏展开，结果追加到 out 中
+static void expand_tokens(PPToken *toks, int len, TokenBuf *out) {
+  // 结束标记之后的终结符不参与展开
+  buf_push(&PENDING, (PPToken){.kind = TK_EOF});
+  push_pending(toks, len);
+
+  while (true) {
+    PPToken tok = read_token();
+    if (tok.kind == TK_EOF)
+      break;
+    if (expand_macro(&tok))
+      continue;
+    buf_push(out, tok);
+  }
+}
+
+// 读取函数式宏的实参，返回右括号
+static PPToken read_macro_args(Macro *m, PPToken *name, TokenBuf *raw,
+                               MacroArg *args) {
+  // 跳过 (
+  read_token();
+
+  // 所有实参依次存放在 raw 中，starts 记录每个实参的起始位置
+  int nargs = m->nparams + m->is_variadic;
+  int *starts = scratch_calloc(nargs + 2, sizeof(int));
+  int n = 0, depth = 0;
+  PPToken tok;
+
+  while (true) {
+    tok = read_token();
+    if (tok.kind == TK_EOF)
+      error_srcloc(name->loc, "unterminated macro argument list");
+
+    if (depth == 0 && pp_equal(&tok, ")"))
+      break;
+
+    // 可变参数中的 , 属于实参的一部分
+    if (depth == 0 && pp_equal(&tok, ",") &&
+        !(m->is_variadic && n == m->nparams)) {
+      if (n + 1 >= nargs)
+        error_srcloc(name->loc, "too many arguments");
+      starts[++n] = raw->len;
+      continue;
+    }
+
+    if (pp_equal(&tok, "("))
+      depth++;
+    else if (pp_equal(&tok, ")"))
+      depth--;
+    buf_push(raw, tok);
+  }
+
+  // 可变参数为空
+  if (m->is_variadic && n + 1 == m->nparams)
+    starts[++n] = raw->len;
+  // f() 视为有一个空的实参
+  if (nargs == 0 ? raw->len > 0 : n + 1 != nargs)
+    error_srcloc(name->loc, "too few arguments");
+  starts[n + 1] = raw->len;
+
+  for (int i = 0; i < nargs; i++) {
+    args[i].toks = raw->data + starts[i];
+    args[i].len = starts[i + 1] - starts[i];
+  }
+  scratch_free(starts);
+  return tok;
+}
+
+// 查找形参对应的实参
+static MacroArg *find_arg(Macro *m, MacroArg *args, PPToken *tok) {
+  if (!args || tok->kind != TK_IDENT)
+    return NULL;
+  for (int i = 0; i < m->nparams; i++)
+    if (pp_same(&m->params[i], tok))
+      return &args[i];
+  if (m->is_variadic && pp_equal(tok, "__VA_ARGS__"))
+    return &args[m->nparams];
+  return NULL;
+}
+
+// 将实参代入替换列表
+static void subst(Macro *m, MacroArg *args, TokenBuf *out) {
+  PPToken *body = m->body;
+  int len = m->body_len;
+
+  for (int i = 0; i < len; i++) {
+    PPToken *tok = &body[i];
+
+    // "#" 实参 替换为实参的字符串
+    if (!m->is_objlike && pp_equal(tok, "#")) {
+      MacroArg *arg = i + 1 < len ? find_arg(m, args, &body[i + 1]) : NULL;
+      if (!arg)
+        error_srcloc(tok->loc, "'#' is not followed by a macro parameter");
+      buf_push(out, stringize(tok, arg->toks, arg->len));
+      i++;
+      continue;
+    }
+
+    // x ## y 将两侧的终结符拼接为一个
+    if (pp_equal(tok, "##")) {
+      if (out->len == 0)
+        error_srcloc(tok->loc,
+                     "'##' cannot appear at start of macro expansion");
+      if (i + 1 == len)
+        error_srcloc(tok->loc, "'##' cannot appear at end of macro expansion");
+
+      PPToken *rhs = &body[++i];
+      MacroArg *arg = find_arg(m, args, rhs);
+      if (!arg) {
+        PPToken *lhs = &out->data[out->len - 1];
+        *lhs = paste(lhs, rhs);
+        continue;
+      }
+      // 右侧为形参时，使用未展开的实参
+      if (arg->len > 0) {
+        PPToken *lhs = &out->data[out->len - 1];
+        *lhs = paste(lhs, &arg->toks[0]);
+        for (int j = 1; j < arg->len; j++)
+          buf_push(out, arg->toks[j]);
+      }
+      continue;
+    }
+
+    MacroArg *arg = find_arg(m, args, tok);
+
+    // 形参 ## 使用未展开的实参
+    if (arg && i + 1 < len && pp_equal(&body[i + 1], "##")) {
+      if (arg->len == 0) {
+        // 左侧的实参为空，直接代入右侧
+        PPToken *rhs = i + 2 < len ? &body[i + 2] : NULL;
+        if (!rhs)
+          error_srcloc(body[i + 1].loc,
+                       "'##' cannot appear at end of macro expansion");
+        MacroArg *arg2 = find_arg(m, args, rhs);
+        if (arg2) {
+          for (int j = 0; j < arg2->len; j++)
+            buf_push(out, arg2->toks[j]);
+        } else {
+          buf_push(out, *rhs);
+        }
+        i += 2;
+        continue;
+      }
+      for (int j = 0; j < arg->len; j++) {
+        PPToken t = arg->toks[j];
+        if (j == 0)
+          t.flags = tok->flags;
+        buf_push(out, t);
+      }
+      continue;
+    }
+
+    // 其余的形参替换为完全展开后的实参
+    if (arg) {
+      if (!arg->is_expanded) {
+        expand_tokens(arg->toks, arg->len, &arg->expanded);
+        arg->is_expanded = true;
+      }
+      for (int j = 0; j < arg->expanded.len; j++) {
+        PPToken t = arg->expanded.data[j];
+        if (j == 0)
+          t.flags = tok->flags;
+        buf_push(out, t);
+      }
+      continue;
+    }
+
+    buf_push(out, *tok);
+  }
+}
+
+// 若 tok 为宏，则将其展开，展开的结果放入待读取的终结符中
+// 返回是否进行了展开
+static bool expand_macro(PPToken *tok) {
+  // 宏展开的结果中不会再次展开同一个宏
+  if (hideset_contains(tok->hideset, pp_text(tok), tok->len))
+    return false;
+
+  Macro *m = find_macro(tok);
+  if (!m)
+    return false;
+
+  // 内置宏
+  if (m->handler) {
+    PPToken t = m->handler(tok);
+    push_pending(&t, 1);
+    return true;
+  }
+
+  TokenBuf out = {};
+  Hideset *hs;
+
+  if (m->is_objlike) {
+    hs = hideset_union(tok->hideset, new_hideset(tok));
+    subst(m, NULL, &out);
+  } else {
+    // 宏名之后不是 ( 时，不作为宏展开
+    if (!pp_equal(peek_token(), "("))
+      return false;
+
+    TokenBuf raw = {};
+    int nargs = m->nparams + m->is_variadic;
+    MacroArg *args = scratch_calloc(nargs + 1, sizeof(MacroArg));
+    PPToken rparen = read_macro_args(m, tok, &raw, args);
+
+    // 展开结果的宏名集合为 宏名与右括号的集合的交集 加上该宏名
+    hs = hideset_intersection(tok->hideset, rparen.hideset);
+    hs = hideset_union(hs, new_hideset(tok));
+    subst(m, args, &out);
+
+    for (int i = 0; i < nargs; i++)
+      buf_free(&args[i].expanded);
+    scratch_free(args);
+    buf_free(&raw);
+  }
+
+  for (int i = 0; i < out.len; i++)
+    out.data[i].hideset = hideset_union(out.data[i].hideset, hs);
+  // 展开结果继承宏名前的空白
+  if (out.len > 0)
+    out.data[0].flags = tok->flags;
+
+  push_pending(out.data, out.len);
+  buf_free(&out);
+  return true;
+}
+
+//
+// 条件编译
+//
+
+// 读取 #if 的常量表达式时使用的终结符
+static _Thread_local PPToken *EXPR_TOKS;
+static _Thread_local int EXPR_LEN;
+static _Thread_local int EXPR_POS;
+
+// 返回常量表达式中的下一个终结符，到达结尾时返回 NULL
+static PPToken *expr_peek(void) {
+  return EXPR_POS < EXPR_LEN ? &EXPR_TOKS[EXPR_POS] : NULL;
+}
+
+// 尝试跳过常量表达式中的 op
+static bool expr_consume(char *op) {
+  PPToken *tok = expr_peek();
+  if (tok && tok->kind == TK_PUNCT && pp_equal(tok, op)) {
+    EXPR_POS++;
+    return true;
+  }
+  return false;
+}
+
+static long eval_expr(SrcLoc loc);
+
+// primary = "(" expr ")" | num | ident
+// 在宏展开后仍保留的标识符视为 0
+static long eval_primary(SrcLoc loc) {
+  PPToken *tok = expr_peek();
+  if (!tok)
+    error_srcloc(loc, "missing expression");
+
+  if (expr_consume("(")) {
+    long val = eval_expr(loc);
+    if (!expr_consume(")"))
+      error_srcloc(tok->loc, "expected ')'");
+    return val;
+  }
+
+  EXPR_POS++;
+  if (tok->kind == TK_NUM)
+    return strtol(pp_text(tok), NULL, 10);
+  if (tok->kind == TK_IDENT)
+    return 0;
+  error_srcloc(tok->loc, "invalid expression");
+  return 0;
+}
+
+// unary = ("+" | "-" | "!" | "~") unary | primary
+static long eval_unary(SrcLoc loc) {
+  if (expr_consume("+"))
+    return eval_unary(loc);
+  if (expr_consume("-"))
+    return -eval_unary(loc);
+  if (expr_consume("!"))
+    return !eval_unary(loc);
+  if (expr_consume("~"))
+    return ~eval_unary(loc);
+  return eval_primary(loc);
+}
+
+// 常量表达式中的二元运算符，按优先级从低到高排列
+static char *EXPR_OPS[][4] = {
+    {"||"},       {"&&"},     {"|"},
+    {"^"},        {"&"},      {"==", "!="},
+    {"<", "<=", ">", ">="},   {"<<", ">>"},
+    {"+", "-"},   {"*", "/", "%"},
+};
+
+// 计算二元运算
+static long eval_bin_op(char *op, long lhs, long rhs, SrcLoc loc) {
+  if ((!strcmp(op, "/") || !strcmp(op, "%")) && rhs == 0)
+    error_srcloc(loc, "division by zero");
+
+  switch (op[0]) {
+  case '|':
+    return op[1] ? lhs || rhs : lhs | rhs;
+  case '&':
+    return op[1] ? lhs && rhs : lhs & rhs;
+  case '^':
+    return lhs ^ rhs;
+  case '=':
+    return lhs == rhs;
+  case '!':
+    return lhs != rhs;
+  case '<':
+    return op[1] == '<' ? lhs << rhs : op[1] ? lhs <= rhs : lhs < rhs;
+  case '>':
+    return op[1] == '>' ? lhs >> rhs : op[1] ? lhs >= rhs : lhs > rhs;
+  case '+':
+    return lhs + rhs;
+  case '-':
+    return lhs - rhs;
+  case '*':
+    return lhs * rhs;
+  case '/':
+    return lhs / rhs;
+  default: // %
+    return lhs % rhs;
+  }
+}
+
+// 按优先级 prec 计算二元运算
+static long eval_binary(int prec, SrcLoc loc) {
+  int nprec = sizeof(EXPR_OPS) / sizeof(*EXPR_OPS);
+  if (prec == nprec)
+    return eval_unary(loc);
+
+  long val = eval_binary(prec + 1, loc);
+  while (true) {
+    char *op = NULL;
+    for (int i = 0; i < 4 && EXPR_OPS[prec][i]; i++) {
+      if (expr_consume(EXPR_OPS[prec][i])) {
+        op = EXPR_OPS[prec][i];
+        break;
+      }
+    }
+    if (!op)
+      return val;
+    val = eval_bin_op(op, val, eval_binary(prec + 1, loc), loc);
+  }
+}
+
+// expr = binary ("?" expr ":" expr)?
+static long eval_expr(SrcLoc loc) {
+  long cond = eval_binary(0, loc);
+  if (!expr_consume("?"))
+    return cond;
+
+  long then = eval_expr(loc);
+  if (!expr_consume(":"))
+    error_srcloc(loc, "expected ':'");
+  long els = eval_expr(loc);
+  return cond ? then : els;
+}
+
+// 计算 #if 和 #elif 之后的常量表达式
+static long eval_const_expr(PPToken *hash, PPToken *line, int len) {
+  TokenBuf buf = {};
+
+  // 先处理 defined(name) 和 defined name，避免其中的宏名被展开
+  for (int i = 0; i < len; i++) {
+    if (!pp_equal(&line[i], "defined")) {
+      buf_push(&buf, line[i]);
+      continue;
+    }
+
+    PPToken *start = &line[i];
+    bool has_paren = i + 1 < len && pp_equal(&line[i + 1], "(");
+    if (has_paren)
+      i++;
+    if (i + 1 >= len || line[i + 1].kind != TK_IDENT)
+      error_srcloc(start->loc, "macro name must be an identifier");
+    PPToken *name = &line[++i];
+    if (has_paren && (++i >= len || !pp_equal(&line[i], ")")))
+      error_srcloc(name->loc, "expected ')'");
+
+    buf_push(&buf, new_num_token(find_macro(name) ? 1 : 0, start));
+  }
+
+  TokenBuf expanded = {};
+  expand_tokens(buf.data, buf.len, &expanded);
+
+  EXPR_TOKS = expanded.data;
+  EXPR_LEN = expanded.len;
+  EXPR_POS = 0;
+  long val = eval_expr(hash->loc);
+  if (EXPR_POS != EXPR_LEN)
+    error_srcloc(EXPR_TOKS[EXPR_POS].loc, "extra token");
+
+  buf_free(&buf);
+  buf_free(&expanded);
+  return val;
+}
+
+// 压入一个条件编译
+static void push_cond_incl(PPToken *hash, bool included) {
+  if (CONDS_LEN == CONDS_CAP) {
+    CONDS_CAP = CONDS_CAP ? CONDS_CAP * 2 : 16;
+    CONDS = realloc(CONDS, sizeof(CondIncl) * CONDS_CAP);
+    if (!CONDS)
+      error("out of memory");
+  }
+  CONDS[CONDS_LEN++] = (CondIncl){IN_THEN, hash->loc, included};
+}
+
+// 跳过条件编译中未被选中的分支，直到同一层的 #elif、#else 或 #endif
+static void skip_cond_incl(void) {
+  FileFrame *frame = &FRAMES[FRAMES_LEN - 1];
+  CachedFile *cf = frame->file;
+  int depth = 0;
+
+  for (PPToken *tok = frame_peek(frame, 0); tok->kind != TK_EOF;
+       frame_advance(frame), tok = frame_peek(frame, 0)) {
+    if (!raw_is_hash(cf, tok))
+      continue;
+
+    PPToken *dir = frame_peek(frame, 1);
+    if (raw_is_if(cf, dir)) {
+      depth++;
+    } else if (depth > 0 && raw_equal(cf, dir, "endif")) {
+      depth--;
+    } else if (depth == 0 &&
+               (raw_equal(cf, dir, "elif") || raw_equal(cf, dir, "else") ||
+                raw_equal(cf, dir, "endif"))) {
+      return;
+    }
+  }
+  // 到达文件末尾，由文件结束时的检查报错
+}
+
+//
+// 包含文件
+//
+
+// 判断文件是否形如
+//
+//   #ifndef NAME
+//   #define NAME
+//   ...
+//   #endif
+//
+// 若是则记录 NAME，此后 NAME 已定义时可以直接跳过该文件
+static void detect_include_guard(CachedFile *cf) {
+  PPToken *tok = cf->tokens;
+  if (!raw_is_hash(cf, &tok[0]) || !raw_equal(cf, &tok[1], "ifndef") ||
+      tok[2].kind != TK_IDENT || !(tok[3].flags & PP_BOL))
+    return;
+  PPToken *name = &tok[2];
+
+  if (!raw_is_hash(cf, &tok[3]) || !raw_equal(cf, &tok[4], "define") ||
+      tok[5].len != name->len ||
+      memcmp(cf->file->contents + tok[5].loc, cf->file->contents + name->loc,
+             name->len))
+    return;
+
+  // #endif 必须与 #ifndef 对应，且位于文件末尾
+  int depth = 0;
+  for (tok += 3; tok->kind != TK_EOF; tok++) {
+    if (!raw_is_hash(cf, tok))
+      continue;
+
+    PPToken *dir = tok + 1;
+    if (raw_is_if(cf, dir)) {
+      depth++;
+    } else if (raw_equal(cf, dir, "endif")) {
+      if (depth-- > 0)
+        continue;
+      if ((dir + 1)->kind == TK_EOF) {
+        cf->guard = cf->file->contents + name->loc;
+        cf->guard_len = name->len;
+      }
+      return;
+    } else if (depth == 0 &&
+               (raw_equal(cf, dir, "elif") || raw_equal(cf, dir, "else"))) {
+      return;
+    }
+  }
+}
+
+// 返回缓存的文件，未缓存时读取并解析文件，文件不存在时返回 NULL
+// 解析时先从终结符缓存(--token-cache)中加载
+static CachedFile *load_file(char *path) {
+  CachedFile *cf = hashmap_get(&FILE_CACHE, path);
+  if (cf)
+    return cf;
+
+  SourceFile *file = NULL;
+  PPToken *tokens = load_token_cache(path, &file);
+  if (!file)
+    file = read_source_file(path);
+  if (!file)
+    return NULL;
+
+  if (!tokens) {
+    tokens = tokenize(file);
+    save_token_cache(file, tokens);
+  }
+
+  cf = arena_alloc(ARENA_TOKEN, sizeof(CachedFile));
+  cf->file = file;
+  cf->tokens = tokens;
+  detect_include_guard(cf);
+  hashmap_put(&FILE_CACHE, path, cf);
+  return cf;
+}
+
+// 开始读取文件
+static void push_file(CachedFile *cf) {
+  // 再次包含的头文件已经被 #pragma once 或 include guard 保护
+  if (cf->once)
+    return;
+  if (cf->guard && hashmap_get2(&MACROS, cf->guard, cf->guard_len))
+    return;
+
+  if (FRAMES_LEN == FRAMES_CAP) {
+    FRAMES_CAP = FRAMES_CAP ? FRAMES_CAP * 2 : 16;
+    FRAMES = realloc(FRAMES, sizeof(FileFrame) * FRAMES_CAP);
+    if (!FRAMES)
+      error("out of memory");
+  }
+  FileFrame *frame = &FRAMES[FRAMES_LEN++];
+  *frame = (FileFrame){.file = cf, .pos = cf->tokens, .cond_len = CONDS_LEN};
+
+  // 未解析为终结符数组的文件，读取时再逐个解析终结符
+  if (!cf->tokens) {
+    frame->lex = arena_alloc(ARENA_TOKEN, sizeof(Lexer));
+    init_lexer(frame->lex, cf->file);
+  }
+}
+
+// 添加 #include 的搜索路径(-I)
+void add_include_path(char *dir) {
+  INCLUDE_PATHS =
+      realloc(INCLUDE_PATHS, sizeof(char *) * (INCLUDE_PATHS_LEN + 1));
+  INCLUDE_PATHS[INCLUDE_PATHS_LEN++] = dir;
+}
+
+// 清空所有 #include 的搜索路径
+void clear_include_paths(void) {
+  free(INCLUDE_PATHS);
+  INCLUDE_PATHS = NULL;
+  INCLUDE_PATHS_LEN = 0;
+}
+
+// 返回所有 #include 的搜索路径，*len 为路径的数量
+char **get_include_paths(int *len) {
+  *len = INCLUDE_PATHS_LEN;
+  return INCLUDE_PATHS;
+}
+
+// 返回 path 所在的目录
+static char *dir_name(char *path) {
+  char *slash = strrchr(path, '/');
+  if (!slash)
+    return ".";
+  return arena_strndup(path, slash - path);
+}
+
+// 查找被包含的文件
+// "name" 先在当前文件所在的目录中查找，<name> 只在搜索路径中查找
+static CachedFile *search_include(char *name, bool is_dquote) {
+  if (name[0] == '/')
+    return load_file(name);
+
+  if (is_dquote) {
+    char *dir = dir_name(FRAMES[FRAMES_LEN - 1].file->file->name);
+    CachedFile *cf = load_file(format("%s/%s", dir, name));
+    if (cf)
+      return cf;
+  }
+
+  for (int i = 0; i < INCLUDE_PATHS_LEN; i++) {
+    CachedFile *cf = load_file(format("%s/%s", INCLUDE_PATHS[i], name));
+    if (cf)
+      return cf;
+  }
+  return NULL;
+}
+
+// 读取 #include 之后的文件名，*is_dquote 返回是否为 "name" 的形式
+static char *read_include_filename(PPToken *hash, PPToken *line, int len,
+                                   bool *is_dquote) {
+  if (len == 0)
+    error_srcloc(hash->loc, "expected a filename");
+
+  // #include "foo.h"
+  // 文件名中不处理转义
+  if (line[0].kind == TK_STR) {
+    *is_dquote = true;
+    return arena_strndup(pp_text(&line[0]) + 1, line[0].len - 2);
+  }
+
+  // #include <foo.h>
+  if (pp_equal(&line[0], "<")) {
+    int i = 1;
+    while (i < len && !pp_equal(&line[i], ">"))
+      i++;
+    if (i == len)
+      error_srcloc(line[0].loc, "expected '>'");
+    *is_dquote = false;
+    return join_tokens(&line[1], i - 1);
+  }
+
+  // #include FOO, FOO 展开为以上两种形式
+  if (line[0].kind == TK_IDENT) {
+    TokenBuf buf = {};
+    expand_tokens(line, len, &buf);
+    if (buf.len == 0 || buf.data[0].kind == TK_IDENT)
+      error_srcloc(line[0].loc, "expected a filename");
+    char *name = read_include_filename(hash, buf.data, buf.len, is_dquote);
+    buf_free(&buf);
+    return name;
+  }
+
+  error_srcloc(line[0].loc, "expected a filename");
+  return NULL;
+}
+
+//
+// 预处理指令
+//
+
+// 内置宏 __FILE__
+static PPToken file_macro(PPToken *tok) {
+  return new_str_token(srcloc_file(tok->loc)->name, tok);
+}
+
+// 内置宏 __LINE__
+static PPToken line_macro(PPToken *tok) {
+  return new_num_token(srcloc_line(tok->loc), tok);
+}
+
+// 定义内置宏
+static void add_builtin(char *name, MacroHandler handler) {
+  Macro *m = arena_alloc(ARENA_SYMBOL, sizeof(Macro));
+  m->is_objlike = true;
+  m->handler = handler;
+  hashmap_put(&MACROS, name, m);
+}
+
+// 执行 # 开始的预处理指令
+// 指令只能出现在文件中，因此直接从当前文件中读取
+static void directive(void) {
+  FileFrame *frame = &FRAMES[FRAMES_LEN - 1];
+  PPToken hash_tok = relocate(frame->file, frame_peek(frame, 0));
+  PPToken *hash = &hash_tok;
+  frame_advance(frame);
+
+  // 空指令
+  PPToken *next = frame_peek(frame, 0);
+  if (next->kind == TK_EOF || (next->flags & PP_BOL))
+    return;
+  PPToken dir_tok = relocate(frame->file, next);
+  PPToken *dir = &dir_tok;
+  frame_advance(frame);
+
+  // 指令的其余部分
+  int len;
+  PPToken *line = read_line(&len);
+
+  if (pp_equal(dir, "include")) {
+    bool is_dquote;
+    char *name = read_include_filename(hash, line, len, &is_dquote);
+    CachedFile *cf = search_include(name, is_dquote);
+    if (!cf)
+      error_srcloc(line[0].loc, "can't open %s", name);
+    push_file(cf);
+    return;
+  }
+
+  if (pp_equal(dir, "define")) {
+    read_macro_definition(dir, line, len);
+    return;
+  }
+
+  if (pp_equal(dir, "undef")) {
+    if (len == 0 || line[0].kind != TK_IDENT)
+      error_srcloc(dir->loc, "macro name must be an identifier");
+    hashmap_delete2(&MACROS, pp_text(&line[0]), line[0].len);
+    return;
+  }
+
+  if (pp_equal(dir, "if")) {
+    bool included = eval_const_expr(hash, line, len);
+    push_cond_incl(hash, included);
+    if (!included)
+      skip_cond_incl();
+    return;
+  }
+
+  if (pp_equal(dir, "ifdef") || pp_equal(dir, "ifndef")) {
+    if (len == 0 || line[0].kind != TK_IDENT)
+      error_srcloc(dir->loc, "macro name must be an identifier");
+    bool defined = find_macro(&line[0]);
+    bool included = pp_equal(dir, "ifdef") ? defined : !defined;
+    push_cond_incl(hash, included);
+    if (!included)
+      skip_cond_incl();
+    return;
+  }
+
+  if (pp_equal(dir, "elif")) {
+    if (CONDS_LEN == 0 || CONDS[CONDS_LEN - 1].ctx == IN_ELSE)
+      error_srcloc(hash->loc, "stray #elif");
+    CondIncl *cond = &CONDS[CONDS_LEN - 1];
+    cond->ctx = IN_ELIF;
+
+    if (!cond->included && eval_const_expr(hash, line, len))
+      cond->included = true;
+    else
+      skip_cond_incl();
+    return;
+  }
+
+  if (pp_equal(dir, "else")) {
+    if (CONDS_LEN == 0 || CONDS[CONDS_LEN - 1].ctx == IN_ELSE)
+      error_srcloc(hash->loc, "stray #else");
+    CondIncl *cond = &CONDS[CONDS_LEN - 1];
+    cond->ctx = IN_ELSE;
+
+    if (cond->included)
+      skip_cond_incl();
+    return;
+  }
+
+  if (pp_equal(dir, "endif")) {
+    if (CONDS_LEN == 0)
+      error_srcloc(hash->loc, "stray #endif");
+    CONDS_LEN--;
+    return;
+  }
+
+  if (pp_equal(dir, "pragma")) {
+    // #pragma once，此后不再包含该文件
+    if (len > 0 && pp_equal(&line[0], "once"))
+      frame->file->once = true;
+    // 忽略其他 #pragma
+    return;
+  }
+
+  if (pp_equal(dir, "error"))
+    error_srcloc(hash->loc, "#error %s", join_tokens(line, len));
+
+  error_srcloc(dir->loc, "invalid preprocessor directive");
+}
+
+// 开始预处理 path 对应的文件
+// token1, token2, token3 ... 依次存放在终结符流中，返回第一个 token；
+// 终结符在被访问时才由 preprocess_next 按需预处理
+Token preprocess(char *path) {
+  SourceFile *file = read_source_file(path);
+  if (!file)
+    error("can't open %s: %s", path, strerror(errno));
+  return preprocess_file(file);
+}
+
+// 开始预处理已登记的源文件
+Token preprocess_file(SourceFile *file) {
+  add_builtin("__FILE__", file_macro);
+  add_builtin("__LINE__", line_macro);
+
+  // 主文件只读取一次，不解析为终结符数组，也不经过终结符缓存
+  CachedFile *cf = arena_alloc(ARENA_TOKEN, sizeof(CachedFile));
+  cf->file = file;
+  push_file(cf);
+
+  // 返回第一个 token
+  return 0;
+}
+
+// 预处理下一个终结符并加入终结符流，文件结束后总是加入 TK_EOF
+void preprocess_next(void) {
+  while (true) {
+    PPToken *tok = peek_token();
+
+    // 只有文件中位于行首的 # 才是预处理指令
+    if (!PENDING.len && is_hash(tok)) {
+      directive();
+      continue;
+    }
+
+    if (tok->kind == TK_EOF)
+      break;
+
+    PPToken t = read_token();
+    if (expand_macro(&t))
+      continue;
+    push_token(&t);
+    return;
+  }
+
+  if (CONDS_LEN > 0)
+    error_srcloc(CONDS[CONDS_LEN - 1].loc,
+                 "unterminated conditional directive");
+
+  // 解析结束之后追加一个 EOF
+  push_token(peek_token());
+}
+
+// 清空宏定义、文件缓存及各个栈，以便同一线程预处理下一个文件
+void preprocess_reset(void) {
+  hashmap_free(&MACROS);
+  hashmap_free(&FILE_CACHE);
+  free(FRAMES);
+  FRAMES = NULL;
+  FRAMES_LEN = FRAMES_CAP = 0;
+  free(CONDS);
+  CONDS = NULL;
+  CONDS_LEN = CONDS_CAP = 0;
+  // PENDING 及 LINE 的数组也是临时内存
+  for (int i = 0; i < SCRATCH_LEN; i++)
+    free(SCRATCH[i]);
+  free(SCRATCH);
+  SCRATCH = NULL;
+  SCRATCH_LEN = SCRATCH_CAP = 0;
+  PENDING = (TokenBuf){};
+  LINE = (TokenBuf){};
+}
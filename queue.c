@@ -0,0 +1,82 @@
+#include "rvcc.h"
+#include <stdatomic.h>
+
+//
+// 单生产者单消费者队列
+//
+// 容量固定的环形缓冲区，只有一个线程放入、一个线程取出，双方无需加锁：
+// 生产者只写 tail，写入元素后以 release 语义发布；
+// 消费者只写 head，以 acquire 语义读取 tail 后即可看到元素及其指向的数据
+//
+
+// 缓存行的大小
+#define CACHE_LINE 64
+
+struct SpscQueue {
+  void **items; // 元素
+  size_t cap;   // 容量，为 2 的幂
+  // head 与 tail 位于不同的缓存行，两个线程不会互相使对方的缓存行失效
+  _Alignas(CACHE_LINE) atomic_size_t head; // 下一个取出的位置
+  _Alignas(CACHE_LINE) atomic_size_t tail; // 下一个放入的位置
+};
+
+// 创建容量至少为 cap 的队列
+SpscQueue *spsc_new(int cap) {
+  SpscQueue *q =
+      aligned_alloc(CACHE_LINE, align_to(sizeof(SpscQueue), CACHE_LINE));
+  if (!q)
+    error("out of memory");
+  q->cap = 1;
+  while (q->cap < cap)
+    q->cap *= 2;
+  q->items = calloc(q->cap, sizeof(void *));
+  if (!q->items)
+    error("out of memory");
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  return q;
+}
+
+// 释放队列，其中剩余的元素由调用者处理
+void spsc_free(SpscQueue *q) {
+  free(q->items);
+  free(q);
+}
+
+// 由生产者放入一个非空的元素，队列已满时返回 false
+bool spsc_push(SpscQueue *q, void *item) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  if (tail - head == q->cap)
+    return false;
+
+  q->items[tail & (q->cap - 1)] = item;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+// 由消费者取出一个元素，队列为空时返回 NULL
+void *spsc_pop(SpscQueue *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  if (head == tail)
+    return NULL;
+
+  void *item = q->items[head & (q->cap - 1)];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return item;
+}
+
+// 由生产者判断队列是否已满
+bool spsc_full(SpscQueue *q) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+  return tail - head == q->cap;
+}
+
+// 由消费者判断队列是否为空
+bool spsc_empty(SpscQueue *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+  return head == tail;
+}
@@ -3,8 +3,10 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,12 +14,94 @@
 typedef struct Node Node;
 typedef struct Type Type;
 
+// 标记不可能到达的代码位置
+#define unreachable() error("internal error at %s:%d", __FILE__, __LINE__)
+
 //
 // 字符串处理
 //
 
 char *format(char *fmt, ...);
 
+//
+// 内存分配
+//
+
+// 各编译阶段使用的内存区域
+typedef enum {
+  ARENA_TOKEN,  // 终结符
+  ARENA_AST,    // 语法树节点
+  ARENA_TYPE,   // 类型，同一线程的多次编译共用
+  ARENA_SYMBOL, // 全局变量、函数及其作用域
+  ARENA_LOCAL,  // 局部变量及其作用域
+  ARENA_STRING, // 标识符、字面量等字符串
+  ARENA_NUM,    // 区域的数量
+} ArenaKind;
+
+// 从 kind 对应的区域中分配 size 字节，内容全部为0
+void *arena_alloc(ArenaKind kind, size_t size);
+// 在字符串区域中复制 s 的前 n 个字符，并以'\0'结尾
+char *arena_strndup(char *s, size_t n);
+// 一次性释放 kind 对应区域中的所有对象
+void arena_release(ArenaKind kind);
+// 清空 kind 对应区域中的所有对象，保留已申请的内存供之后复用
+void arena_reset(ArenaKind kind);
+// 输出各区域的内存使用统计
+void arena_print_stats(FILE *out);
+
+// 从一个线程取出、交由另一个线程接管的区域
+typedef struct ArenaSet ArenaSet;
+// 取出当前线程所有区域中的内存，当前线程的区域随之清空
+ArenaSet *arena_detach(void);
+// 当前线程接管 set 中的内存，之后随当前线程的区域一起重置或释放
+void arena_attach(ArenaSet *set);
+
+//
+// 哈希表
+//
+
+typedef struct {
+  char *key;  // 键，不要求以'\0'结尾
+  int keylen; // 键的长度
+  void *val;  // 值
+} HashEntry;
+
+typedef struct {
+  HashEntry *buckets; // 桶数组
+  int capacity;       // 桶的数量
+  int used;           // 使用过的桶数量(包括墓碑)
+} HashMap;
+
+// FNV-1a 哈希函数
+uint64_t fnv_hash(char *s, int len);
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+void hashmap_delete(HashMap *map, char *key);
+void hashmap_delete2(HashMap *map, char *key, int keylen);
+void hashmap_free(HashMap *map);
+
+//
+// 队列
+//
+
+// 容量固定的单生产者单消费者无锁队列
+typedef struct SpscQueue SpscQueue;
+
+// 创建容量至少为 cap 的队列
+SpscQueue *spsc_new(int cap);
+// 释放队列，其中剩余的元素由调用者处理
+void spsc_free(SpscQueue *q);
+// 由生产者放入一个非空的元素，队列已满时返回 false
+bool spsc_push(SpscQueue *q, void *item);
+// 由消费者取出一个元素，队列为空时返回 NULL
+void *spsc_pop(SpscQueue *q);
+// 由生产者判断队列是否已满
+bool spsc_full(SpscQueue *q);
+// 由消费者判断队列是否为空
+bool spsc_empty(SpscQueue *q);
+
 //
 // 一、词法分析
 //
@@ -31,42 +115,255 @@ typedef enum {
   TK_EOF,     // 文件终止符
 } TokenKind;
 
-typedef struct Token Token;
-struct Token {
-  TokenKind kind; // 类型
-  Token *next;    // 下一个终结符
-  char *loc;      // 在被解析字符串中的位置
-  int len;        // 长度
-  int line;       // 行号
+// 终结符
+//
+// 终结符依次存放在终结符流中，Token 即为终结符在流中的序号，
+// 其后继终结符为 token + 1
+typedef uint32_t Token;
 
-  union {
-    // TK_NUM
-    int val; // 值
+// 源码位置，即字符在源码空间中的位置
+typedef uint32_t SrcLoc;
 
-    // TK_STR
-    struct {
-      Type *type;
-      char *str; // 字符串字面量，包括 '\0'
-    };
-  };
+// 源文件
+//
+// 所有源文件及预处理时合成的文本依次排列在同一个源码空间中，
+// 文件中的字符在源码空间中的位置为 base + 偏移
+typedef struct {
+  char *name;     // 文件名
+  int file_no;    // 文件编号，用于 .file/.loc；合成的文本为 0
+  char *contents; // 文件内容，以 '\0' 结尾
+  SrcLoc base;    // 文件在源码空间中的起始位置
+  uint32_t size;  // 文件内容的长度
+  SrcLoc origin;  // 合成的文本：产生该文本的源码位置
+
+  uint32_t *line_starts; // 每一行起始位置相对于文件的偏移
+  int line_len;          // 行数
+} SourceFile;
+
+// 预处理终结符的标志
+enum {
+  PP_BOL = 1,   // 位于行首
+  PP_SPACE = 2, // 前面有空白
 };
 
+typedef struct Hideset Hideset;
+
+// 预处理终结符
+//
+// 预处理阶段只记录终结符的种类和位置，
+// 字面量的值在加入终结符流(push_token)时才解析
+typedef struct {
+  uint8_t kind;     // 种类(TokenKind)
+  uint8_t flags;    // 标志(PP_BOL, PP_SPACE)
+  SrcLoc loc;       // 源码位置；文件的终结符数组中为相对于文件起始的位置
+  uint32_t len;     // 长度
+  Hideset *hideset; // 展开时不能再次展开的宏
+} PPToken;
+
+// 设置当前线程出错时的恢复点及错误信息的输出位置
+// jmp 为 NULL 时出错即退出程序，out 为 NULL 时输出到 stderr
+void set_error_handler(jmp_buf *jmp, FILE *out);
+// 返回当前线程出错时的恢复点及错误信息的输出位置
+void get_error_handler(jmp_buf **jmp, FILE **out);
 // 输出错误信息
-void error(char *fmt, ...);
-// 指示错误信息并退出程序
-void error_at(char *loc, char *fmt, ...);
+_Noreturn void error(char *fmt, ...);
+// 指示当前正在解析的文件中 loc 处出错，并退出程序
+_Noreturn void error_at(char *loc, char *fmt, ...);
 // 指示 token 解析出错，并退出程序
-void error_token(Token *token, char *fmt, ...);
+_Noreturn void error_token(Token token, char *fmt, ...);
+// 指示源码位置 loc 处出错，并退出程序
+_Noreturn void error_srcloc(SrcLoc loc, char *fmt, ...);
+
+// 返回 token 的种类
+TokenKind tok_kind(Token token);
+// 返回 token 的标志(PP_BOL, PP_SPACE)
+int tok_flags(Token token);
+// 返回 token 在输入字符串中的位置
+char *tok_loc(Token token);
+// 返回 token 的长度
+int tok_len(Token token);
+// 返回 token 在源码中的位置
+SrcLoc tok_srcloc(Token token);
+// 返回 token 所在的行号
+int tok_line(Token token);
+// 返回 TK_NUM token 的值
+int tok_val(Token token);
+// 返回 TK_STR token 的内容，包括 '\0'
+char *tok_str(Token token);
+// 返回 TK_STR token 内容的长度，包括 '\0'
+int tok_str_len(Token token);
+
+// 返回源码位置 loc 对应的字符
+char *srcloc_ptr(SrcLoc loc);
+// 返回源码位置 loc 处的标识符
+char *srcloc_ident(SrcLoc loc);
+// 返回源码位置 loc 所在的行号
+int srcloc_line(SrcLoc loc);
+// 返回源码位置 loc 所在的文件
+SourceFile *srcloc_file(SrcLoc loc);
+// 返回源码位置 loc 所在源文件的编号
+int srcloc_file_no(SrcLoc loc);
+// 返回编号为 file_no 的源文件的名称，不存在时返回 NULL
+char *source_file_name(int file_no);
 
 // 判断 token 的值是否与给定的 char* 值相同
-bool equal(Token *token, char *str);
+bool equal(Token token, char *str);
 // 跳过值与 str 相同的 token
-Token *skip(Token *token, char *str);
-// 尝试跳过 str, rest保存跳过之后的 Token*, 返回值表示是否跳过成功
-bool consume(Token **rest, Token *token, char *str);
-// 终结符解析
-// token1 -> token2 -> token3
-Token *tokenize_file(char *path);
+Token skip(Token token, char *str);
+// 尝试跳过 str, rest保存跳过之后的 Token, 返回值表示是否跳过成功
+bool consume(Token *rest, Token token, char *str);
+// 逐个解析文件中预处理终结符的词法分析器
+typedef struct {
+  SourceFile *file; // 正在解析的文件
+  char *p;          // 下一个字符
+  int flags;        // 下一个终结符的标志
+} Lexer;
+
+// 在源码空间中登记源文件，line_starts 为 NULL 时由文件内容计算
+SourceFile *new_source_file(char *path, char *contents, uint32_t *line_starts,
+                            int line_len);
+// 读取源文件并在源码空间中登记，文件无法打开时返回 NULL
+SourceFile *read_source_file(char *path);
+// 在源码空间中登记内存中的源码，len 为源码的长度
+SourceFile *new_source_buffer(char *name, char *buf, size_t len);
+// 设置当前线程访问文件时相对路径所相对的目录，为 NULL 时使用当前目录
+void set_work_dir(char *dir);
+// 返回访问 path 时实际使用的路径
+char *resolve_path(char *path);
+// 在源码空间中登记预处理时合成的文本，其行号按 origin 计算
+SourceFile *new_source_text(char *text, SrcLoc origin);
+// 开始解析文件中的预处理终结符
+void init_lexer(Lexer *lex, SourceFile *file);
+// 解析文件中的下一个预处理终结符，文件结束后总是返回 TK_EOF
+// 终结符的位置相对于文件的起始位置
+void lex_token(Lexer *lex, PPToken *tok);
+// 终结符解析，返回文件的预处理终结符数组，以 TK_EOF 结尾
+// 终结符的位置相对于文件的起始位置
+PPToken *tokenize(SourceFile *file);
+// 将预处理终结符加入终结符流，并解析字面量的值
+Token push_token(PPToken *tok);
+// 声明 token 之前的终结符不会再被访问，将其移出终结符流
+void release_tokens(Token token);
+// 之后还会回头访问已读取的终结符，release_tokens 不再移出终结符
+void keep_tokens(void);
+// 清空源码空间及终结符流，以便同一线程编译下一个文件
+void tokenize_reset(void);
+
+// 交由其他线程的一块终结符
+typedef struct TokenBlock TokenBlock;
+
+// 预处理至多 n 个终结符，加入 TK_EOF 时提前结束并返回 true
+bool preprocess_block(int n);
+// 将终结符流中尚未交出的终结符打包成块，并移出终结符流，块由 free 释放
+// msg 不为 NULL 时为预处理的错误信息，读完块中的终结符后才报告
+TokenBlock *take_tokens(char *msg);
+// 终结符改由 fetch 取得的其他线程的块提供，为 NULL 时由当前线程预处理
+void set_token_source(TokenBlock *(*fetch)(void));
+
+typedef struct TokenStream TokenStream;
+
+// 源文件表、终结符流及相对路径所相对的目录，供工作线程只读地共享
+typedef struct {
+  SourceFile **files;  // 所有源文件
+  int len;             // 源文件的数量
+  TokenStream *tokens; // 终结符流
+  char *work_dir;      // 相对路径所相对的目录
+} SourceState;
+
+// 返回当前线程的源文件表、终结符流及相对路径所相对的目录
+SourceState get_source_state(void);
+// 返回 token 加入终结符流时的源文件表，不含终结符流
+SourceState source_state_at(Token token);
+// 当前线程改为使用 state 中的源文件表、终结符流及目录，
+// 只用于查询源码位置及读取已预处理的终结符
+void use_source_state(SourceState state);
+
+//
+// 预处理
+//
+
+// 添加 #include 的搜索路径(-I)
+void add_include_path(char *dir);
+// 清空所有 #include 的搜索路径
+void clear_include_paths(void);
+// 返回所有 #include 的搜索路径，*len 为路径的数量
+char **get_include_paths(int *len);
+// 开始预处理 path 对应的文件
+// token1, token2, token3 ... 依次存放在终结符流中，返回第一个 token；
+// 终结符在被访问时才由 preprocess_next 按需预处理
+Token preprocess(char *path);
+// 开始预处理已登记的源文件，如内存中的源码
+Token preprocess_file(SourceFile *file);
+// 预处理下一个终结符并加入终结符流，文件结束后总是加入 TK_EOF
+void preprocess_next(void);
+// 清空宏定义及头文件缓存
+void preprocess_reset(void);
+
+//
+// 终结符缓存
+//
+
+// 从缓存中加载 path 的预处理终结符，缓存无效时返回 NULL
+// *file 为登记的源文件，未读取源文件时为 NULL
+PPToken *load_token_cache(char *path, SourceFile **file);
+// 将文件的预处理终结符写入缓存
+void save_token_cache(SourceFile *file, PPToken *tokens);
+// 结束一次编译，映射的缓存文件留待之后的编译复用
+void token_cache_reset(void);
+// 解除映射的所有缓存文件
+void token_cache_release(void);
+
+// 终结符缓存的目录(--token-cache)，为 NULL 时不使用缓存
+extern _Thread_local char *OPT_TOKEN_CACHE;
+
+//
+// 编译缓存
+//
+
+// 编译缓存的键，为 SHA-256 哈希值
+typedef struct {
+  uint8_t hash[32];
+} CacheKey;
+
+// 计算中的 SHA-256
+typedef struct {
+  uint32_t state[8];
+  uint64_t len;      // 已输入的字节数
+  uint8_t block[64]; // 未满一块的输入
+} Sha256;
+
+void sha256_init(Sha256 *s);
+void sha256_update(Sha256 *s, const void *buf, size_t len);
+void sha256_final(Sha256 *s, uint8_t out[32]);
+
+// 命中的缓存项
+typedef struct {
+  void *map;       // 映射的缓存文件
+  size_t map_size; // 映射的大小
+  char *data;      // 缓存的输出
+  size_t len;      // 输出的长度
+} CacheHit;
+
+// 计算 path 的编译缓存的键，flags 为影响输出的编译选项
+// 文件无法读取时返回 false
+bool cache_key(char *path, char *flags, CacheKey *key);
+// 查找缓存，命中时 hit 指向映射中缓存的输出
+bool cache_load(CacheKey *key, CacheHit *hit);
+// 释放命中的缓存项
+void cache_release(CacheHit *hit);
+// 将本次编译的输出存入缓存，依赖为本次编译读取的所有源文件
+void cache_store(CacheKey *key, char *buf, size_t len);
+// 查找函数缓存，命中时 *buf 指向读入的缓存内容，随区域一起释放
+bool cache_load_function(CacheKey *key, char **buf, size_t *len);
+// 将一个函数生成的代码存入函数缓存
+void cache_store_function(CacheKey *key, char *buf, size_t len);
+
+// 编译缓存的目录(--cache-dir)，为 NULL 时不使用缓存
+extern _Thread_local char *OPT_CACHE_DIR;
+// 编译缓存的大小上限，单位为字节(--cache-size)
+extern _Thread_local size_t OPT_CACHE_SIZE;
+// 编译缓存默认的大小上限
+#define DEFAULT_CACHE_SIZE ((size_t)1 << 30)
 
 //
 // 二、语法分析， 生成AST
@@ -97,6 +394,12 @@ typedef enum {
   ND_NUM,
 } NodeKind;
 
+// 语法树节点在节点池中的下标，0 表示空节点
+typedef uint32_t NodeId;
+
+// 节点池，存放一个函数的所有语法树节点
+typedef struct NodePool NodePool;
+
 // 本地变量
 typedef struct Object Object;
 
@@ -107,6 +410,7 @@ struct Object {
 
   bool is_local;    // 局部变量与否
   bool is_function; // ObjectMember 属性
+  bool is_static;   // 是否为 static，不导出符号
 
   union {
     // Var
@@ -114,10 +418,18 @@ struct Object {
 
     // Function
     struct {
-      Object *params; // 形参
-      Node *body;     // 函数体(AST)
-      Object *locals; // 本地变量
-      int stack_size; // 栈大小
+      Object *params;   // 形参
+      NodePool *pool;   // 函数体的节点池
+      NodeId body;      // 函数体(AST)
+      Object *locals;   // 本地变量
+      int stack_size;   // 栈大小
+      Object *literals; // 函数中的字符串字面量
+
+      // 函数缓存
+      SrcLoc def_loc;      // 函数定义的起始位置
+      CacheKey *cache_key; // 缓存的键，不使用函数缓存时为 NULL
+      char *cached;        // 命中缓存时为缓存的代码，函数体不再解析
+      size_t cached_len;   // 缓存的代码的长度
     };
 
     // String Literal
@@ -125,11 +437,14 @@ struct Object {
   };
 };
 
+// 紧凑的语法树节点
+//
+// 节点存放在所属函数的节点池中，节点之间通过 32 位的 NodeId 相互引用，
+// 个数不定的子节点(语句、实参等)连续存放在节点池的子节点侧表中
 struct Node {
-  Token *token;  // 节点对应终结符
-  NodeKind kind; // 节点的类型
-  Type *type;    // 节点中数据的类型
-  Node *next;
+  uint8_t kind; // 节点的类型(NodeKind)
+  SrcLoc loc;   // 节点在源码中的位置
+  Type *type;   // 节点中数据的类型
 
   union {
 
@@ -137,8 +452,8 @@ struct Node {
     //       ND_ASSIGN, ND_EQ,ND_NE,ND_LT,ND_LE
     // [unary] ND_RETURN, ND_DEREF, ND_ADDR, ND_EXPR_STMT
     struct {
-      Node *lhs;
-      Node *rhs;
+      NodeId lhs;
+      NodeId rhs;
     };
 
     // ND_VAR
@@ -147,33 +462,45 @@ struct Node {
     // ND_NUM;
     int val; // 存储 ND_NUM 的值
 
-    // ND_BLOCK
-    Node *body; // 代码块
-
-    // ND_FNCALL
+    // ND_BLOCK, ND_STMT_EXPR: 语句
+    // ND_FNCALL: 实参，函数名称为 loc 处的标识符
+    // ND_IF: KID_COND, KID_THEN, KID_ELS
+    // ND_FOR: KID_COND, KID_THEN, KID_INIT, KID_INC
     struct {
-      char *func_name; // 函数名称
-      Node *args;      // 函数参数
-    };
-
-    // ND_IF | ND_FOR
-    struct {
-      Node *cond; // 条件
-      Node *then; // 判断成立
-      union {
-        Node *els; // 判断失败
-
-        struct {      // ND_FOR
-          Node *init; // 循环初始化语句
-          Node *inc;  // 循环变量变化语句
-        };
-      };
+      uint32_t kids;  // 第一个子节点在侧表中的下标
+      uint32_t nkids; // 子节点的数量
     };
   };
 };
 
+// ND_IF, ND_FOR 的子节点在侧表中的次序
+enum { KID_COND, KID_THEN, KID_ELS, KID_INIT = 2, KID_INC };
+
+// 创建一个空的节点池
+NodePool *new_node_pool(void);
+// 返回节点池中的节点，节点的地址在节点池存续期间不会改变
+Node *node_at(NodePool *pool, NodeId id);
+// 返回节点的第 i 个子节点
+NodeId node_kid(NodePool *pool, Node *node, int i);
+
+// 函数定义解析完毕时的回调，end 为函数定义之后的终结符
+typedef void (*FunctionHandler)(Object *func, Token end);
+
 // 语法解析入口函数
-Object *parse(Token *token);
+// on_function 不为 NULL 时，每个函数定义解析完毕即调用
+Object *parse(Token token, FunctionHandler on_function);
+// 清空作用域及变量列表，以便同一线程编译下一个文件
+void parse_reset(void);
+// 并行解析函数体的线程数(-j)，不超过 1 时逐个解析
+extern _Thread_local int OPT_PARSE_THREADS;
+// 是否只解析及生成从入口函数可达的函数(--lazy)
+extern _Thread_local bool OPT_LAZY;
+// 惰性解析时始终保留名为 name 的函数(--keep)
+void add_keep_function(char *name);
+// 清空所有 --keep 指定的函数
+void clear_keep_functions(void);
+// 返回所有 --keep 指定的函数，*len 为函数的数量
+char **get_keep_functions(int *len);
 
 //
 // 三、语义分析，生成代码
@@ -181,6 +508,98 @@ Object *parse(Token *token);
 
 // 代码生成入口函数
 void codegen(Object *prog, FILE *out);
+// 是否省略汇编中的注释及重复的 .loc(--terse)
+extern _Thread_local bool OPT_TERSE;
+// 生成单个函数的代码
+void codegen_function(Object *func, FILE *out);
+// 生成所有全局变量的数据段
+void codegen_data(Object *prog, FILE *out);
+// 查找函数 func 的缓存，命中时记录在 func->cached 中
+bool codegen_load_cached(Object *func);
+// 将 n 对齐到 align 的整数倍
+int align_to(int n, int align);
+// 重置标签编号及调试信息的状态
+void codegen_reset(void);
+// 是否直接生成目标文件(-c)
+extern _Thread_local bool OPT_C;
+// 是否将每个函数放入单独的代码节 .text.<函数名>(-ffunction-sections)
+extern _Thread_local bool OPT_FUNCTION_SECTIONS;
+// 是否将每个全局变量放入单独的节 .bss.<变量名>，
+// 每个函数的字符串字面量放入 .rodata.str.<函数名>(-fdata-sections)
+extern _Thread_local bool OPT_DATA_SECTIONS;
+// 并行生成各函数代码的线程数(-j)，不超过 1 时逐个生成
+extern _Thread_local int OPT_CODEGEN_THREADS;
+
+//
+// 目标文件
+//
+
+// 目标文件中的节
+typedef enum {
+  SEC_TEXT,   // 代码
+  SEC_DATA,   // 有初始值的数据
+  SEC_BSS,    // 初始值为0的数据
+  SEC_RODATA, // 只读数据
+  SEC_NUM,    // 节的数量
+} SectionKind;
+
+// RV64IM 指令的操作码及功能码，寄存器和立即数由 rv_* 填入
+#define RV_LB 0x00000003
+#define RV_LD 0x00003003
+#define RV_ADDI 0x00000013
+#define RV_SLTIU 0x00003013
+#define RV_XORI 0x00004013
+#define RV_AUIPC 0x00000017
+#define RV_ADDIW 0x0000001b
+#define RV_SB 0x00000023
+#define RV_SD 0x00003023
+#define RV_ADD 0x00000033
+#define RV_SUB 0x40000033
+#define RV_MUL 0x02000033
+#define RV_DIV 0x02004033
+#define RV_SLT 0x00002033
+#define RV_SLTU 0x00003033
+#define RV_XOR 0x00004033
+#define RV_LUI 0x00000037
+#define RV_BEQ 0x00000063
+#define RV_JALR 0x00000067
+#define RV_JAL 0x0000006f
+
+// 按 R、I、S、B、U、J 格式编码指令
+uint32_t rv_r(uint32_t op, int rd, int rs1, int rs2);
+uint32_t rv_i(uint32_t op, int rd, int rs1, int imm);
+uint32_t rv_s(uint32_t op, int rs2, int rs1, int imm);
+uint32_t rv_b(uint32_t op, int rs1, int rs2, int imm);
+uint32_t rv_u(uint32_t op, int rd, int imm);
+uint32_t rv_j(uint32_t op, int rd, int imm);
+
+// 切换当前写入的节
+void obj_section(SectionKind kind);
+// 切换到与 kind 属性相同、名为 name 的单独的节，不存在时创建
+void obj_named_section(SectionKind kind, char *name);
+// 向当前节写入一条指令
+void obj_inst(uint32_t inst);
+// 向当前节写入 len 个字节
+void obj_bytes(char *buf, int len);
+// 向当前节写入 len 个0
+void obj_zero(int len);
+// 在当前节的当前位置定义符号 name
+void obj_label(char *name);
+// 将符号 name 标记为全局符号
+void obj_global(char *name);
+// 将符号 name 标记为函数或数据对象
+void obj_type(char *name, bool is_func);
+// 符号 name 的大小为其到当前节当前位置的距离
+void obj_size(char *name);
+// 对当前位置随后写入的指令添加引用符号 name 的重定位(R_RISCV_*)
+void obj_reloc(int type, char *name);
+// 解析代码节中跳转到本文件内标签的分支，
+// 超出范围的条件分支改写为反向分支加跳转
+void obj_resolve(void);
+// 将目标文件写入 out
+void obj_write(FILE *out);
+// 释放所有节、符号及重定位
+void obj_reset(void);
 
 //
 // 四、类型系统
@@ -195,10 +614,11 @@ typedef enum {
   TY_ARRAY, // 数组
 } TypeKind;
 
+// 类型是规范化的：结构相同的类型只有一个实例，
+// 因此判断类型是否相同只需比较指针，且类型中不记录变量的名称
 struct Type {
   TypeKind kind; // 类型
   int size;      // 大小
-  Token *token;  // 变量的名称
 
   union {
     // TY_PTR, TY_ARRAY
@@ -210,8 +630,8 @@ struct Type {
     // TY_FUNC
     struct {
       Type *ret_type; // 返回值的类型
-      Type *params;   // 形参
-      Type *next;     // 下一个类型
+      Type **params;  // 形参的类型
+      int nparams;    // 形参的数量
     };
   };
 };
@@ -224,17 +644,72 @@ extern Type *TYPE_CHAR;
 // 判断是否为 Type int
 bool is_integer(Type *type);
 
-// 复制类型
-Type *copy_type(Type *type);
-
 // 创建一个指针类型，并指向 base
 Type *pointer_type(Type *base);
 
-// 创建一个函数类型， 且返回值为ret_type
-Type *func_type(Type *ret_type);
+// 创建一个函数类型， 且返回值为ret_type，形参为 params[0..nparams)
+Type *func_type(Type *ret_type, Type **params, int nparams);
 
 // 创建一个数组类型, 基类为 base， 长度为 len
 Type *array_type(Type *base, int len);
 
-// 遍历 AST 并为所有 NODE 增加类型
-void add_type(Node *node);
+// 为刚构造完成的节点增加类型，其子节点必须已有类型
+void add_type(NodePool *pool, NodeId id);
+
+// 遍历 AST，校验所有节点的类型
+void verify_types(NodePool *pool, NodeId id);
+// 结束一次编译，已创建的类型留待之后的编译复用
+void type_reset(void);
+// 清空已创建类型的缓存，需在释放或交出 ARENA_TYPE 之前调用
+void type_release(void);
+
+// 多个线程共用的规范类型表
+typedef struct SharedTypes SharedTypes;
+// 当前线程的规范类型表开始由多个线程共用，返回供其他线程使用的句柄
+SharedTypes *share_types(void);
+// 当前线程改为使用共用的规范类型表，为 NULL 时恢复使用本线程的表
+void use_shared_types(SharedTypes *shared);
+// 其他线程都已不再使用后，结束共用当前线程的规范类型表
+void unshare_types(SharedTypes *shared);
+
+// 是否在语法分析后校验语法树的类型(--verify-types)
+extern _Thread_local bool OPT_VERIFY_TYPES;
+
+//
+// 编译库
+//
+
+// 重置所有编译阶段的状态，以便当前线程开始下一次编译
+// 各区域的内存留待下一次编译复用
+void reset_compilation(void);
+
+//
+// 流水线编译
+//
+
+// 预处理、语法分析及代码生成分别在三个线程中同时进行，结果输出到 out
+// 当前线程已开始预处理，token 为第一个终结符
+void run_pipeline(Token token, FILE *out);
+
+//
+// 编译服务
+//
+
+// 编译服务回复的帧的种类
+typedef enum {
+  FRAME_FILE = 'f', // 开始一个输出文件，内容为文件名，空串表示标准输出
+  FRAME_DATA = 'd', // 当前输出文件的内容
+  FRAME_DIAG = 'e', // 错误信息
+  FRAME_EXIT = 'x', // 退出状态，为最后一帧
+} FrameKind;
+
+// 处理一个编译请求，结果以帧的形式写回 fd
+typedef void (*RequestHandler)(int fd, char *cwd, int argc, char **argv,
+                               char *input, size_t len);
+
+// 向客户端发送一帧
+void send_frame(int fd, FrameKind kind, void *buf, size_t len);
+// 在 path 上监听编译请求，由 nthreads 个线程调用 handler 处理，不会返回
+void run_server(char *path, int nthreads, RequestHandler handler);
+// 连接 path 上的编译服务，转发参数及标准输入，返回编译的退出状态
+int run_client(char *path, int argc, char **argv);
@@ -0,0 +1,257 @@
+#include "rvcc.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//
+// 编译服务
+//
+// rvcc --server <sock> 常驻后台，在 Unix 域套接字上接收编译请求，
+// 省去每次编译时启动进程的开销；多个工作线程同时处理各自的请求。
+// rvcc --client <sock> 将命令行参数、当前目录及标准输入转发给服务，
+// 再按服务返回的内容写出输出文件及错误信息。
+//
+// 请求：当前目录、参数个数、各个参数、标准输入，
+//       字符串均以 4 字节长度开头，标准输入以 8 字节长度开头
+// 回复：若干帧，每帧为 1 字节种类 + 8 字节长度 + 内容，以 FRAME_EXIT 结束
+//
+
+// 请求中参数的最大个数及字符串的最大长度
+#define MAX_ARGS 4096
+#define MAX_STRING (1 << 20)
+
+// 读取 len 字节，连接中断时返回 false
+static bool read_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// 写出 len 字节，连接中断时返回 false
+static bool write_full(int fd, void *buf, size_t len) {
+  char *p = buf;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// 写出以 4 字节长度开头的字符串
+static bool write_string(int fd, char *s) {
+  uint32_t len = strlen(s);
+  return write_full(fd, &len, sizeof(len)) && write_full(fd, s, len);
+}
+
+// 读取以 4 字节长度开头的字符串，结果以 '\0' 结尾
+static char *read_string(int fd) {
+  uint32_t len;
+  if (!read_full(fd, &len, sizeof(len)) || len > MAX_STRING)
+    return NULL;
+  char *s = malloc(len + 1);
+  if (!s || !read_full(fd, s, len)) {
+    free(s);
+    return NULL;
+  }
+  s[len] = '\0';
+  return s;
+}
+
+// 向客户端发送一帧，客户端已断开时忽略
+void send_frame(int fd, FrameKind kind, void *buf, size_t len) {
+  char k = kind;
+  uint64_t n = len;
+  if (!write_full(fd, &k, 1) || !write_full(fd, &n, sizeof(n)))
+    return;
+  write_full(fd, buf, len);
+}
+
+// 一个请求
+typedef struct {
+  char *cwd;   // 客户端的当前目录
+  int argc;    // 参数个数，argv[0] 为 "rvcc"
+  char **argv; // 参数
+  char *input; // 标准输入的内容
+  size_t len;  // 标准输入的长度
+} Request;
+
+static void free_request(Request *req) {
+  free(req->cwd);
+  for (int i = 0; i < req->argc; i++)
+    free(req->argv[i]);
+  free(req->argv);
+  free(req->input);
+}
+
+// 读取一个请求，请求不完整或不合法时返回 false
+static bool read_request(int fd, Request *req) {
+  *req = (Request){};
+  uint32_t argc;
+  if (!(req->cwd = read_string(fd)) ||
+      !read_full(fd, &argc, sizeof(argc)) || argc == 0 || argc > MAX_ARGS)
+    return false;
+
+  req->argv = calloc(argc + 1, sizeof(char *));
+  if (!req->argv)
+    return false;
+  for (; req->argc < argc; req->argc++)
+    if (!(req->argv[req->argc] = read_string(fd)))
+      return false;
+
+  uint64_t len;
+  if (!read_full(fd, &len, sizeof(len)) || len > SIZE_MAX - 1)
+    return false;
+  req->input = malloc(len + 1);
+  req->len = len;
+  return req->input && read_full(fd, req->input, len);
+}
+
+// 监听的套接字及处理请求的回调
+static int LISTEN_FD;
+static RequestHandler HANDLER;
+
+// 工作线程依次接受连接，每个连接处理一个请求
+static void *server_worker(void *arg) {
+  for (;;) {
+    int fd = accept(LISTEN_FD, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      error("accept failed: %s", strerror(errno));
+    }
+
+    Request req;
+    if (read_request(fd, &req))
+      HANDLER(fd, req.cwd, req.argc, req.argv, req.input, req.len);
+    free_request(&req);
+    close(fd);
+  }
+  return NULL;
+}
+
+// 在 path 上监听编译请求，由 nthreads 个线程调用 handler 处理，不会返回
+void run_server(char *path, int nthreads, RequestHandler handler) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+
+  // 客户端中途断开时，写入不应终止服务
+  signal(SIGPIPE, SIG_IGN);
+
+  LISTEN_FD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (LISTEN_FD < 0)
+    error("socket failed: %s", strerror(errno));
+  unlink(path);
+  if (bind(LISTEN_FD, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(LISTEN_FD, SOMAXCONN) != 0)
+    error("can't listen on %s: %s", path, strerror(errno));
+
+  HANDLER = handler;
+  for (int i = 1; i < nthreads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, server_worker, NULL))
+      error("pthread_create failed");
+    pthread_detach(thread);
+  }
+  server_worker(NULL);
+}
+
+// 连接 path 上的编译服务，转发参数及标准输入，返回编译的退出状态
+int run_client(char *path, int argc, char **argv) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("socket path too long: %s", path);
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    error("can't connect to %s: %s", path, strerror(errno));
+
+  // 只有输入为 "-" 时才转发标准输入
+  char *input = NULL;
+  size_t len = 0;
+  FILE *in = open_memstream(&input, &len);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-"))
+      continue;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0)
+      fwrite(buf, 1, n, in);
+    break;
+  }
+  fclose(in);
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+    error("getcwd failed: %s", strerror(errno));
+  uint32_t n = argc;
+  uint64_t n_input = len;
+  bool ok = write_string(fd, cwd) && write_full(fd, &n, sizeof(n));
+  for (int i = 0; ok && i < argc; i++)
+    ok = write_string(fd, argv[i]);
+  ok = ok && write_full(fd, &n_input, sizeof(n_input)) &&
+       write_full(fd, input, len);
+  free(input);
+  free(cwd);
+  if (!ok)
+    error("can't send request to %s", path);
+
+  // 按帧写出输出文件及错误信息，直到收到退出状态
+  FILE *out = NULL;
+  for (;;) {
+    char kind;
+    uint64_t size;
+    if (!read_full(fd, &kind, 1) || !read_full(fd, &size, sizeof(size)))
+      error("connection to %s closed", path);
+
+    char *buf = malloc(size + 1);
+    if (!buf || !read_full(fd, buf, size))
+      error("connection to %s closed", path);
+    buf[size] = '\0';
+
+    switch (kind) {
+    case FRAME_FILE:
+      if (out && out != stdout)
+        fclose(out);
+      out = size ? fopen(buf, "w") : stdout;
+      if (!out)
+        error("can't open output file: %s, error: %s", buf, strerror(errno));
+      break;
+    case FRAME_DATA:
+      if (!out || fwrite(buf, 1, size, out) != size)
+        error("write failed");
+      break;
+    case FRAME_DIAG:
+      fwrite(buf, 1, size, stderr);
+      break;
+    case FRAME_EXIT: {
+      int status = size ? buf[0] : 1;
+      free(buf);
+      if (out && out != stdout && fclose(out) != 0)
+        error("write failed: %s", strerror(errno));
+      close(fd);
+      return status;
+    }
+    default:
+      error("invalid reply from %s", path);
+    }
+    free(buf);
+  }
+}
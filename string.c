@@ -1,18 +1,19 @@
 #include "rvcc.h"
 
 // 格式化字符串
+// 结果保存在字符串区域中
 char *format(char *fmt, ...) {
-  char *buf;
-  size_t len;
-
-  // 申请堆上内存并将起始地址保存到 buf 中
-  FILE *out = open_memstream(&buf, &len);
-
   va_list va;
+
+  // 先计算格式化后的长度
   va_start(va, fmt);
-  vfprintf(out, fmt, va);
+  int len = vsnprintf(NULL, 0, fmt, va);
   va_end(va);
 
-  fclose(out);
+  // 再将结果写入到字符串区域中
+  char *buf = arena_alloc(ARENA_STRING, len + 1);
+  va_start(va, fmt);
+  vsnprintf(buf, len + 1, fmt, va);
+  va_end(va);
   return buf;
-}
\ No newline at end of file
+}
@@ -36,4 +36,210 @@ check -o
 # 将--help传入check函数
 check --help
 
+# --arena-stats
+./rvcc --arena-stats -o $tmp/out $tmp/empty.c 2>&1 | grep -q arena
+check --arena-stats
+
+# --verify-types
+echo 'int main() { int x[2]; int *p=x+1; return ({ p-x; }) + *p; }' > $tmp/verify.c
+./rvcc --verify-types -o $tmp/out $tmp/verify.c
+check --verify-types
+
+# --stream
+# 函数按源码顺序逐个生成，全局变量在最后生成
+echo 'int g; int f() { return 1; } int main() { return f(); }' > $tmp/stream.c
+./rvcc --stream -o $tmp/out $tmp/stream.c
+[ "$(grep -E '^(f|main|g):' $tmp/out | tr '\n' ' ')" = 'f: main: g: ' ]
+check --stream
+
+# --pipeline
+# 预处理、解析及生成代码同时进行，结果及错误信息与 --stream 相同
+./rvcc --pipeline -o $tmp/pipe.s $tmp/stream.c &&
+  ./rvcc --stream -o $tmp/stream.s $tmp/stream.c &&
+  cmp -s $tmp/pipe.s $tmp/stream.s &&
+  printf 'int f() { return 1; }\n#error boom\n' > $tmp/perr.c &&
+  ! ./rvcc --pipeline -o /dev/null $tmp/perr.c 2> $tmp/pipe.err &&
+  grep -q 'boom' $tmp/pipe.err
+check --pipeline
+
+# --terse
+# 省略注释，生成的指令不变
+./rvcc -o $tmp/out $tmp/stream.c
+./rvcc --terse -o $tmp/terse $tmp/stream.c
+! grep -q '#' $tmp/terse
+[ "$(grep -cv '#' $tmp/out)" -ge "$(wc -l < $tmp/terse)" ]
+check --terse
+
+# -c
+# 直接生成 ELF 目标文件，-S 时仍生成汇编
+./rvcc -c -o $tmp/out.o $tmp/stream.c
+[ "$(head -c 4 $tmp/out.o | tail -c 3)" = ELF ]
+./rvcc -c -S -o $tmp/out $tmp/stream.c
+grep -qx 'main:' $tmp/out
+check -c
+
+# -ffunction-sections, -fdata-sections
+# 每个函数及全局变量各自位于独立的节中，供链接器回收未引用的节
+./rvcc -ffunction-sections -fdata-sections -o $tmp/sec.s $tmp/stream.c &&
+  grep -q '\.section \.text\.main,"ax",@progbits' $tmp/sec.s &&
+  grep -q '\.section \.bss\.g,"aw",@nobits' $tmp/sec.s &&
+  grep -q '\.size main, \.-main' $tmp/sec.s &&
+  ./rvcc -ffunction-sections -fdata-sections -c -o $tmp/sec.o $tmp/stream.c &&
+  grep -qa '\.text\.f' $tmp/sec.o
+check -ffunction-sections
+
+# -j
+# 多个文件同时编译，各自输出到当前目录，结果与逐个编译相同
+echo 'int f() { return 1; }' > $tmp/multi.c
+mkdir -p $tmp/j
+(rvcc=$PWD/rvcc && cd $tmp/j &&
+  $rvcc -o ../stream.s ../stream.c && $rvcc -o ../multi.s ../multi.c &&
+  $rvcc -j2 ../stream.c ../multi.c) &&
+  cmp -s $tmp/j/stream.s $tmp/stream.s && cmp -s $tmp/j/multi.s $tmp/multi.s
+check -j
+
+# 单个文件时 -j 并行生成各函数的代码，结果与逐个生成相同
+./rvcc -j3 -o $tmp/pj.s $tmp/stream.c && ./rvcc -o $tmp/sj.s $tmp/stream.c &&
+  cmp -s $tmp/pj.s $tmp/sj.s
+check 'parallel codegen'
+
+# 并行生成时出错，报告的错误与逐个生成时相同
+awk 'BEGIN { for (i = 0; i < 200; i++) printf "int f%d(int x) { return x + %d; }\n", i, i; print "int g() { 3 = 4; return 0; }"; print "int main() { 1 = 2; return 0; }" }' > $tmp/cgerr.c
+! ./rvcc -o /dev/null $tmp/cgerr.c 2> $tmp/cgerr1 &&
+  ! ./rvcc -j4 -o /dev/null $tmp/cgerr.c 2> $tmp/cgerr2 &&
+  grep -q 'not an lvalue' $tmp/cgerr1 && cmp -s $tmp/cgerr1 $tmp/cgerr2
+check 'parallel codegen error'
+
+# 并行解析的函数体只能看到之前声明的全局变量，只报告源码中最靠前的错误
+printf 'int f() { return g; }\nint g;\nint h() { return 1 + ; }\n' > $tmp/perr.c
+./rvcc -j3 -o /dev/null $tmp/perr.c 2>&1 | grep -q 'undefined variable'
+check 'parallel parse'
+
+# --lazy, --keep
+# 只解析及生成从 main、非 static 函数及 --keep 指定的函数可达的函数，
+# 不可达的函数体中的错误不再报告，static 函数不导出符号
+printf 'static int dead() { return 1 + ; }\nstatic int leaf() { return 2; }\nstatic int used() { return leaf(); }\nstatic int kept() { return 3; }\nint main() { return used(); }\n' > $tmp/lazy.c
+./rvcc --lazy --keep kept -o $tmp/lazy.s $tmp/lazy.c &&
+  [ "$(grep -E '^[a-z]+:' $tmp/lazy.s | tr '\n' ' ')" = 'main: kept: used: leaf: ' ] &&
+  ! grep -q 'globl used' $tmp/lazy.s
+check --lazy
+
+# --server, --client
+# 经编译服务编译的结果与直接编译相同，错误信息及退出状态转发给客户端
+./rvcc --server $tmp/sock -j2 &
+server=$!
+for i in $(seq 50); do [ -S $tmp/sock ] && break; sleep 0.1; done
+./rvcc --client $tmp/sock -o $tmp/client.s $tmp/stream.c &&
+  ./rvcc -o $tmp/local.s $tmp/stream.c &&
+  cmp -s $tmp/client.s $tmp/local.s &&
+  echo 'int main() { return x; }' | ./rvcc --client $tmp/sock -o /dev/null - 2>&1 |
+  grep -q 'undefined variable'
+check '--server --client'
+
+# 请求中并行生成出错时只报告错误，编译服务继续处理之后的请求
+! ./rvcc --client $tmp/sock -j4 -o /dev/null $tmp/cgerr.c 2> $tmp/cgerr3 &&
+  cmp -s $tmp/cgerr1 $tmp/cgerr3 &&
+  ./rvcc --client $tmp/sock -j4 -o $tmp/client.s $tmp/stream.c &&
+  cmp -s $tmp/client.s $tmp/local.s
+check '--server parallel codegen error'
+
+# 编译服务在请求之间保留规范类型及映射的终结符缓存，头文件变化后缓存失效
+printf '#include "sc.h"\nint *f(int **p) { return *p; }\nint main() { return N; }\n' > $tmp/sc.c
+echo '#define N 1' > $tmp/sc.h
+./rvcc --client $tmp/sock --token-cache $tmp/stc -o $tmp/sc1.s $tmp/sc.c &&
+  ./rvcc --client $tmp/sock --token-cache $tmp/stc -o $tmp/sc2.s $tmp/sc.c &&
+  cmp -s $tmp/sc1.s $tmp/sc2.s &&
+  echo '#define N 12345' > $tmp/sc.h &&
+  ./rvcc --client $tmp/sock --token-cache $tmp/stc -o $tmp/sc3.s $tmp/sc.c &&
+  grep -q 12345 $tmp/sc3.s
+check 'server warm caches'
+kill $server
+
+# -E
+echo '#define M 3' > $tmp/def.h
+printf '#include "def.h"\nM M\n' > $tmp/pp.c
+./rvcc -E $tmp/pp.c | grep -qx '3 3'
+check -E
+
+# -I
+printf '#include <def.h>\nM\n' > $tmp/pp.c
+./rvcc -E -I$tmp/ $tmp/pp.c | grep -qx '3'
+check -I
+
+# include guard, #pragma once
+printf '#ifndef G_H\n#define G_H\nguarded\n#endif\n' > $tmp/g.h
+printf '#pragma once\nonce\n' > $tmp/o.h
+printf '#include "g.h"\n#include "o.h"\n#include "g.h"\n#include "o.h"\n' > $tmp/pp.c
+[ "$(./rvcc -E $tmp/pp.c | tr '\n' ' ')" = 'guarded once ' ]
+check 'include once'
+
+# --token-cache
+# 第二次编译使用缓存，头文件内容变化后缓存失效
+./rvcc -E --token-cache $tmp/cache $tmp/pp.c > $tmp/pp1.i &&
+  ls $tmp/cache/*.tok > /dev/null &&
+  ./rvcc -E --token-cache $tmp/cache $tmp/pp.c > $tmp/pp2.i &&
+  cmp -s $tmp/pp1.i $tmp/pp2.i
+check --token-cache
+printf '#pragma once\nonce again\n' > $tmp/o.h
+[ "$(./rvcc -E --token-cache $tmp/cache $tmp/pp.c | tr '\n' ' ')" = 'guarded once again ' ]
+check 'token cache invalidation'
+
+# --cache-dir
+# 第二次编译直接使用缓存的输出，头文件内容变化后缓存失效
+printf '#include "h.h"\nint main() { return N; }\n' > $tmp/oc.c
+echo '#define N 1' > $tmp/h.h
+./rvcc --cache-dir $tmp/cc -o $tmp/oc1.s $tmp/oc.c &&
+  ls $tmp/cc/*.out > /dev/null &&
+  ./rvcc --cache-dir $tmp/cc -o $tmp/oc2.s $tmp/oc.c &&
+  cmp -s $tmp/oc1.s $tmp/oc2.s
+check --cache-dir
+echo '#define N 12345' > $tmp/h.h
+./rvcc --cache-dir $tmp/cc -o $tmp/oc3.s $tmp/oc.c &&
+  grep -q 12345 $tmp/oc3.s
+check 'cache invalidation'
+
+# 函数缓存
+# 修改一个函数后只重新生成该函数，其余函数即使行号变化也使用缓存，
+# 结果与不使用缓存时相同
+printf 'int f() {\n  return 1;\n}\nint main() {\n  return f();\n}\n' > $tmp/fn.c
+./rvcc --cache-dir $tmp/fc -o $tmp/fn1.s $tmp/fn.c &&
+  printf 'int f() {\n  int x;\n  x = 2;\n  return x;\n}\nint main() {\n  return f();\n}\n' > $tmp/fn.c &&
+  ./rvcc --cache-dir $tmp/fc -o $tmp/fn2.s $tmp/fn.c &&
+  ./rvcc -o $tmp/fn3.s $tmp/fn.c &&
+  cmp -s $tmp/fn2.s $tmp/fn3.s &&
+  [ "$(ls $tmp/fc/*.fn | wc -l)" = 3 ]
+check 'function cache'
+
+# 流水线编译时函数缓存的键同样包含影响生成代码的选项，
+# 之后以其他选项使用同一缓存目录的结果与不使用缓存时相同
+printf 'int f(int x) {\n  if (x) return 1;\n  return 2;\n}\nint main() {\n  return f(0);\n}\n' > $tmp/pc.c
+./rvcc --pipeline --terse --cache-dir $tmp/pc -o /dev/null $tmp/pc.c &&
+  ./rvcc --pipeline -ffunction-sections --cache-dir $tmp/pc -o /dev/null $tmp/pc.c &&
+  ./rvcc --stream --cache-dir $tmp/pc -o $tmp/pc1.s $tmp/pc.c &&
+  ./rvcc --stream -o $tmp/pc2.s $tmp/pc.c &&
+  cmp -s $tmp/pc1.s $tmp/pc2.s &&
+  ./rvcc --pipeline -c --cache-dir $tmp/pc -o $tmp/pc1.o $tmp/pc.c &&
+  ./rvcc --pipeline -c -o $tmp/pc2.o $tmp/pc.c &&
+  cmp -s $tmp/pc1.o $tmp/pc2.o
+check 'pipeline function cache'
+
+# 变量作用域
+# 离开作用域删除的变量在哈希表中留下墓碑，之后重新声明同名变量时
+# 不应与墓碑之后的旧绑定重复，离开函数后变量不再可见
+awk 'BEGIN { printf "int main() { int ea; {"; for (i = 0; i < 12; i++) printf " int a%d;", i; print " } { int ea; } return 0; } int g() { return ea; }" }' > $tmp/scope.c
+./rvcc -o /dev/null $tmp/scope.c 2>&1 | grep -q 'undefined variable'
+check 'scope shadowing'
+
+# 深层语法树
+# 超长的表达式及 else if 链不应耗尽本机栈
+awk 'BEGIN { printf "int main() { return 0"; for (i = 0; i < 1000000; i++) printf "+1"; print "; }" }' > $tmp/deep.c
+./rvcc -o /dev/null $tmp/deep.c
+check 'long expression'
+awk 'BEGIN { printf "int main() { int x=0; if (x) return 0;"; for (i = 1; i < 100000; i++) printf " else if (x==%d) return %d;", i, i; print " return 0; }" }' > $tmp/deep.c
+./rvcc --verify-types -o /dev/null $tmp/deep.c
+check 'long else-if chain'
+awk 'BEGIN { print "int main() { int x=0;"; for (i = 0; i < 200000; i++) print "x=x+1;"; print "return x; }" }' > $tmp/deep.c
+./rvcc -o /dev/null $tmp/deep.c
+check 'long function body'
+
 echo OK
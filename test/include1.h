@@ -0,0 +1,10 @@
+#ifndef INCLUDE1_H
+#define INCLUDE1_H
+
+#include "include2.h"
+
+#define include1 5
+
+int include1_count() { return include2 + 1; }
+
+#endif
@@ -0,0 +1,5 @@
+#pragma once
+
+#define include2 7
+
+int include2_count() { return include2; }
@@ -0,0 +1,188 @@
+#include "test.h"
+#include "include1.h"
+// 使用 include guard 和 #pragma once 的头文件只会被包含一次
+#include "include1.h"
+#include "include2.h"
+
+/* */ #
+
+int ret3() { return 3; }
+int dbl(int x) { return x*x; }
+int M4(int x) { return x + 1; }
+
+int main() {
+  // [预处理] #include
+  ASSERT(5, include1);
+  ASSERT(7, include2);
+  ASSERT(8, include1_count());
+  ASSERT(7, include2_count());
+
+  // [预处理] 条件编译
+  int m = 0;
+
+#if 0
+#include "/no/such/file"
+  ASSERT(0, 1);
+#if nested
+#endif
+#endif
+
+#if 1
+  m = 5;
+#endif
+  ASSERT(5, m);
+
+#if 1
+# if 0
+#  if 1
+  foo bar
+#  endif
+# endif
+  m = 3;
+#endif
+  ASSERT(3, m);
+
+#if 1-1
+# if 1
+# endif
+# if 1
+# else
+# endif
+# if 0
+# else
+# endif
+  m = 2;
+#else
+# if 1
+  m = 3;
+# endif
+#endif
+  ASSERT(3, m);
+
+#if 1
+  m = 2;
+#else
+  m = 3;
+#endif
+  ASSERT(2, m);
+
+#if 0
+  m = 1;
+#elif 0
+  m = 2;
+#elif 3+5
+  m = 3;
+#elif 1*5
+  m = 4;
+#endif
+  ASSERT(3, m);
+
+#if 1 && (2 || 0) && !0 && ~0 == -1 && 1 << 3 == 8 && 17 % 5 == 2
+  m = 4;
+#else
+  m = 5;
+#endif
+  ASSERT(4, m);
+
+#if 1 ? 0 : 1
+  m = 6;
+#elif undefined_name
+  m = 7;
+#else
+  m = 8;
+#endif
+  ASSERT(8, m);
+
+  // [预处理] 对象式宏
+#define M1 3
+  ASSERT(3, M1);
+#define M2 M1 + M1
+  ASSERT(6, M2);
+#define M3 (M1)
+  ASSERT(9, M3 * M3);
+#undef M1
+  int M1 = 7;
+  ASSERT(7, M1);
+  ASSERT(14, M2);
+
+  int M5 = 3;
+#define M5 M5 * 2
+  ASSERT(6, M5);
+
+#ifdef M5
+  m = 9;
+#endif
+  ASSERT(9, m);
+
+#ifndef M5
+  m = 10;
+#endif
+  ASSERT(9, m);
+
+#if defined(M5) && !defined M6
+  m = 11;
+#endif
+  ASSERT(11, m);
+
+#define M6 1 + 2
+#if M6 == 3
+  m = 12;
+#endif
+  ASSERT(12, m);
+
+  // [预处理] 函数式宏
+#define add(x, y) ((x) + (y))
+  ASSERT(7, add(3, 4));
+  ASSERT(10, add(add(1, 2), add(3, 4)));
+#define sq(x) x*x
+  ASSERT(5, sq(1+2));
+#define M7() 1
+  ASSERT(1, M7());
+#define M8(x, y) x*y
+  ASSERT(24, M8(3+4, 4+5));
+  ASSERT(9, dbl(3));
+#define dbl(x) 2*x
+  ASSERT(6, dbl(3));
+  ASSERT(2, M4(1));
+#define M4(x) M4(x) * 5
+  ASSERT(10, M4(1));
+
+  int add = 4;
+  ASSERT(4, add);
+
+  ASSERT(7, add(
+    3,
+    4));
+
+  // [预处理] 字符串化
+#define str(x) #x
+  ASSERT(97, str(abc)[0]);
+  ASSERT(4, sizeof(str(abc)));
+  ASSERT(34, str("")[0]);
+  ASSERT(6, sizeof(str(a  +  b)));
+
+  // [预处理] 拼接
+#define paste(x, y) x##y
+  ASSERT(15, paste(1, 5));
+  int foobar = 3;
+  ASSERT(3, paste(foo, bar));
+#define cat3(a, b, c) a##b##c
+  ASSERT(123, cat3(1, 2, 3));
+  ASSERT(12, cat3(1, , 2));
+  ASSERT(3, paste(ret, 3)());
+
+  // [预处理] 空的实参和可变参数
+#define M9(x) 5 x
+  ASSERT(5, M9());
+#define M10(...) add(__VA_ARGS__)
+  ASSERT(3, M10(1, 2));
+#define M11(x, ...) x
+  ASSERT(1, M11(1));
+  ASSERT(1, M11(1, 2, 3));
+
+  // [预处理] 内置宏
+  ASSERT(184, __LINE__);
+
+  printf("OK\n");
+  return 0;
+}
@@ -0,0 +1,284 @@
+#include "rvcc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//
+// 终结符缓存
+//
+// 将头文件的内容、行起始位置及预处理终结符写入缓存目录中的文件，
+// 之后的编译以只读方式映射(mmap)缓存文件，无需再次读取和解析头文件。
+//
+// 文件的终结符记录的是相对于文件起始的位置，缓存中也没有有效的指针，
+// 因此缓存与文件在源码空间中的位置无关，映射后即可直接使用
+//
+
+// 缓存文件的格式版本，格式变化时递增
+#define TOKEN_CACHE_VERSION 1
+
+// 缓存文件头，之后依次为 路径、内容、行起始位置、终结符
+typedef struct {
+  char magic[8];       // "RVCCTOK"
+  uint32_t version;    // 格式版本
+  uint32_t token_size; // sizeof(PPToken)
+  int64_t mtime_sec;   // 源文件的修改时间(秒)
+  int64_t mtime_nsec;  // 源文件的修改时间(纳秒)
+  uint64_t file_size;  // 源文件的大小
+  uint64_t hash;       // 源文件内容的哈希值
+  uint32_t path_off;   // 源文件的路径，以'\0'结尾
+  uint32_t text_off;   // 源文件的内容，以'\0'结尾
+  uint32_t text_size;  // 内容的长度
+  uint32_t lines_off;  // 每一行的起始位置
+  uint32_t nlines;     // 行数
+  uint32_t tokens_off; // 预处理终结符，以 TK_EOF 结尾
+  uint32_t ntokens;    // 终结符的数量
+} TokenCacheHeader;
+
+static char TOKEN_CACHE_MAGIC[8] = "RVCCTOK";
+
+// 终结符缓存的目录(--token-cache)
+_Thread_local char *OPT_TOKEN_CACHE;
+
+// 映射的缓存文件
+//
+// 映射在线程退出前一直保留，同一线程之后的编译(如编译服务的请求)中
+// 缓存文件未变时直接复用，无需再次打开、映射及检查。
+// 缓存文件总是整体重命名替换，设备号、inode、修改时间及大小都未变，
+// 即内容未变
+typedef struct {
+  char *path;            // 缓存文件的路径
+  dev_t dev;             // 设备号
+  ino_t ino;             // inode
+  struct timespec mtime; // 修改时间
+  size_t size;           // 大小
+  void *addr;            // 映射的地址
+  bool stale;            // 缓存文件已被替换，本次编译结束后解除映射
+} Mapping;
+
+// 所有映射的缓存文件
+static _Thread_local Mapping **MAPPINGS;
+static _Thread_local int MAPPINGS_LEN;
+static _Thread_local int MAPPINGS_CAP;
+// 缓存文件的路径到其当前有效的映射
+static _Thread_local HashMap MAPPING_MAP;
+
+// 返回 path 对应的缓存文件的路径
+static char *cache_path(char *path) {
+  return format("%s/%016llx.tok", resolve_path(OPT_TOKEN_CACHE),
+                (unsigned long long)fnv_hash(path, strlen(path)));
+}
+
+// 判断映射是否仍对应状态为 st 的缓存文件
+static bool is_same_file(Mapping *m, struct stat *st) {
+  return m->dev == st->st_dev && m->ino == st->st_ino &&
+         m->mtime.tv_sec == st->st_mtim.tv_sec &&
+         m->mtime.tv_nsec == st->st_mtim.tv_nsec && m->size == st->st_size;
+}
+
+// 返回缓存文件 path 的映射，缓存文件不存在或无法映射时返回 NULL
+// 已映射的缓存文件未变时直接复用，已被替换时重新映射
+static Mapping *map_cache_file(char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return NULL;
+
+  Mapping *m = hashmap_get(&MAPPING_MAP, path);
+  if (m && is_same_file(m, &st))
+    return m;
+  // 本次编译可能仍在使用旧的映射
+  if (m) {
+    m->stale = true;
+    hashmap_delete(&MAPPING_MAP, m->path);
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(TokenCacheHeader)) {
+    close(fd);
+    return NULL;
+  }
+  void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return NULL;
+
+  m = calloc(1, sizeof(Mapping));
+  if (!m || !(m->path = strdup(path)))
+    error("out of memory");
+  m->dev = st.st_dev;
+  m->ino = st.st_ino;
+  m->mtime = st.st_mtim;
+  m->size = st.st_size;
+  m->addr = addr;
+
+  if (MAPPINGS_LEN == MAPPINGS_CAP) {
+    MAPPINGS_CAP = MAPPINGS_CAP ? MAPPINGS_CAP * 2 : 16;
+    MAPPINGS = realloc(MAPPINGS, sizeof(Mapping *) * MAPPINGS_CAP);
+    if (!MAPPINGS)
+      error("out of memory");
+  }
+  MAPPINGS[MAPPINGS_LEN++] = m;
+  hashmap_put(&MAPPING_MAP, m->path, m);
+  return m;
+}
+
+// 解除映射
+static void unmap(Mapping *m) {
+  munmap(m->addr, m->size);
+  free(m->path);
+  free(m);
+}
+
+// 检查缓存文件头，保证所有数据都位于缓存文件之内
+static bool is_valid_cache(TokenCacheHeader *h, size_t size, char *path) {
+  char *map = (char *)h;
+  if (memcmp(h->magic, TOKEN_CACHE_MAGIC, sizeof(h->magic)) ||
+      h->version != TOKEN_CACHE_VERSION || h->token_size != sizeof(PPToken))
+    return false;
+
+  if (h->path_off >= size || h->text_off + (size_t)h->text_size >= size ||
+      h->lines_off % sizeof(uint32_t) ||
+      h->lines_off + (size_t)h->nlines * sizeof(uint32_t) > size ||
+      h->tokens_off % sizeof(void *) || h->ntokens == 0 ||
+      h->tokens_off + (size_t)h->ntokens * sizeof(PPToken) > size)
+    return false;
+
+  // 路径相同，即不是哈希冲突
+  if (strncmp(map + h->path_off, path, size - h->path_off) != 0)
+    return false;
+
+  PPToken *tokens = (PPToken *)(map + h->tokens_off);
+  return map[h->text_off + h->text_size] == '\0' &&
+         tokens[h->ntokens - 1].kind == TK_EOF;
+}
+
+// 从缓存中加载 path 的预处理终结符，缓存无效时返回 NULL
+// *file 为登记的源文件，未读取源文件时为 NULL
+//
+// 修改时间和大小与缓存一致时直接使用映射的内容；
+// 否则读取源文件，内容的哈希值仍一致时继续使用缓存的终结符
+PPToken *load_token_cache(char *path, SourceFile **file) {
+  *file = NULL;
+  if (!OPT_TOKEN_CACHE || !strcmp(path, "-"))
+    return NULL;
+
+  struct stat st;
+  if (stat(resolve_path(path), &st) != 0)
+    return NULL;
+
+  // 映射至少在整个编译期间保持有效，源文件的内容和终结符都直接指向映射
+  Mapping *m = map_cache_file(cache_path(path));
+  if (!m)
+    return NULL;
+  char *map = m->addr;
+  TokenCacheHeader *h = (TokenCacheHeader *)map;
+  if (!is_valid_cache(h, m->size, path))
+    return NULL;
+
+  PPToken *tokens = (PPToken *)(map + h->tokens_off);
+  if (h->mtime_sec == st.st_mtim.tv_sec &&
+      h->mtime_nsec == st.st_mtim.tv_nsec && h->file_size == st.st_size) {
+    *file = new_source_file(path, map + h->text_off,
+                            (uint32_t *)(map + h->lines_off), h->nlines);
+    return tokens;
+  }
+
+  *file = read_source_file(path);
+  if (*file && (*file)->size == h->text_size &&
+      fnv_hash((*file)->contents, (*file)->size) == h->hash)
+    return tokens;
+  return NULL;
+}
+
+// 将文件的预处理终结符写入缓存
+//
+// 先写入临时文件再重命名，其他同时进行的编译不会读到不完整的缓存；
+// 缓存只用于加速，写入失败时直接忽略
+void save_token_cache(SourceFile *file, PPToken *tokens) {
+  if (!OPT_TOKEN_CACHE || !strcmp(file->name, "-"))
+    return;
+
+  struct stat st;
+  if (stat(resolve_path(file->name), &st) != 0)
+    return;
+
+  int ntokens = 1;
+  while (tokens[ntokens - 1].kind != TK_EOF)
+    ntokens++;
+
+  TokenCacheHeader h = {};
+  memcpy(h.magic, TOKEN_CACHE_MAGIC, sizeof(h.magic));
+  h.version = TOKEN_CACHE_VERSION;
+  h.token_size = sizeof(PPToken);
+  h.mtime_sec = st.st_mtim.tv_sec;
+  h.mtime_nsec = st.st_mtim.tv_nsec;
+  h.file_size = st.st_size;
+  h.hash = fnv_hash(file->contents, file->size);
+  h.text_size = file->size;
+  h.nlines = file->line_len;
+  h.ntokens = ntokens;
+
+  // 计算各部分在缓存文件中的位置
+  size_t size = sizeof(h);
+  h.path_off = size;
+  size += strlen(file->name) + 1;
+  h.text_off = size;
+  size += file->size + 1;
+  h.lines_off = size = align_to(size, sizeof(uint32_t));
+  size += file->line_len * sizeof(uint32_t);
+  h.tokens_off = size = align_to(size, sizeof(void *));
+  size += ntokens * sizeof(PPToken);
+  if (size > UINT32_MAX)
+    return;
+
+  char *buf = calloc(1, size);
+  if (!buf)
+    return;
+  memcpy(buf, &h, sizeof(h));
+  strcpy(buf + h.path_off, file->name);
+  memcpy(buf + h.text_off, file->contents, file->size);
+  memcpy(buf + h.lines_off, file->line_starts,
+         file->line_len * sizeof(uint32_t));
+  memcpy(buf + h.tokens_off, tokens, ntokens * sizeof(PPToken));
+
+  // 临时文件名由 mkstemp 生成，同时写入同一缓存的进程或线程互不干扰
+  mkdir(resolve_path(OPT_TOKEN_CACHE), 0777);
+  char *path = cache_path(file->name);
+  char *tmp = format("%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+  if (out) {
+    bool ok = fwrite(buf, 1, size, out) == size;
+    if (fclose(out) == 0 && ok && rename(tmp, path) == 0)
+      tmp = NULL;
+  } else if (fd >= 0) {
+    close(fd);
+  }
+  if (tmp && fd >= 0)
+    unlink(tmp);
+  free(buf);
+}
+
+// 结束一次编译，只解除已被替换的缓存文件的映射
+void token_cache_reset(void) {
+  int n = 0;
+  for (int i = 0; i < MAPPINGS_LEN; i++) {
+    if (MAPPINGS[i]->stale)
+      unmap(MAPPINGS[i]);
+    else
+      MAPPINGS[n++] = MAPPINGS[i];
+  }
+  MAPPINGS_LEN = n;
+}
+
+// 解除映射的所有缓存文件
+void token_cache_release(void) {
+  for (int i = 0; i < MAPPINGS_LEN; i++)
+    unmap(MAPPINGS[i]);
+  free(MAPPINGS);
+  MAPPINGS = NULL;
+  MAPPINGS_LEN = MAPPINGS_CAP = 0;
+  hashmap_free(&MAPPING_MAP);
+}
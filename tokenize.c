@@ -4,106 +4,442 @@
 // 一、词法分析
 //
 
-// 记录当前正在处理的文件名
-static char *CUR_FILENAME;
+// 记录当前正在解析的文件
+static _Thread_local SourceFile *CUR_FILE;
 
-// 记录当前的输入字符串
-static char *CUR_INPUT;
+// 源文件表
+//
+// 所有源文件及预处理时合成的文本依次排列在同一个源码空间中，
+// 按起始位置升序存放，由源码位置查找文件时使用二分查找
+static _Thread_local SourceFile **FILES;
+static _Thread_local int FILES_LEN;
+static _Thread_local int FILES_CAP;
+// 下一个文件在源码空间中的起始位置
+static _Thread_local SrcLoc NEXT_BASE;
+// 已编号的文件数量
+static _Thread_local int FILE_COUNT;
+// 最近一次查找到的文件，相邻的查找通常落在同一个文件中
+static _Thread_local SourceFile *LAST_FILE;
+
+// 源文件表的增长记录：序号不小于 token 的终结符加入终结符流时，
+// 源文件表中至少已有 nfiles 个文件
+typedef struct {
+  Token token;
+  int nfiles;
+} FileMark;
+
+static _Thread_local FileMark *FILE_MARKS;
+static _Thread_local int FILE_MARKS_LEN;
+static _Thread_local int FILE_MARKS_CAP;
+// 已随终结符块交出的记录数量
+static _Thread_local int FILE_MARKS_SENT;
+
+// 字面量（数字、字符串）的附加数据，存放在侧表中
+typedef struct {
+  Token token; // 所属的终结符
+  int val;     // TK_NUM 的值；TK_STR 的长度，包括 '\0'
+  char *str;   // TK_STR 的内容
+} TokenLiteral;
+
+// 终结符流
+//
+// 以数组结构体(struct of arrays)的形式存放预处理后的终结符，
+// 每个终结符仅占用 种类(1字节) + 标志(1字节) + 位置(4字节) + 长度(4字节)，
+// 字面量的值存放在按终结符升序排列的侧表中
+//
+// 终结符流是一个环形缓冲区：终结符在被访问时才按需预处理(preprocess_next)，
+// 语法分析不再访问的终结符(release_tokens)随即被移出缓冲区，
+// 因此只需容纳语法分析向前查看的窗口，与文件的大小无关。
+// 终结符 token 位于数组的 token & (cap - 1) 处
+struct TokenStream {
+  uint8_t *kinds; // 种类
+  uint8_t *flags; // 标志(PP_BOL, PP_SPACE)
+  uint32_t *locs; // 在源码空间中的位置
+  uint32_t *lens; // 长度
+  Token start;    // 缓冲区中的第一个终结符
+  Token len;      // 已预处理的终结符的数量
+  int cap;        // 数组的容量，为 2 的幂
+
+  TokenLiteral *lits; // 字面量侧表
+  int lit_start;      // 侧表中第一个仍在缓冲区中的字面量
+  int lit_len;        // 字面量的数量
+  int lit_cap;        // 侧表的容量
+
+  bool keep;     // 之后还会回头访问，不再移出终结符
+  bool borrowed; // 借用自其他线程，只能访问已预处理的终结符，不可释放
+};
+
+// 终结符流的初始容量
+#define TOKEN_RING_SIZE 256
+
+// 当前的终结符流
+static _Thread_local TokenStream TOKENS;
+
+// 出错时返回的恢复点，为 NULL 时出错即退出程序
+static _Thread_local jmp_buf *ERROR_JMP;
+// 错误信息的输出位置，为 NULL 时输出到 stderr
+static _Thread_local FILE *ERROR_OUT;
+
+// 设置当前线程出错时的恢复点及错误信息的输出位置
+void set_error_handler(jmp_buf *jmp, FILE *out) {
+  ERROR_JMP = jmp;
+  ERROR_OUT = out;
+}
+
+// 返回当前线程出错时的恢复点及错误信息的输出位置，供临时替换后恢复
+void get_error_handler(jmp_buf **jmp, FILE **out) {
+  *jmp = ERROR_JMP;
+  *out = ERROR_OUT;
+}
+
+static FILE *error_out(void) { return ERROR_OUT ? ERROR_OUT : stderr; }
+
+// 中止编译：有恢复点时返回恢复点，否则退出程序
+static _Noreturn void fail(void) {
+  if (ERROR_JMP)
+    longjmp(*ERROR_JMP, 1);
+  exit(1);
+}
 
 // 输出错误信息
-void error(char *fmt, ...) {
+_Noreturn void error(char *fmt, ...) {
   // 可变参数存储在 va_list 中
   va_list va;
   // 获取 fmt 之后的所有参数到 va 中
   va_start(va, fmt);
   // 输出 va_list 类型的参数
-  vfprintf(stderr, fmt, va);
-  fprintf(stderr, "\n");
+  vfprintf(error_out(), fmt, va);
+  fprintf(error_out(), "\n");
   va_end(va);
-  exit(1);
+  fail();
+}
+
+// 由合成的文本回溯到产生它的源文件位置
+static SourceFile *resolve_srcloc(SrcLoc *loc) {
+  SourceFile *file = srcloc_file(*loc);
+  while (!file->file_no) {
+    *loc = file->origin;
+    file = srcloc_file(*loc);
+  }
+  return file;
 }
 
 // 指示错误出现的位置
 // foo.c:10: x = y + 1;
 //               ^ <错误信息>
-static void verror_at(int line, char *loc, char *fmt, va_list va) {
+static void verror_srcloc(SrcLoc srcloc, char *fmt, va_list va) {
+  SourceFile *file = resolve_srcloc(&srcloc);
+  char *loc = file->contents + (srcloc - file->base);
   char *start = loc, *end = loc;
 
   // 移动 line 到 loc 所在行的起始位置
-  // CUR_INPUT是字符串的第一个字符
-  while (CUR_INPUT < start && start[-1] != '\n')
+  // contents是文件的第一个字符
+  while (file->contents < start && start[-1] != '\n')
     start--;
   // filename:line
   // indent记录输出了多少个字符
-  int indent = fprintf(stderr, "%s:%d: ", CUR_FILENAME, line);
+  FILE *out = error_out();
+  int indent = fprintf(out, "%s:%d: ", file->name, srcloc_line(srcloc));
   // 输出存在错误的行到end为止的文本
-  fprintf(stderr, "%.*s\n", (int)(end - start), start);
+  fprintf(out, "%.*s\n", (int)(end - start), start);
 
   // 计算错误信息要添加的位点
   int pos = loc - start + indent;
 
   // %*s 将会打印 pos 长度的字符串，若参数不满足长度 pos ，则使用空格补全
-  fprintf(stderr, "%*s", pos, "");
+  fprintf(out, "%*s", pos, "");
   // 指示符
-  fprintf(stderr, "^ ");
-  vfprintf(stderr, fmt, va);
-  fprintf(stderr, "\n");
+  fprintf(out, "^ ");
+  vfprintf(out, fmt, va);
+  fprintf(out, "\n");
   va_end(va);
 }
 
-// 指示错误信息并退出程序
-void error_at(char *loc, char *fmt, ...) {
-  int line = 1;
-  for (char *p = CUR_INPUT; p < loc; p++) {
-    if (*p == '\n')
-      line++;
-  }
+// 指示当前正在解析的文件中 loc 处出错，并退出程序
+_Noreturn void error_at(char *loc, char *fmt, ...) {
+  va_list va;
+  va_start(va, fmt);
+  verror_srcloc(CUR_FILE->base + (loc - CUR_FILE->contents), fmt, va);
+  fail();
+}
 
+// 指示源码位置 loc 处出错，并退出程序
+_Noreturn void error_srcloc(SrcLoc loc, char *fmt, ...) {
   va_list va;
   va_start(va, fmt);
-  verror_at(line, loc, fmt, va);
-  exit(1);
+  verror_srcloc(loc, fmt, va);
+  fail();
 }
 
 // 指示 token 解析出错，并退出程序
-void error_token(Token *token, char *fmt, ...) {
+_Noreturn void error_token(Token token, char *fmt, ...) {
   va_list va;
   va_start(va, fmt);
-  verror_at(token->line, token->loc, fmt, va);
-  exit(1);
+  verror_srcloc(tok_srcloc(token), fmt, va);
+  fail();
 }
 
-// Token 构造函数
-// [start, end)
-static Token *new_token(TokenKind kind, char *start, char *end) {
-  Token *token = calloc(1, sizeof(Token));
-  token->kind = kind;
-  token->loc = start;
-  token->len = end - start;
-  return token;
+// 标识符首字母判断
+// [a-zA-Z_]
+static bool is_ident_head(char c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || '_' == c;
+}
+
+// 标识符非首字母判断
+// [a-zA-Z0-9_]
+static bool is_ident_rest(char c) {
+  return is_ident_head(c) || ('0' <= c && c <= '9');
+}
+
+// 在区域中将数组扩容到 cap 个元素，旧数组随区域一起释放
+static void *grow_array(void *old, int len, int cap, int elem_size) {
+  void *arr = arena_alloc(ARENA_TOKEN, (size_t)cap * elem_size);
+  if (old)
+    memcpy(arr, old, (size_t)len * elem_size);
+  return arr;
 }
 
+// 追加一条源文件表的增长记录
+static void add_file_mark(FileMark mark) {
+  if (FILE_MARKS_LEN == FILE_MARKS_CAP) {
+    int cap = FILE_MARKS_CAP ? FILE_MARKS_CAP * 2 : 64;
+    FILE_MARKS =
+        grow_array(FILE_MARKS, FILE_MARKS_LEN, cap, sizeof(FileMark));
+    FILE_MARKS_CAP = cap;
+  }
+  FILE_MARKS[FILE_MARKS_LEN++] = mark;
+}
+
+// 在源码空间中登记一个文件
+static SourceFile *add_file(char *name, char *contents, SrcLoc origin) {
+  SourceFile *file = arena_alloc(ARENA_TOKEN, sizeof(SourceFile));
+  file->name = name;
+  file->contents = contents;
+  file->size = strlen(contents);
+  file->base = NEXT_BASE;
+  file->origin = origin;
+
+  // 文件末尾的 '\0' 也占用一个位置，供 EOF 终结符使用
+  if ((uint64_t)NEXT_BASE + file->size + 1 > UINT32_MAX)
+    error("%s: too much source text", name);
+  NEXT_BASE += file->size + 1;
+
+  if (FILES_LEN == FILES_CAP) {
+    int cap = FILES_CAP ? FILES_CAP * 2 : 64;
+    FILES = grow_array(FILES, FILES_LEN, cap, sizeof(SourceFile *));
+    FILES_CAP = cap;
+  }
+  FILES[FILES_LEN++] = file;
+  add_file_mark((FileMark){TOKENS.len, FILES_LEN});
+  return file;
+}
+
+// 记录每一行起始位置的偏移，用于由偏移计算行号
+static void add_line_numbers(SourceFile *file) {
+  int cap = 1024;
+  file->line_starts = grow_array(NULL, 0, cap, sizeof(uint32_t));
+  file->line_starts[file->line_len++] = 0;
+
+  for (char *p = file->contents; *p; p++) {
+    if (*p != '\n')
+      continue;
+
+    if (file->line_len == cap) {
+      file->line_starts = grow_array(file->line_starts, file->line_len,
+                                     cap * 2, sizeof(uint32_t));
+      cap *= 2;
+    }
+    file->line_starts[file->line_len++] = p + 1 - file->contents;
+  }
+}
+
+// 预处理时合成的文本，如字符串化及拼接产生的终结符
+// 其行号及出错位置按 origin 计算
+SourceFile *new_source_text(char *text, SrcLoc origin) {
+  return add_file("<built-in>", text, origin);
+}
+
+// 返回源码位置 loc 所在的文件
+SourceFile *srcloc_file(SrcLoc loc) {
+  if (LAST_FILE && LAST_FILE->base <= loc &&
+      loc <= LAST_FILE->base + LAST_FILE->size)
+    return LAST_FILE;
+
+  // 二分查找最后一个起始位置不超过 loc 的文件
+  int lo = 0, hi = FILES_LEN;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (FILES[mid]->base <= loc)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == 0)
+    unreachable();
+  LAST_FILE = FILES[lo - 1];
+  return LAST_FILE;
+}
+
+// 返回源码位置 loc 所在源文件的编号
+int srcloc_file_no(SrcLoc loc) { return resolve_srcloc(&loc)->file_no; }
+
+// 返回编号为 file_no 的源文件的名称，不存在时返回 NULL
+char *source_file_name(int file_no) {
+  for (int i = 0; i < FILES_LEN; i++)
+    if (FILES[i]->file_no == file_no)
+      return FILES[i]->name;
+  return NULL;
+}
+
+// 为 token 在侧表中追加一个字面量
+static TokenLiteral *new_literal(Token token) {
+  // 先移除已不在缓冲区中的字面量，仍然放不下时再扩容
+  if (TOKENS.lit_len == TOKENS.lit_cap && TOKENS.lit_start > 0) {
+    TOKENS.lit_len -= TOKENS.lit_start;
+    memmove(TOKENS.lits, TOKENS.lits + TOKENS.lit_start,
+            TOKENS.lit_len * sizeof(TokenLiteral));
+    TOKENS.lit_start = 0;
+  }
+
+  if (TOKENS.lit_len == TOKENS.lit_cap) {
+    int cap = TOKENS.lit_cap ? TOKENS.lit_cap * 2 : 256;
+    TOKENS.lits =
+        grow_array(TOKENS.lits, TOKENS.lit_len, cap, sizeof(TokenLiteral));
+    TOKENS.lit_cap = cap;
+  }
+
+  TokenLiteral *lit = &TOKENS.lits[TOKENS.lit_len++];
+  lit->token = token;
+  return lit;
+}
+
+static void read_more_tokens(void);
+
+// 返回 token 在终结符流数组中的下标，尚未预处理的终结符按需读取
+// 按需读取时数组可能扩容，须先取得下标再访问数组
+static int tok_slot(Token token) {
+  while (token >= TOKENS.len) {
+    // 借用的终结符流中没有预处理的状态
+    if (TOKENS.borrowed)
+      unreachable();
+    read_more_tokens();
+  }
+  // 语法分析已声明不再访问该终结符
+  if (token < TOKENS.start)
+    unreachable();
+  return token & (TOKENS.cap - 1);
+}
+
+// 在侧表中二分查找 token 对应的字面量
+static TokenLiteral *find_literal(Token token) {
+  tok_slot(token);
+  int lo = TOKENS.lit_start, hi = TOKENS.lit_len;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (TOKENS.lits[mid].token < token)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo == TOKENS.lit_len || TOKENS.lits[lo].token != token)
+    unreachable();
+  return &TOKENS.lits[lo];
+}
+
+// 返回 token 的种类
+TokenKind tok_kind(Token token) {
+  int i = tok_slot(token);
+  return TOKENS.kinds[i];
+}
+
+// 返回 token 的标志(PP_BOL, PP_SPACE)
+int tok_flags(Token token) {
+  int i = tok_slot(token);
+  return TOKENS.flags[i];
+}
+
+// 返回 token 在输入字符串中的位置
+char *tok_loc(Token token) { return srcloc_ptr(tok_srcloc(token)); }
+
+// 返回 token 的长度
+int tok_len(Token token) {
+  int i = tok_slot(token);
+  return TOKENS.lens[i];
+}
+
+// 返回 token 在源码中的位置
+SrcLoc tok_srcloc(Token token) {
+  int i = tok_slot(token);
+  return TOKENS.locs[i];
+}
+
+// 返回 token 所在的行号
+int tok_line(Token token) { return srcloc_line(tok_srcloc(token)); }
+
+// 返回源码位置 loc 对应的字符
+char *srcloc_ptr(SrcLoc loc) {
+  SourceFile *file = srcloc_file(loc);
+  return file->contents + (loc - file->base);
+}
+
+// 返回源码位置 loc 处的标识符
+char *srcloc_ident(SrcLoc loc) {
+  char *start = srcloc_ptr(loc), *end = start;
+  while (is_ident_rest(*end))
+    end++;
+  return arena_strndup(start, end - start);
+}
+
+// 返回源码位置 loc 所在的行号
+int srcloc_line(SrcLoc loc) {
+  SourceFile *file = resolve_srcloc(&loc);
+  uint32_t offset = loc - file->base;
+
+  // 二分查找最后一个不超过 offset 的行起始位置
+  int lo = 0, hi = file->line_len;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (file->line_starts[mid] <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// 返回 TK_NUM token 的值
+int tok_val(Token token) { return find_literal(token)->val; }
+
+// 返回 TK_STR token 的内容，包括 '\0'
+char *tok_str(Token token) { return find_literal(token)->str; }
+
+// 返回 TK_STR token 内容的长度，包括 '\0'
+int tok_str_len(Token token) { return find_literal(token)->val; }
+
 // 判断 token 的值是否与给定的 char* 值相同
-bool equal(Token *token, char *str) {
+bool equal(Token token, char *str) {
   // 比较字符串LHS（左部），RHS（右部）的前N位，S2的长度应大于等于N.
   // 比较按照字典序，LHS<RHS回负值，LHS=RHS返回0，LHS>RHS返回正值
   // 同时确保，此处的Op位数=N
-  return memcmp(token->loc, str, token->len) == 0 && str[token->len] == '\0';
+  int len = tok_len(token);
+  return memcmp(tok_loc(token), str, len) == 0 && str[len] == '\0';
 }
 
 // 跳过值与 str 相同的 token
-Token *skip(Token *token, char *str) {
+Token skip(Token token, char *str) {
   if (!equal(token, str)) {
     error_token(token, "expect '%s'", str);
   }
-  return token->next;
+  return token + 1;
 }
 
-// 尝试跳过 str, rest保存跳过之后的 Token*, 返回值表示是否跳过成功
-bool consume(Token **rest, Token *token, char *str) {
+// 尝试跳过 str, rest保存跳过之后的 Token, 返回值表示是否跳过成功
+bool consume(Token *rest, Token token, char *str) {
   if (equal(token, str)) {
     // 移动到下一个
-    *rest = token->next;
+    *rest = token + 1;
     return true;
   }
 
@@ -111,46 +447,32 @@ bool consume(Token **rest, Token *token, char *str) {
   return false;
 }
 
-// 返回 TK_NUM Token 的值
-static int get_num(Token *token) {
-  if (token->kind != TK_NUM) {
-    error_token(token, "expect a number");
-  }
-  return token->val;
-}
-
 // 比较 str 是否以 sub_str 为开头
 static bool starts_with(char *str, char *sub_str) {
   return strncmp(str, sub_str, strlen(sub_str)) == 0;
 }
 
-// 标识符首字母判断
-// [a-zA-Z_]
-static bool is_ident_head(char c) {
-  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || '_' == c;
-}
-
-// 标识符非首字母判断
-// [a-zA-Z0-9_]
-static bool is_ident_rest(char c) {
-  return is_ident_head(c) || ('0' <= c && c <= '9');
-}
-
 // 返回运算符长度
 static int read_punct(char *p) {
+  // 判断长度是否为 3
+  if (starts_with(p, "..."))
+    return 3;
+
   // 判断长度是否为 2
-  if (starts_with(p, "==") || starts_with(p, "!=") || starts_with(p, "<=") ||
-      starts_with(p, ">=")) {
-    return 2;
+  static char *puncts[] = {"==", "!=", "<=", ">=", "&&",
+                            "||", "<<", ">>", "##"};
+  for (int i = 0; i < sizeof(puncts) / sizeof(*puncts); i++) {
+    if (starts_with(p, puncts[i]))
+      return 2;
   }
 
   return ispunct(*p) ? 1 : 0;
 }
 
 // 判断 ident token 是否在 keywords 中
-static bool is_keyword(Token *token) {
-  static char *keywords[] = {"return", "if",     "else", "for",
-                             "while",  "sizeof", "int",  "char"};
+static bool is_keyword(Token token) {
+  static char *keywords[] = {"return", "if",   "else", "for",   "while",
+                             "sizeof", "int",  "char", "static"};
 
   for (int i = 0; i < sizeof(keywords) / sizeof(*keywords); i++) {
     if (equal(token, keywords[i])) {
@@ -161,15 +483,6 @@ static bool is_keyword(Token *token) {
   return false;
 }
 
-// 将符合关键字的 token 类型修改为 TK_KEYWORD
-static void convert_keywords(Token *token) {
-  for (Token *t = token; t; t = t->next) {
-    if (is_keyword(t)) {
-      t->kind = TK_KEYWORD;
-    }
-  }
-}
-
 #define CHAR_OCTAL(x) '0' <= x &&x <= '7'
 
 // 返回一位十六进制转十进制W
@@ -257,14 +570,17 @@ static char *read_string_literal_end(char *p) {
   return p;
 }
 
-// 读取字符串字面量
+// 读取字符串字面量的内容，存入侧表
 //
 // 形如 "foo" 的 token 即是 string literal
-static Token *read_string_literal(char *start) {
-  char *end = read_string_literal_end(start + 1);
+static void read_string_literal(Token token) {
+  CUR_FILE = srcloc_file(tok_srcloc(token));
+  char *start = tok_loc(token);
+  // 右引号
+  char *end = start + tok_len(token) - 1;
 
   // 存储处理之后的字符串字面量, buf 大小为 总字符数 + 1
-  char *buf = calloc(1, end - start);
+  char *buf = arena_alloc(ARENA_STRING, end - start);
   int real_len = 0;
 
   // 遍历双引号包裹的部分
@@ -275,41 +591,251 @@ static Token *read_string_literal(char *start) {
       buf[real_len++] = *p++;
   }
 
-  Token *token = new_token(TK_STR, start, end + 1);
+  // 字符串字面量的长度包括末尾多出的一位 '\0' (区域分配的内存初始为0)
+  TokenLiteral *lit = new_literal(token);
+  lit->str = buf;
+  lit->val = real_len + 1;
+}
+
+// 扩大终结符流的容量，缓冲区中的终结符移动到新数组中对应的位置
+static void grow_tokens(void) {
+  int cap = TOKENS.cap ? TOKENS.cap * 2 : TOKEN_RING_SIZE;
+  uint8_t *kinds = calloc(cap, sizeof(uint8_t));
+  uint8_t *flags = calloc(cap, sizeof(uint8_t));
+  uint32_t *locs = calloc(cap, sizeof(uint32_t));
+  uint32_t *lens = calloc(cap, sizeof(uint32_t));
+  if (!kinds || !flags || !locs || !lens)
+    error("out of memory");
+
+  for (Token t = TOKENS.start; t < TOKENS.len; t++) {
+    int from = t & (TOKENS.cap - 1), to = t & (cap - 1);
+    kinds[to] = TOKENS.kinds[from];
+    flags[to] = TOKENS.flags[from];
+    locs[to] = TOKENS.locs[from];
+    lens[to] = TOKENS.lens[from];
+  }
+
+  free(TOKENS.kinds);
+  free(TOKENS.flags);
+  free(TOKENS.locs);
+  free(TOKENS.lens);
+  TOKENS.kinds = kinds;
+  TOKENS.flags = flags;
+  TOKENS.locs = locs;
+  TOKENS.lens = lens;
+  TOKENS.cap = cap;
+}
 
-  // 字符串字面量类型为 char[]，包括了双引号
-  // 末尾多出的一位是 '\0' (calloc时进行的初始化)
-  token->type = array_type(TYPE_CHAR, real_len + 1);
-  token->str = buf;
+// 将预处理终结符加入终结符流，并解析字面量的值
+// 缓冲区已满时扩容，语法分析仍可能访问的终结符不会被覆盖
+Token push_token(PPToken *tok) {
+  if (TOKENS.len - TOKENS.start == TOKENS.cap)
+    grow_tokens();
+
+  Token token = TOKENS.len++;
+  int i = token & (TOKENS.cap - 1);
+  TOKENS.kinds[i] = tok->kind;
+  TOKENS.flags[i] = tok->flags;
+  TOKENS.locs[i] = tok->loc;
+  TOKENS.lens[i] = tok->len;
+
+  switch (tok->kind) {
+  case TK_IDENT:
+    // 将符合关键字的 token 类型修改为 TK_KEYWORD
+    if (is_keyword(token))
+      TOKENS.kinds[i] = TK_KEYWORD;
+    break;
+  case TK_NUM:
+    new_literal(token)->val = strtoul(tok_loc(token), NULL, 10);
+    break;
+  case TK_STR:
+    read_string_literal(token);
+    break;
+  default:
+    break;
+  }
   return token;
 }
 
-static void add_line_numbers(Token *token) {
-  char *p = CUR_INPUT;
+// 声明 token 之前的终结符不会再被访问，将其移出终结符流
+void release_tokens(Token token) {
+  if (TOKENS.keep || token <= TOKENS.start)
+    return;
+  if (token > TOKENS.len)
+    unreachable();
+
+  TOKENS.start = token;
+  while (TOKENS.lit_start < TOKENS.lit_len &&
+         TOKENS.lits[TOKENS.lit_start].token < token)
+    TOKENS.lit_start++;
+}
 
-  // 计算行号
-  // start 之前遇到 n 个 '\n'，意味着有 n 行
-  // 而 start 位于第 n + 1 行
-  int n = 1;
+// 之后还会回头访问已读取的终结符，release_tokens 不再移出终结符
+// 终结符流将容纳整个文件的终结符
+void keep_tokens(void) { TOKENS.keep = true; }
 
-  do {
-    if (p == token->loc) {
-      token->line = n;
-      token = token->next;
-    }
-    if (*p == '\n')
-      n++;
+// 终结符块
+//
+// 流水线编译时，预处理线程将终结符按块交给语法分析线程。
+// 块中还含有字面量、源文件表及其增长记录，预处理出错时含有错误信息，
+// 语法分析读完块中的终结符、需要更多终结符时才报告该错误。
+// 块只分配一次，由 free 释放
+struct TokenBlock {
+  Token start;        // 第一个终结符的序号
+  int len;            // 终结符的数量
+  TokenLiteral *lits; // 字面量
+  int nlits;          // 字面量的数量
+  FileMark *marks;    // 源文件表的增长记录
+  int nmarks;         // 记录的数量
+  uint32_t *locs;     // 各终结符的位置
+  uint32_t *lens;     // 各终结符的长度
+  uint8_t *kinds;     // 各终结符的种类
+  uint8_t *flags;     // 各终结符的标志
+  SourceFile **files; // 源文件表
+  int nfiles;         // 源文件的数量
+  char *error;        // 预处理的错误信息
+};
+
+// 取得其他线程预处理的终结符块，为 NULL 时由当前线程预处理
+static _Thread_local TokenBlock *(*FETCH_TOKENS)(void);
+// 取得的块中附带的错误信息，块中的终结符读完后报告
+static _Thread_local char *FETCH_ERROR;
+// 取得的最后一个 TK_EOF，未取得时种类不为 TK_EOF
+static _Thread_local PPToken FETCH_EOF;
+
+// 预处理至多 n 个终结符，加入 TK_EOF 时提前结束并返回 true
+bool preprocess_block(int n) {
+  for (int i = 0; i < n; i++) {
+    preprocess_next();
+    if (TOKENS.kinds[(TOKENS.len - 1) & (TOKENS.cap - 1)] == TK_EOF)
+      return true;
+  }
+  return false;
+}
 
-  } while (*p++);
+// 将终结符流中尚未交出的终结符打包成块，并移出终结符流
+// msg 不为 NULL 时为预处理的错误信息，之后不再交出终结符
+TokenBlock *take_tokens(char *msg) {
+  int n = TOKENS.len - TOKENS.start;
+  int nlits = TOKENS.lit_len - TOKENS.lit_start;
+  int nmarks = FILE_MARKS_LEN - FILE_MARKS_SENT;
+
+  // 按对齐要求从大到小依次排列各数组
+  TokenBlock *block = malloc(sizeof(TokenBlock) +
+                             nlits * sizeof(TokenLiteral) +
+                             nmarks * sizeof(FileMark) +
+                             n * (2 * sizeof(uint32_t) + 2 * sizeof(uint8_t)));
+  if (!block)
+    error("out of memory");
+  *block = (TokenBlock){TOKENS.start, n};
+  block->lits = (TokenLiteral *)(block + 1);
+  block->marks = (FileMark *)(block->lits + nlits);
+  block->locs = (uint32_t *)(block->marks + nmarks);
+  block->lens = block->locs + n;
+  block->kinds = (uint8_t *)(block->lens + n);
+  block->flags = block->kinds + n;
+
+  for (int i = 0; i < n; i++) {
+    int from = (TOKENS.start + i) & (TOKENS.cap - 1);
+    block->kinds[i] = TOKENS.kinds[from];
+    block->flags[i] = TOKENS.flags[from];
+    block->locs[i] = TOKENS.locs[from];
+    block->lens[i] = TOKENS.lens[from];
+  }
+  memcpy(block->lits, TOKENS.lits + TOKENS.lit_start,
+         nlits * sizeof(TokenLiteral));
+  block->nlits = nlits;
+  memcpy(block->marks, FILE_MARKS + FILE_MARKS_SENT,
+         nmarks * sizeof(FileMark));
+  block->nmarks = nmarks;
+  FILE_MARKS_SENT = FILE_MARKS_LEN;
+
+  // 源文件表扩容时旧数组仍然有效，其中已有的文件不会再改变
+  block->files = FILES;
+  block->nfiles = FILES_LEN;
+  block->error = msg;
+
+  release_tokens(TOKENS.len);
+  return block;
 }
 
-// 终结符解析
-// head -> token1 -> token2 -> token3
-Token *tokenize(char *filename, char *p) {
-  CUR_FILENAME = filename;
-  CUR_INPUT = p;
-  Token head = {};
-  Token *cur = &head;
+// 将其他线程交出的终结符块追加到终结符流，并改用块中的源文件表
+static void put_tokens(TokenBlock *block) {
+  if (block->start != TOKENS.len)
+    unreachable();
+  while (TOKENS.len - TOKENS.start + block->len > TOKENS.cap)
+    grow_tokens();
+
+  for (int i = 0; i < block->len; i++) {
+    int to = (TOKENS.len + i) & (TOKENS.cap - 1);
+    TOKENS.kinds[to] = block->kinds[i];
+    TOKENS.flags[to] = block->flags[i];
+    TOKENS.locs[to] = block->locs[i];
+    TOKENS.lens[to] = block->lens[i];
+  }
+  TOKENS.len += block->len;
+  int last = block->len - 1;
+  if (last >= 0 && block->kinds[last] == TK_EOF)
+    FETCH_EOF = (PPToken){TK_EOF, block->flags[last], block->locs[last],
+                          block->lens[last]};
+  for (int i = 0; i < block->nlits; i++)
+    *new_literal(block->lits[i].token) = block->lits[i];
+  for (int i = 0; i < block->nmarks; i++)
+    add_file_mark(block->marks[i]);
+
+  FILES = block->files;
+  FILES_LEN = block->nfiles;
+  FETCH_ERROR = block->error;
+  free(block);
+}
+
+// 终结符由 fetch 取得的其他线程预处理的块提供，fetch 为 NULL 时由当前线程预处理
+void set_token_source(TokenBlock *(*fetch)(void)) { FETCH_TOKENS = fetch; }
+
+// 读取更多终结符
+static void read_more_tokens(void) {
+  if (!FETCH_TOKENS) {
+    preprocess_next();
+    return;
+  }
+
+  // 预处理出错之前的终结符都已读完，此时才报告错误
+  if (FETCH_ERROR)
+    error("%s", FETCH_ERROR);
+  // 与当前线程预处理时一样，文件结束后总是追加 TK_EOF
+  if (FETCH_EOF.kind == TK_EOF) {
+    push_token(&FETCH_EOF);
+    return;
+  }
+  put_tokens(FETCH_TOKENS());
+}
+
+// 预处理终结符构造函数，lex 继续从 end 处解析
+// [start, end)
+static void new_token(Lexer *lex, PPToken *tok, TokenKind kind, char *start,
+                      char *end) {
+  tok->kind = kind;
+  tok->flags = lex->flags;
+  tok->loc = start - lex->file->contents;
+  tok->len = end - start;
+  tok->hideset = NULL;
+
+  lex->p = end;
+  lex->flags = 0;
+}
+
+// 开始解析文件中的预处理终结符
+void init_lexer(Lexer *lex, SourceFile *file) {
+  lex->file = file;
+  lex->p = file->contents;
+  lex->flags = PP_BOL;
+}
+
+// 解析文件中的下一个预处理终结符，文件结束后总是返回 TK_EOF
+// 终结符的位置相对于文件的起始位置，与文件在源码空间中的位置无关
+void lex_token(Lexer *lex, PPToken *tok) {
+  CUR_FILE = lex->file;
+  char *p = lex->p;
 
   while (*p) {
     // 跳过行注释
@@ -317,6 +843,7 @@ Token *tokenize(char *filename, char *p) {
       p += 2;
       while (*p != '\n')
         p++;
+      lex->flags |= PP_SPACE;
       continue;
     }
 
@@ -327,33 +854,39 @@ Token *tokenize(char *filename, char *p) {
       if (!q)
         error_at(p, "unclosed block comment");
       p = q + 2;
+      lex->flags |= PP_SPACE;
+      continue;
+    }
+
+    // 换行，下一个终结符位于行首
+    if (*p == '\n') {
+      ++p;
+      lex->flags = PP_BOL;
       continue;
     }
 
-    // 跳过空白字符, \t \n
+    // 跳过空白字符, \t
     if (isspace(*p)) {
       ++p;
+      lex->flags |= PP_SPACE;
       continue;
     }
 
-    // 解析数字
+    // 解析数字，数值在加入终结符流时计算
     if (isdigit(*p)) {
-      // 创建一个 Token 用来保存数字, 此时 start 与 end 并无意义
-      cur->next = new_token(TK_NUM, p, p);
-      cur = cur->next;
-      const char *old_p = p;
-      // 执行之后，p指向的是第一个非数字字符
-      cur->val = strtoul(p, &p, 10);
-      cur->len = p - old_p;
-      continue;
+      char *start = p;
+      do {
+        ++p;
+      } while (isdigit(*p));
+      new_token(lex, tok, TK_NUM, start, p);
+      return;
     }
 
-    // 解析字符串字面量
+    // 解析字符串字面量，内容在加入终结符流时解析
     if (*p == '"') {
-      cur->next = read_string_literal(p);
-      cur = cur->next;
-      p += cur->len;
-      continue;
+      char *end = read_string_literal_end(p + 1);
+      new_token(lex, tok, TK_STR, p, end + 1);
+      return;
     }
 
     // 解析标记符
@@ -363,36 +896,96 @@ Token *tokenize(char *filename, char *p) {
       do {
         ++p;
       } while (is_ident_rest(*p));
-      cur->next = new_token(TK_IDENT, start, p);
-      cur = cur->next;
-      continue;
+      new_token(lex, tok, TK_IDENT, start, p);
+      return;
     }
 
     // 解析操作符
     int punct_len = read_punct(p);
     if (punct_len) {
-      cur->next = new_token(TK_PUNCT, p, p + punct_len);
-      cur = cur->next;
-      p += punct_len;
-      continue;
+      new_token(lex, tok, TK_PUNCT, p, p + punct_len);
+      return;
     }
 
     error_at(p, "invalid token");
   }
 
-  // 解析结束之后追加一个 EOF
-  cur->next = new_token(TK_EOF, p, p);
+  // 解析结束之后返回 EOF，保留 EOF 之前的标志
+  int flags = lex->flags;
+  new_token(lex, tok, TK_EOF, p, p);
+  lex->flags = flags;
+}
+
+// 终结符解析
+// 返回文件的预处理终结符数组，以 TK_EOF 结尾
+// 终结符的位置相对于文件的起始位置，与文件在源码空间中的位置无关
+PPToken *tokenize(SourceFile *file) {
+  Lexer lex;
+  init_lexer(&lex, file);
+
+  PPToken *toks = NULL;
+  int len = 0, cap = 0;
+  do {
+    if (len == cap) {
+      cap = cap ? cap * 2 : 1024;
+      toks = grow_array(toks, len, cap, sizeof(PPToken));
+    }
+    lex_token(&lex, &toks[len]);
+  } while (toks[len++].kind != TK_EOF);
+  return toks;
+}
+
+// 相对路径所相对的目录，为 NULL 时相对于进程的当前目录
+static _Thread_local char *WORK_DIR;
+
+// 设置当前线程访问文件时相对路径所相对的目录
+void set_work_dir(char *dir) { WORK_DIR = dir; }
+
+// 返回访问 path 时实际使用的路径
+// 文件名仍保持原样，生成的代码与在 WORK_DIR 中直接编译时相同
+char *resolve_path(char *path) {
+  if (!WORK_DIR || path[0] == '/')
+    return path;
+  return format("%s/%s", WORK_DIR, path);
+}
 
-  // 为所有token增加行号
-  add_line_numbers(head.next);
-  // 将所有keyword字符token类型修改为keyword
-  convert_keywords(head.next);
+// 返回当前线程的源文件表、终结符流及相对路径所相对的目录
+SourceState get_source_state(void) {
+  return (SourceState){FILES, FILES_LEN, &TOKENS, WORK_DIR};
+}
+
+// 返回 token 加入终结符流时的源文件表，不含终结符流
+SourceState source_state_at(Token token) {
+  // 二分查找最后一条序号不超过 token 的记录
+  int lo = 0, hi = FILE_MARKS_LEN;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (FILE_MARKS[mid].token <= token)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  int nfiles = lo ? FILE_MARKS[lo - 1].nfiles : 0;
+  return (SourceState){FILES, nfiles, NULL, WORK_DIR};
+}
 
-  // head 实际是一个 dummy head
-  return head.next;
+// 当前线程改为使用 state 中的源文件表、终结符流及目录，
+// 只用于查询源码位置及读取已预处理的终结符
+void use_source_state(SourceState state) {
+  FILES = state.files;
+  FILES_LEN = state.len;
+  LAST_FILE = NULL;
+  WORK_DIR = state.work_dir;
+  if (!state.tokens)
+    return;
+
+  // 只复制数组的指针，各线程只读地访问同一组数组
+  TOKENS = *state.tokens;
+  TOKENS.keep = TOKENS.borrowed = true;
 }
 
-// 从文件中读取文本到字符数组中
+// 从文件中读取文本到字符数组中，文件无法打开时返回 NULL
 static char *read_file(char *path) {
   FILE *in;
 
@@ -400,9 +993,9 @@ static char *read_file(char *path) {
     // 文件名为 "-" 时，从stdin读取文本
     in = stdin;
   } else {
-    in = fopen(path, "r");
+    in = fopen(resolve_path(path), "r");
     if (!in)
-      error("can't open %s: %s", path, strerror(errno));
+      return NULL;
   }
 
   char *buf;
@@ -432,8 +1025,71 @@ static char *read_file(char *path) {
 
   // 满足字符串以 `\0` 结尾的要求
   fputc('\0', out);
+  fclose(out);
 
   return buf;
 }
 
-Token *tokenize_file(char *path) { return tokenize(path, read_file(path)); }
\ No newline at end of file
+// 在源码空间中登记源文件
+// line_starts 为 NULL 时由文件内容计算每一行的起始位置
+SourceFile *new_source_file(char *path, char *contents, uint32_t *line_starts,
+                            int line_len) {
+  SourceFile *file = add_file(path, contents, 0);
+  file->file_no = ++FILE_COUNT;
+
+  if (line_starts) {
+    file->line_starts = line_starts;
+    file->line_len = line_len;
+  } else {
+    // 记录行起始位置，用于计算token的行号
+    add_line_numbers(file);
+  }
+  return file;
+}
+
+// 读取源文件并在源码空间中登记，文件无法打开时返回 NULL
+SourceFile *read_source_file(char *path) {
+  char *buf = read_file(path);
+  if (!buf)
+    return NULL;
+
+  // 内容随区域一起释放
+  char *contents = arena_alloc(ARENA_TOKEN, strlen(buf) + 1);
+  strcpy(contents, buf);
+  free(buf);
+  return new_source_file(path, contents, NULL, 0);
+}
+
+// 在源码空间中登记内存中的源码，len 为源码的长度
+SourceFile *new_source_buffer(char *name, char *buf, size_t len) {
+  // 与 read_file 相同，保证以 `\n` 和 `\0` 结尾
+  char *contents = arena_alloc(ARENA_TOKEN, len + 2);
+  memcpy(contents, buf, len);
+  if (len == 0 || buf[len - 1] != '\n')
+    contents[len] = '\n';
+  return new_source_file(name, contents, NULL, 0);
+}
+
+// 释放终结符流，清空源文件表，以便同一线程编译下一个文件
+void tokenize_reset(void) {
+  // 借用的数组由其所属的线程释放
+  if (!TOKENS.borrowed) {
+    free(TOKENS.kinds);
+    free(TOKENS.flags);
+    free(TOKENS.locs);
+    free(TOKENS.lens);
+  }
+  TOKENS = (TokenStream){};
+
+  // 源文件表及字面量侧表都分配在区域中
+  CUR_FILE = LAST_FILE = NULL;
+  FILES = NULL;
+  FILES_LEN = FILES_CAP = 0;
+  NEXT_BASE = 0;
+  FILE_COUNT = 0;
+  FILE_MARKS = NULL;
+  FILE_MARKS_LEN = FILE_MARKS_CAP = FILE_MARKS_SENT = 0;
+  FETCH_TOKENS = NULL;
+  FETCH_ERROR = NULL;
+  FETCH_EOF = (PPToken){};
+}
@@ -1,118 +1,154 @@
 #include "rvcc.h"
+#include <pthread.h>
 
 // 复合字面量声明了一个仅初始化了 kind 的匿名Type结构体，使用TYPE_INT指向他
 Type *TYPE_INT = &(Type){TY_INT, 8};
 Type *TYPE_CHAR = &(Type){TY_CHAR, 1};
 
+// 是否在语法分析后校验语法树的类型(--verify-types)
+_Thread_local bool OPT_VERIFY_TYPES;
+
 // 判断是否为 Type int
 // 目前将 char 也视为 int
 bool is_integer(Type *type) {
   return type->kind == TY_INT || type->kind == TY_CHAR;
 }
 
-// 复制类型
-// 浅拷贝，仅复制栈上数据
-Type *copy_type(Type *type) {
-  Type *rlt = calloc(1, sizeof(Type));
-  *rlt = *type;
+// 规范类型的键
+//
+// 相同的 (kind, base, len, params) 只对应一个规范的 Type，
+// 因此判断类型是否相同只需比较指针
+typedef struct {
+  TypeKind kind;  // 类型
+  int len;        // 数组的长度；函数形参的数量
+  Type *base;     // 指针、数组的基类；函数的返回值类型
+  Type *params[]; // 函数的形参类型
+} TypeKey;
+
+// 所有规范类型，键为 TypeKey
+// 类型分配在 ARENA_TYPE 中，同一线程之后的编译也继续使用
+static _Thread_local HashMap TYPES;
+
+// 多个线程共用的规范类型表
+struct SharedTypes {
+  HashMap *map;         // 发起共用的线程的 TYPES
+  pthread_mutex_t lock; // 保护 map
+};
+
+// 当前线程共用的规范类型表，为 NULL 时使用本线程的 TYPES
+static _Thread_local SharedTypes *SHARED_TYPES;
 
-  return rlt;
+// 当前线程的规范类型表开始由多个线程共用，返回供其他线程使用的句柄
+// 共用期间各线程构造的类型仍是同一个，类型的比较不受影响
+SharedTypes *share_types(void) {
+  SharedTypes *shared = calloc(1, sizeof(SharedTypes));
+  if (!shared)
+    error("out of memory");
+  shared->map = &TYPES;
+  pthread_mutex_init(&shared->lock, NULL);
+  SHARED_TYPES = shared;
+  return shared;
 }
 
-// 创建一个指针类型，并指向 base
-Type *pointer_type(Type *base) {
-  Type *type = calloc(1, sizeof(Type));
-  type->kind = TY_PTR;
-  type->size = 8;
-  type->base = base;
+// 当前线程改为使用共用的规范类型表，为 NULL 时恢复使用本线程的表
+void use_shared_types(SharedTypes *shared) { SHARED_TYPES = shared; }
 
-  return type;
+// 其他线程都已不再使用后，结束共用当前线程的规范类型表
+void unshare_types(SharedTypes *shared) {
+  SHARED_TYPES = NULL;
+  pthread_mutex_destroy(&shared->lock);
+  free(shared);
 }
 
-// 创建一个函数类型， 且返回值为ret_type
-Type *func_type(Type *ret_type) {
-  Type *type = calloc(1, sizeof(Type));
-  type->kind = TY_FUNC;
-  type->ret_type = ret_type;
+// 在 map 中查找 key 对应的规范类型，不存在则以 type 为模板构造一个
+// 新构造的类型分配在当前线程的区域中
+static Type *intern_in(HashMap *map, TypeKey *key, int nparams, Type *type) {
+  int keylen = sizeof(TypeKey) + nparams * sizeof(Type *);
+
+  Type *canon = hashmap_get2(map, (char *)key, keylen);
+  if (canon)
+    return canon;
+
+  // 键需与规范类型存续同样长的时间
+  TypeKey *saved = arena_alloc(ARENA_TYPE, keylen);
+  memcpy(saved, key, keylen);
 
-  return type;
+  canon = arena_alloc(ARENA_TYPE, sizeof(Type));
+  *canon = *type;
+  // 函数的形参数组直接使用键中保存的副本
+  if (nparams)
+    canon->params = saved->params;
+  hashmap_put2(map, (char *)saved, keylen, canon);
+  return canon;
 }
 
-// 创建一个数组类型, 基类为 base， 长度为 len
-Type *array_type(Type *base, int len) {
-  Type *type = calloc(1, sizeof(Type));
+// 返回 key 对应的规范类型，不存在则以 type 为模板构造一个新的规范类型
+static Type *intern_type(TypeKey *key, int nparams, Type *type) {
+  if (!SHARED_TYPES)
+    return intern_in(&TYPES, key, nparams, type);
 
-  type->kind = TY_ARRAY;
-  type->base = base;
-  type->size = base->size * len;
-  type->len = len;
+  pthread_mutex_lock(&SHARED_TYPES->lock);
+  Type *canon = intern_in(SHARED_TYPES->map, key, nparams, type);
+  pthread_mutex_unlock(&SHARED_TYPES->lock);
+  return canon;
+}
 
-  return type;
+// 创建一个指针类型，并指向 base
+Type *pointer_type(Type *base) {
+  TypeKey key = {TY_PTR, 0, base};
+  Type type = {TY_PTR, 8};
+  type.base = base;
+  return intern_type(&key, 0, &type);
 }
 
-// 遍历 AST 并为所有 expr 及以下 NODE 增加类型
-void add_type(Node *node) {
-  // 节点为空，或者类型已经设置
-  if (!node || node->type)
-    return;
+// 创建一个函数类型， 且返回值为ret_type，形参为 params[0..nparams)
+Type *func_type(Type *ret_type, Type **params, int nparams) {
+  TypeKey *key = calloc(1, sizeof(TypeKey) + nparams * sizeof(Type *));
+  *key = (TypeKey){TY_FUNC, nparams, ret_type};
+  memcpy(key->params, params, nparams * sizeof(Type *));
 
-  // 递归访问所有的子节点
-  switch (node->kind) {
-  case ND_ADD:
-  case ND_SUB:
-  case ND_MUL:
-  case ND_DIV:
-  case ND_NEG:
-  case ND_ASSIGN:
-  case ND_EQ:
-  case ND_NE:
-  case ND_LT:
-  case ND_LE:
-  case ND_RETURN:
-  case ND_ADDR:
-  case ND_DEREF:
-  case ND_EXPR_STMT:
-    add_type(node->lhs);
-    add_type(node->rhs);
-    break;
-  case ND_IF:
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->els);
-    break;
-  case ND_FOR:
-    add_type(node->cond);
-    add_type(node->then);
-    add_type(node->init);
-    add_type(node->inc);
-    break;
-  case ND_FNCALL:
-    // 访问所有参数以增加类型
-    for (Node *n = node->args; n; n = n->next)
-      add_type(n);
-    break;
-  case ND_BLOCK:
-    // 遍历 stmt 链表
-    for (Node *n = node->body; n; n = n->next)
-      add_type(n);
-  default: // ND_VAR, ND_NUM
-    break;
-  }
+  Type type = {TY_FUNC};
+  type.ret_type = ret_type;
+  type.nparams = nparams;
+  Type *canon = intern_type(key, nparams, &type);
+
+  free(key);
+  return canon;
+}
+
+// 创建一个数组类型, 基类为 base， 长度为 len
+Type *array_type(Type *base, int len) {
+  TypeKey key = {TY_ARRAY, len, base};
+  Type type = {TY_ARRAY, base->size * len};
+  type.base = base;
+  type.len = len;
+  return intern_type(&key, 0, &type);
+}
 
+// 根据子节点的类型计算节点的类型
+// 子节点总是先于父节点构造，因此计算时子节点的类型都已确定
+static Type *node_type(NodePool *pool, Node *node) {
   switch (node->kind) {
+  case ND_SUB: {
+    // ptr - ptr 的结果为两指针间的元素个数，类型为 INT
+    Type *lhs = node_at(pool, node->lhs)->type;
+    Type *rhs = node_at(pool, node->rhs)->type;
+    if (lhs->base && rhs->base)
+      return TYPE_INT;
+    return lhs;
+  }
   case ND_ADD:
-  case ND_SUB:
   case ND_MUL:
   case ND_DIV:
   case ND_NEG:
-    node->type = node->lhs->type;
-    return;
-  case ND_ASSIGN:
-    if (node->lhs->type->kind == TY_ARRAY) // 暂不允许对数组直接赋值
-      error_token(node->lhs->token, "not an lvalue");
+    return node_at(pool, node->lhs)->type;
+  case ND_ASSIGN: {
+    Node *lhs = node_at(pool, node->lhs);
+    if (lhs->type->kind == TY_ARRAY) // 暂不允许对数组直接赋值
+      error_srcloc(lhs->loc, "not an lvalue");
     // ADD、SUB、MUL、DIV、NEG、ASSIGN都与左子节点(单臂)的类型相同
-    node->type = node->lhs->type;
-    return;
+    return lhs->type;
+  }
   case ND_EQ:
   case ND_NE:
   case ND_LT:
@@ -120,47 +156,124 @@ void add_type(Node *node) {
   case ND_NUM:
   case ND_FNCALL:
     // EQ、NE、LT、LE、VAR、NUM、FNCALL都设置为 TYPE_INT
-    node->type = TYPE_INT;
-    return;
+    return TYPE_INT;
   case ND_VAR:
     // 变量节点的类型与变量节点中保存的 Object Var 的类型相同
-    node->type = node->var->type;
-    return;
+    return node->var->type;
   case ND_ADDR: {
-    Type *type = node->lhs->type;
+    Type *type = node_at(pool, node->lhs)->type;
 
     // 取地址节点的类型根据单臂所指向节点的类型来决定
     // 如果是数组，&的结果为指向 base 的指针
     if (type->kind == TY_ARRAY)
-      node->type = pointer_type(type->base);
-    else
-      node->type = pointer_type(type);
-    return;
+      return pointer_type(type->base);
+    return pointer_type(type);
   }
-  case ND_DEREF:
+  case ND_DEREF: {
+    Type *type = node_at(pool, node->lhs)->type;
+
     // ND_DEREF 的单臂必须有基类
-    if (!node->lhs->type->base)
-      error_token(node->token, "invalid pointer dereference");
+    if (!type->base)
+      error_srcloc(node->loc, "invalid pointer dereference");
 
     // ND_DEREF 的类型为指针指向的类型
-    node->type = node->lhs->type->base;
-    return;
+    return type->base;
+  }
   case ND_STMT_EXPR:
     // ND_STMT_EXPR类型为其中最后一个ND_EXPR_STMT lhs的类型
-    if (node->body) {
-      Node *stmt = node->body;
-      while (stmt->next)
-        stmt = stmt->next;
-      if (stmt->kind == ND_EXPR_STMT) {
-        node->type = stmt->lhs->type;
-        return;
-      }
+    if (node->nkids) {
+      Node *stmt = node_at(pool, node_kid(pool, node, node->nkids - 1));
+      if (stmt->kind == ND_EXPR_STMT)
+        return node_at(pool, stmt->lhs)->type;
     }
 
-    error_token(node->token,
-                "statement expression returning void is not supported");
+    error_srcloc(node->loc,
+                 "statement expression returning void is not supported");
+    return NULL;
+  default: // 语句没有类型
+    return NULL;
+  }
+}
+
+// 为刚构造完成的节点增加类型
+// 每个节点只在构造时计算一次类型，无需重复遍历子树
+void add_type(NodePool *pool, NodeId id) {
+  Node *node = node_at(pool, id);
+  node->type = node_type(pool, node);
+}
+
+// 校验类型时使用的栈
+static _Thread_local NodeId *VERIFY_STACK;
+static _Thread_local int VERIFY_LEN;
+static _Thread_local int VERIFY_CAP;
+
+// 将待校验的节点压栈，空节点直接忽略
+static void push_verify(NodeId id) {
+  if (!id)
     return;
-  default:
-    break;
+  if (VERIFY_LEN == VERIFY_CAP) {
+    VERIFY_CAP = VERIFY_CAP ? VERIFY_CAP * 2 : 64;
+    VERIFY_STACK = realloc(VERIFY_STACK, sizeof(NodeId) * VERIFY_CAP);
+    if (!VERIFY_STACK)
+      error("out of memory");
+  }
+  VERIFY_STACK[VERIFY_LEN++] = id;
+}
+
+// 遍历 AST，校验所有节点的类型与由子节点重新计算的结果一致
+// 类型是规范化的，直接比较指针即可
+// 使用显式的栈遍历，不受语法树深度的限制
+void verify_types(NodePool *pool, NodeId id) {
+  push_verify(id);
+
+  while (VERIFY_LEN > 0) {
+    Node *node = node_at(pool, VERIFY_STACK[--VERIFY_LEN]);
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_NEG:
+    case ND_ASSIGN:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+    case ND_RETURN:
+    case ND_ADDR:
+    case ND_DEREF:
+    case ND_EXPR_STMT:
+      push_verify(node->lhs);
+      push_verify(node->rhs);
+      break;
+    case ND_IF:
+    case ND_FOR:
+    case ND_FNCALL:
+    case ND_BLOCK:
+    case ND_STMT_EXPR:
+      // 访问所有子节点(条件、分支、参数、语句)
+      for (int i = 0; i < node->nkids; i++)
+        push_verify(node_kid(pool, node, i));
+    default: // ND_VAR, ND_NUM
+      break;
+    }
+
+    if (node->type != node_type(pool, node))
+      error_srcloc(node->loc, "internal error: inconsistent node type");
   }
-}
\ No newline at end of file
+}
+
+// 结束一次编译，以便同一线程编译下一个文件
+// 规范类型与源码位置无关，保留给之后的编译继续使用
+void type_reset(void) {
+  SHARED_TYPES = NULL;
+  free(VERIFY_STACK);
+  VERIFY_STACK = NULL;
+  VERIFY_LEN = VERIFY_CAP = 0;
+}
+
+// 清空规范类型表，之后即可释放或交出 ARENA_TYPE 中的类型
+void type_release(void) {
+  type_reset();
+  hashmap_free(&TYPES);
+}